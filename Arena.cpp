@@ -0,0 +1,120 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define RT_HAVE_MMAP
+#include <sys/mman.h>
+#endif
+
+#include "Arena.h"
+
+Arena::Arena(bool hugePages, size_t blockBytes) :
+        cursor(nullptr), end(nullptr), blockBytes(blockBytes), hugePages(hugePages), usedBytes(), reservedBytes(0),
+        hugePageBytes(0) {
+}
+
+Arena::~Arena() {
+    for (auto it = destructors.rbegin(); it != destructors.rend(); ++it) {
+        it->first(it->second);
+    }
+    for (const Block &block : blocks) {
+#ifdef RT_HAVE_MMAP
+        if (block.mapped) {
+            munmap(block.memory, block.bytes);
+            continue;
+        }
+#endif
+        delete[] block.memory;
+    }
+}
+
+void Arena::addBlock(size_t minBytes) {
+    Block block;
+    block.bytes = std::max(blockBytes, minBytes);
+    block.mapped = false;
+    block.advised = false;
+#ifdef RT_HAVE_MMAP
+    if (hugePages) {
+        block.bytes = (block.bytes + HugePageSize - 1) / HugePageSize * HugePageSize;
+        void *memory = MAP_FAILED;
+#ifdef MAP_HUGETLB
+        memory = mmap(nullptr, block.bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (memory != MAP_FAILED) {
+            hugePageBytes += block.bytes;
+        }
+#endif
+        if (memory == MAP_FAILED) {
+            // no reserved huge pages: map a huge page aligned range and let the kernel back it with transparent ones
+            size_t bytes = block.bytes + HugePageSize;
+            unsigned char *range = (unsigned char *) mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+                                                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (range != MAP_FAILED) {
+                size_t head = (HugePageSize - (uintptr_t) range % HugePageSize) % HugePageSize;
+                if (head > 0) {
+                    munmap(range, head);
+                }
+                munmap(range + head + block.bytes, bytes - head - block.bytes);
+                memory = range + head;
+#ifdef MADV_HUGEPAGE
+                block.advised = madvise(memory, block.bytes, MADV_HUGEPAGE) == 0;
+#endif
+            }
+        }
+        if (memory != MAP_FAILED) {
+            block.memory = (unsigned char *) memory;
+            block.mapped = true;
+        }
+    }
+#endif
+    if (!block.mapped) {
+        block.memory = new unsigned char[block.bytes];
+    }
+    blocks.push_back(block);
+    reservedBytes += block.bytes;
+    cursor = block.memory;
+    end = block.memory + block.bytes;
+}
+
+void *Arena::allocate(size_t bytes, ArenaCategory category, size_t alignment) {
+    size_t padding = (alignment - (uintptr_t) cursor % alignment) % alignment;
+    if (cursor == nullptr || bytes + padding > (size_t) (end - cursor)) {
+        addBlock(bytes + alignment);
+        padding = (alignment - (uintptr_t) cursor % alignment) % alignment;
+    }
+    void *result = cursor + padding;
+    cursor += padding + bytes;
+    usedBytes[category] += bytes;
+    return result;
+}
+
+size_t Arena::getHugePageBytes() const {
+    size_t bytes = hugePageBytes;
+#ifdef __linux__
+    if (std::none_of(blocks.begin(), blocks.end(), [](const Block &block) { return block.advised; })) {
+        return bytes;
+    }
+    FILE *smaps = std::fopen("/proc/self/smaps", "r");
+    if (smaps == nullptr) {
+        return bytes;
+    }
+    // The advised flag splits the mappings at the block boundaries, so a mapping starting inside an advised block
+    // holds only advised memory. Its AnonHugePages line follows the range line.
+    char line[256];
+    bool inBlock = false;
+    while (std::fgets(line, sizeof(line), smaps) != nullptr) {
+        unsigned long long start, end;
+        size_t kib;
+        if (std::sscanf(line, "%llx-%llx ", &start, &end) == 2) {
+            inBlock = std::any_of(blocks.begin(), blocks.end(), [&](const Block &block) {
+                return block.advised && (uintptr_t) block.memory <= start &&
+                       start < (uintptr_t) block.memory + block.bytes;
+            });
+        } else if (inBlock && std::sscanf(line, "AnonHugePages: %zu kB", &kib) == 1) {
+            bytes += kib * 1024;
+        }
+    }
+    std::fclose(smaps);
+#endif
+    return bytes;
+}
@@ -0,0 +1,131 @@
+#ifndef RT_ARENA_H
+#define RT_ARENA_H
+
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+enum ArenaCategory {
+    // objects keep their materials by value, so these include them
+    ArenaPrimitives,
+    // BVH nodes and the object lists they reference
+    ArenaNodes,
+    ArenaCategoriesCount
+};
+
+// Memory of a scene: objects are bump-allocated from large blocks, each on a cache line of its own, so a loader
+// creating primitives one by one gets them packed in creation order instead of scattered over the heap. Nothing is
+// freed before the arena goes away, then the objects are destroyed in reverse order and the blocks released at once.
+// With hugePages the blocks are 2 MiB pages if the system has some reserved, otherwise transparent huge pages are
+// asked for. Allocation is not thread safe.
+class Arena {
+public:
+    static constexpr size_t CacheLineSize = 64;
+    static constexpr size_t HugePageSize = 2 << 20;
+
+private:
+    struct Block {
+        unsigned char *memory;
+        size_t bytes;
+        bool mapped;
+        // left to transparent huge pages, the kernel may back it with small ones
+        bool advised;
+    };
+
+    std::vector<Block> blocks;
+    std::vector<std::pair<void (*)(void *), void *>> destructors;
+    unsigned char *cursor, *end;
+    size_t blockBytes;
+    bool hugePages;
+    size_t usedBytes[ArenaCategoriesCount];
+    size_t reservedBytes, hugePageBytes;
+
+    void addBlock(size_t minBytes);
+
+    template<typename T>
+    static void destroy(void *object) {
+        static_cast<T *>(object)->~T();
+    }
+
+public:
+    explicit Arena(bool hugePages = false, size_t blockBytes = HugePageSize);
+
+    Arena(const Arena &) = delete;
+
+    Arena &operator=(const Arena &) = delete;
+
+    ~Arena();
+
+    void *allocate(size_t bytes, ArenaCategory category, size_t alignment = CacheLineSize);
+
+    template<typename T, typename... Args>
+    T *make(ArenaCategory category, Args &&... args) {
+        T *object = new(allocate(sizeof(T), category)) T(std::forward<Args>(args)...);
+        if (!std::is_trivially_destructible<T>::value) {
+            destructors.emplace_back(&destroy<T>, object);
+        }
+        return object;
+    }
+
+    size_t getUsedBytes(ArenaCategory category) const {
+        return usedBytes[category];
+    }
+
+    // everything taken from the system, including the unused tail of the last block
+    size_t getReservedBytes() const {
+        return reservedBytes;
+    }
+
+    // Bytes actually backed by huge pages: the reserved ones the blocks got, and the transparent ones the kernel has
+    // given the others so far, as /proc/self/smaps reports them.
+    size_t getHugePageBytes() const;
+};
+
+// Standard allocator drawing from an arena, or from the heap when there is none. Deallocation is left to the arena,
+// so containers that grow leave their old storage behind: reserve them up front.
+template<typename T>
+class ArenaAllocator {
+public:
+    typedef T value_type;
+    typedef std::true_type propagate_on_container_copy_assignment;
+    typedef std::true_type propagate_on_container_move_assignment;
+    typedef std::true_type propagate_on_container_swap;
+
+    Arena *arena;
+    ArenaCategory category;
+
+    ArenaAllocator(Arena *arena = nullptr, ArenaCategory category = ArenaNodes) : arena(arena), category(category) {
+    }
+
+    template<typename U>
+    ArenaAllocator(const ArenaAllocator<U> &other) : arena(other.arena), category(other.category) {
+    }
+
+    T *allocate(size_t n) {
+        return arena ? static_cast<T *>(arena->allocate(n * sizeof(T), category)) : std::allocator<T>().allocate(n);
+    }
+
+    void deallocate(T *p, size_t n) {
+        if (!arena) {
+            std::allocator<T>().deallocate(p, n);
+        }
+    }
+};
+
+template<typename T, typename U>
+bool operator==(const ArenaAllocator<T> &a, const ArenaAllocator<U> &b) {
+    return a.arena == b.arena;
+}
+
+template<typename T, typename U>
+bool operator!=(const ArenaAllocator<T> &a, const ArenaAllocator<U> &b) {
+    return a.arena != b.arena;
+}
+
+template<typename T>
+using ArenaVector = std::vector<T, ArenaAllocator<T>>;
+
+#endif //RT_ARENA_H
@@ -1,6 +1,9 @@
 #include <vector>
 #include <fstream>
 #include <cstring>
+#include <cstdlib>
+
+#include "Bitmap.h"
 
 struct Pixel {
     unsigned char r, g, b;
@@ -46,4 +49,77 @@ void SaveBMP(const char *fname, const unsigned int *pixels, int w, int h) {
     }
 
     WriteBMP(fname, &pixels2[0], w, h);
-}
\ No newline at end of file
+}
+static int readLE(const unsigned char *bytes, int count) {
+    int value = 0;
+    for (int i = count - 1; i >= 0; --i) {
+        value = (value << 8) | bytes[i];
+    }
+    return value;
+}
+
+bool BMPReader::open(const char *fname) {
+    in.open(fname, std::ios::in | std::ios::binary);
+    unsigned char bmpfileheader[14];
+    unsigned char bmpinfoheader[40];
+    if (!in.read((char *) bmpfileheader, 14) || !in.read((char *) bmpinfoheader, 40) ||
+        bmpfileheader[0] != 'B' || bmpfileheader[1] != 'M') {
+        return false;
+    }
+
+    offset = readLE(bmpfileheader + 10, 4);
+    width = readLE(bmpinfoheader + 4, 4);
+    height = readLE(bmpinfoheader + 8, 4);
+    int bpp = readLE(bmpinfoheader + 14, 2);
+    int compression = readLE(bmpinfoheader + 16, 4);
+    if (width <= 0 || height == 0 || (bpp != 24 && bpp != 32) || (compression != 0 && compression != 3)) {
+        return false;
+    }
+
+    topDown = height < 0;
+    height = std::abs(height);
+    bytesPerPixel = bpp / 8;
+    // SaveBMP writes tightly packed rows, other writers pad them to 4 bytes
+    int rowSize = readLE(bmpfileheader + 2, 4) == width * height * bytesPerPixel ? width * bytesPerPixel
+                                                                                 : (width * bytesPerPixel + 3) & ~3;
+    row.resize(rowSize);
+    next = 0;
+    return true;
+}
+
+bool BMPReader::readRow(unsigned char *rgb) {
+    int fileRow = topDown ? next : height - next - 1;
+    in.seekg(offset + (std::streamoff) fileRow * row.size());
+    if (next >= height || !in.read((char *) row.data(), row.size())) {
+        return false;
+    }
+    ++next;
+    for (int j = 0; j < width; ++j) {
+        const unsigned char *px = &row[j * bytesPerPixel];
+        rgb[3 * j] = px[2];
+        rgb[3 * j + 1] = px[1];
+        rgb[3 * j + 2] = px[0];
+    }
+    return true;
+}
+
+bool LoadBMP(const char *fname, std::vector<unsigned int> &pixels, int &w, int &h) {
+    BMPReader reader;
+    if (!reader.open(fname)) {
+        return false;
+    }
+    std::vector<unsigned char> rgb(reader.width * 3);
+    pixels.assign(reader.width * reader.height, 0);
+    for (int i = 0; i < reader.height; ++i) {
+        if (!reader.readRow(rgb.data())) {
+            return false;
+        }
+        unsigned int *dst = &pixels[(reader.height - i - 1) * reader.width];
+        for (int j = 0; j < reader.width; ++j) {
+            dst[j] = rgb[3 * j] | (rgb[3 * j + 1] << 8) | (rgb[3 * j + 2] << 16);
+        }
+    }
+    w = reader.width;
+    h = reader.height;
+    return true;
+}
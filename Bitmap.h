@@ -1,6 +1,28 @@
 #ifndef BITMAP_GUARDIAN_H
 #define BITMAP_GUARDIAN_H
 
+#include <fstream>
+#include <vector>
+
 void SaveBMP(const char *fname, const unsigned int *pixels, int w, int h);
 
+// Reads an uncompressed 24 or 32 bit BMP one row at a time, top row first, without holding the whole image.
+class BMPReader {
+    std::ifstream in;
+    std::vector<unsigned char> row;
+    int offset, bytesPerPixel, next;
+    bool topDown;
+
+public:
+    int width, height;
+
+    bool open(const char *fname);
+
+    // Reads the next row as 8-bit R, G, B triples.
+    bool readRow(unsigned char *rgb);
+};
+
+// Reads an uncompressed 24 or 32 bit BMP into the same packed layout SaveBMP expects.
+bool LoadBMP(const char *fname, std::vector<unsigned int> &pixels, int &w, int &h);
+
 #endif 
@@ -0,0 +1,62 @@
+#include <algorithm>
+
+#include "Bvh.h"
+
+constexpr unsigned int MaxLeafSize = 4;
+
+Bvh::Bvh(const std::vector<const BasicObject *> &objects, Arena *arena) :
+        nodes(ArenaAllocator<Node>(arena, ArenaNodes)),
+        objects(objects.begin(), objects.end(), ArenaAllocator<const BasicObject *>(arena, ArenaNodes)) {
+    if (objects.empty()) {
+        return;
+    }
+    std::vector<Bounds> bounds(objects.size());
+    for (size_t i = 0; i < objects.size(); ++i) {
+        bounds[i] = objects[i]->getBounds();
+    }
+    nodes.reserve(2 * objects.size());
+    build(bounds, 0, objects.size());
+}
+
+unsigned int Bvh::build(std::vector<Bounds> &bounds, unsigned int begin, unsigned int end) {
+    unsigned int index = nodes.size();
+    nodes.push_back(Node());
+    Bounds nodeBounds, centers;
+    for (unsigned int i = begin; i < end; ++i) {
+        nodeBounds.grow(bounds[i]);
+        centers.grow(bounds[i].center());
+    }
+    nodes[index].bounds = nodeBounds;
+    if (end - begin <= MaxLeafSize) {
+        nodes[index].start = begin;
+        nodes[index].count = end - begin;
+        return index;
+    }
+
+    // median split along the widest extent of the object centers
+    Point extent = centers.max - centers.min;
+    unsigned int axis = extent[0] > extent[1] ? (extent[0] > extent[2] ? 0 : 2) : (extent[1] > extent[2] ? 1 : 2);
+    std::vector<unsigned int> order(end - begin);
+    for (unsigned int i = 0; i < order.size(); ++i) {
+        order[i] = begin + i;
+    }
+    unsigned int middle = order.size() / 2;
+    std::nth_element(order.begin(), order.begin() + middle, order.end(), [&](unsigned int a, unsigned int b) {
+        return bounds[a].center()[axis] < bounds[b].center()[axis];
+    });
+    std::vector<const BasicObject *> sortedObjects(order.size());
+    std::vector<Bounds> sortedBounds(order.size());
+    for (unsigned int i = 0; i < order.size(); ++i) {
+        sortedObjects[i] = objects[order[i]];
+        sortedBounds[i] = bounds[order[i]];
+    }
+    std::copy(sortedObjects.begin(), sortedObjects.end(), objects.begin() + begin);
+    std::copy(sortedBounds.begin(), sortedBounds.end(), bounds.begin() + begin);
+
+    build(bounds, begin, begin + middle);
+    unsigned int second = build(bounds, begin + middle, end);
+    nodes[index].start = second;
+    nodes[index].count = 0;
+    nodes[index].axis = axis;
+    return index;
+}
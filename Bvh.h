@@ -0,0 +1,70 @@
+#ifndef RT_BVH_H
+#define RT_BVH_H
+
+#include <vector>
+
+#include "Arena.h"
+#include "mygeometry.h"
+
+// Bounding volume hierarchy over objects with finite bounds. Nodes and the object list are taken from arena if given.
+class Bvh {
+    struct Node {
+        Bounds bounds;
+        // leaves reference count objects starting at start, inner nodes keep their first child right after
+        // themselves and the second one at start
+        unsigned int start;
+        unsigned int count;
+        unsigned int axis;
+    };
+
+    ArenaVector<Node> nodes;
+    ArenaVector<const BasicObject *> objects;
+
+    unsigned int build(std::vector<Bounds> &bounds, unsigned int begin, unsigned int end);
+
+public:
+    explicit Bvh(const std::vector<const BasicObject *> &objects = {}, Arena *arena = nullptr);
+
+    Bounds getBounds() const {
+        return nodes.empty() ? Bounds() : nodes[0].bounds;
+    }
+
+    const ArenaVector<const BasicObject *> &getObjects() const {
+        return objects;
+    }
+
+    // Calls visit for every object whose node is crossed by the ray before tMax, nearest nodes first.
+    // visit may shrink tMax, which prunes the rest of the traversal, and stops it by returning true.
+    template<typename Visitor>
+    void traverse(const Point &beamPoint, const Point &direction, const Real &tMax, Visitor visit) const {
+        if (nodes.empty()) {
+            return;
+        }
+        Point invDir(1.0 / direction[0], 1.0 / direction[1], 1.0 / direction[2]);
+        unsigned int stack[64];
+        int top = 0;
+        stack[top++] = 0;
+        while (top > 0) {
+            unsigned int index = stack[--top];
+            const Node &node = nodes[index];
+            if (!node.bounds.areIntersected(beamPoint, invDir, tMax)) {
+                continue;
+            }
+            if (node.count > 0) {
+                for (unsigned int i = node.start; i < node.start + node.count; ++i) {
+                    if (visit(objects[i])) {
+                        return;
+                    }
+                }
+            } else if (direction[node.axis] < 0) {
+                stack[top++] = index + 1;
+                stack[top++] = node.start;
+            } else {
+                stack[top++] = node.start;
+                stack[top++] = index + 1;
+            }
+        }
+    }
+};
+
+#endif //RT_BVH_H
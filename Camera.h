@@ -0,0 +1,138 @@
+#ifndef RT_CAMERA_H
+#define RT_CAMERA_H
+
+#include <algorithm>
+#include <vector>
+
+#include "mygeometry.h"
+
+// Pinhole camera, the default one sits at the origin and looks down -z with a 60 degree vertical field of view.
+// A panorama camera maps the whole sphere around it to the image instead: longitude along x with the view direction
+// in the middle, latitude along y.
+class Camera {
+public:
+    enum Projection {
+        Perspective,
+        Equirectangular
+    };
+
+private:
+    Point position;
+    Point forward, right, up;
+    Real tanHalfFov;
+    Projection projection;
+
+public:
+    explicit Camera(const Point &position = Point(), const Point &target = Point(0, 0, -1),
+                    const Point &upHint = Point(0, 1, 0), Real fov = M_PI / 3.0) :
+            position(position), tanHalfFov(tan(fov / 2.0)), projection(Perspective) {
+        forward = (target - position).normalized();
+        right = forward.cross(upHint).normalized();
+        up = right.cross(forward);
+    }
+
+    // 360 degree view meant for images twice as wide as high.
+    static Camera Panorama(const Point &position = Point(), const Point &target = Point(0, 0, -1),
+                           const Point &upHint = Point(0, 1, 0)) {
+        Camera camera(position, target, upHint);
+        camera.projection = Equirectangular;
+        return camera;
+    }
+
+    // Left and right eye of a stereo pair with parallel axes, eyeDistance apart.
+    static std::vector<Camera> Stereo(const Point &position, const Point &target, Real eyeDistance,
+                                      const Point &upHint = Point(0, 1, 0), Real fov = M_PI / 3.0) {
+        Point shift = Camera(position, target, upHint).right * (eyeDistance / 2);
+        return {Camera(position - shift, target - shift, upHint, fov),
+                Camera(position + shift, target + shift, upHint, fov)};
+    }
+
+    // Faces +x, -x, +y, -y, +z and -z of a cubemap for square images. The side faces are upright, the top and the
+    // bottom one have the -z face below and above them.
+    static std::vector<Camera> Cubemap(const Point &position = Point()) {
+        const Point axes[6] = {Point(1, 0, 0), Point(-1, 0, 0), Point(0, 1, 0), Point(0, -1, 0), Point(0, 0, 1),
+                               Point(0, 0, -1)};
+        const Point upHints[6] = {Point(0, 1, 0), Point(0, 1, 0), Point(0, 0, 1), Point(0, 0, -1), Point(0, 1, 0),
+                                  Point(0, 1, 0)};
+        std::vector<Camera> faces;
+        for (int face = 0; face < 6; ++face) {
+            faces.emplace_back(position, position + axes[face], upHints[face], M_PI / 2);
+        }
+        return faces;
+    }
+
+    const Point &getPosition() const {
+        return position;
+    }
+
+    Projection getProjection() const {
+        return projection;
+    }
+
+    // Unit direction through the corner of pixel (i, j), rows go top to bottom.
+    Point direction(int i, int j, int width, int height) const {
+        if (projection == Equirectangular) {
+            Real longitude = (2 * i / (Real) width - 1) * M_PI, latitude = (1 - 2 * j / (Real) height) * M_PI / 2;
+            return (forward * (cos(latitude) * cos(longitude)) + right * (cos(latitude) * sin(longitude)) +
+                    up * sin(latitude)).normalize();
+        }
+        Real x = (2 * i / (Real) width - 1) * tanHalfFov * width / (Real) height;
+        Real y = -(2 * j / (Real) height - 1) * tanHalfFov;
+        return (right * x + up * y + forward).normalize();
+    }
+
+    // Perspective cameras only: pixel coordinates, as taken by direction, of the ray through p. False when p is not
+    // in front of the camera.
+    bool project(const Point &p, int width, int height, Real &i, Real &j) const {
+        Point d = p - position;
+        Real depth = d * forward;
+        if (!(depth > 0)) {
+            return false;
+        }
+        i = ((d * right) / (depth * tanHalfFov * width / (Real) height) + 1) * width / 2;
+        j = (1 - (d * up) / (depth * tanHalfFov)) * height / 2;
+        return true;
+    }
+
+    // Perspective cameras only: the pixels [left, right] x [top, bottom] of the frame whose rays may meet the box, a
+    // pixel wider on every side for rounding. All of them when the box reaches behind the camera, false when none.
+    bool projectBounds(const Bounds &bounds, int width, int height, int &left, int &right, int &top, int &bottom) const {
+        Real iMin = INFINITY, iMax = -INFINITY, jMin = INFINITY, jMax = -INFINITY;
+        int behind = 0;
+        for (int corner = 0; corner < 8; ++corner) {
+            Point p(corner & 1 ? bounds.max[0] : bounds.min[0], corner & 2 ? bounds.max[1] : bounds.min[1],
+                    corner & 4 ? bounds.max[2] : bounds.min[2]);
+            Real i, j;
+            if (!project(p, width, height, i, j)) {
+                ++behind;
+                continue;
+            }
+            iMin = std::min(iMin, i);
+            iMax = std::max(iMax, i);
+            jMin = std::min(jMin, j);
+            jMax = std::max(jMax, j);
+        }
+        if (behind == 8) {
+            return false;
+        }
+        if (behind > 0) {
+            // crosses the plane of the camera, may cover any pixel
+            left = top = 0;
+            right = width - 1;
+            bottom = height - 1;
+            return true;
+        }
+        left = (int) std::max<Real>(0, std::floor(iMin) - 1);
+        right = (int) std::min<Real>(width - 1, std::ceil(iMax) + 1);
+        top = (int) std::max<Real>(0, std::floor(jMin) - 1);
+        bottom = (int) std::min<Real>(height - 1, std::ceil(jMax) + 1);
+        return left <= right && top <= bottom;
+    }
+
+    // angle covered by one pixel, for texture filtering
+    Real pixelSpread(int height) const {
+        return projection == Equirectangular ? M_PI / height : 2 * tanHalfFov / height;
+    }
+};
+
+#endif //RT_CAMERA_H
@@ -0,0 +1,131 @@
+#include <algorithm>
+#include <cstring>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define RT_HAVE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "Checkpoint.h"
+
+struct CheckpointHeader {
+    char magic[8];
+    unsigned long long key;
+    unsigned long long journalCapacity;
+    unsigned long long dataBytes;
+    char padding[4096 - 32];
+};
+
+static const char CheckpointMagic[8] = {'R', 'T', 'C', 'K', 'P', 'T', '1', 0};
+
+static size_t
+journalBytes(size_t journalCapacity) {
+    return (journalCapacity * sizeof(uint32_t) + sizeof(CheckpointHeader) - 1) / sizeof(CheckpointHeader) *
+           sizeof(CheckpointHeader);
+}
+
+Checkpoint::Checkpoint(unsigned char *mapping, size_t mappingBytes, size_t journalCapacity, const std::string &path) :
+        mapping(mapping), mappingBytes(mappingBytes), journal((uint32_t *) (mapping + sizeof(CheckpointHeader))),
+        journalCapacity(journalCapacity), journalSize(0), restored(journalCapacity, 0), path(path) {
+    // Entries of threads killed between taking a place and writing it leave holes, the journal is packed again.
+    // An entry only ever moves to a place whose own entry has moved already, so a crash meanwhile loses nothing.
+    size_t size = 0;
+    for (size_t i = 0; i < journalCapacity; ++i) {
+        uint32_t entry = journal[i];
+        if (entry < journalCapacity) {
+            restored[entry] = 1;
+            journal[size++] = entry;
+        }
+    }
+    std::fill(journal + size, journal + journalCapacity, NoEntry);
+    journalSize = size;
+}
+
+Checkpoint::~Checkpoint() {
+#ifdef RT_HAVE_MMAP
+    if (mapping != nullptr) {
+        munmap(mapping, mappingBytes);
+    }
+#endif
+}
+
+std::unique_ptr<Checkpoint> Checkpoint::Open(const std::string &path, uint64_t key, size_t journalCapacity,
+                                             size_t dataBytes, bool resume) {
+#ifdef RT_HAVE_MMAP
+    size_t bytes = sizeof(CheckpointHeader) + journalBytes(journalCapacity) + dataBytes;
+    int fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        return nullptr;
+    }
+    bool matches = false;
+    if (resume && lseek(fd, 0, SEEK_END) == (off_t) bytes) {
+        CheckpointHeader header;
+        matches = pread(fd, &header, sizeof(header), 0) == (ssize_t) sizeof(header) &&
+                  std::memcmp(header.magic, CheckpointMagic, sizeof(CheckpointMagic)) == 0 && header.key == key &&
+                  header.journalCapacity == journalCapacity && header.dataBytes == dataBytes;
+    }
+    // the file is emptied first, so none of a previous job is left in it
+    if (!matches && (ftruncate(fd, 0) != 0 || ftruncate(fd, bytes) != 0)) {
+        close(fd);
+        return nullptr;
+    }
+    void *mapping = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        return nullptr;
+    }
+    if (!matches) {
+        CheckpointHeader *header = (CheckpointHeader *) mapping;
+        uint32_t *journal = (uint32_t *) ((unsigned char *) mapping + sizeof(CheckpointHeader));
+        std::fill(journal, journal + journalCapacity, NoEntry);
+        header->key = key;
+        header->journalCapacity = journalCapacity;
+        header->dataBytes = dataBytes;
+        // the magic goes last, a file without it is never resumed
+        std::atomic_thread_fence(std::memory_order_release);
+        std::memcpy(header->magic, CheckpointMagic, sizeof(CheckpointMagic));
+    }
+    return std::unique_ptr<Checkpoint>(new Checkpoint((unsigned char *) mapping, bytes, journalCapacity, path));
+#else
+    return nullptr;
+#endif
+}
+
+unsigned char *Checkpoint::getData() const {
+    return mapping + sizeof(CheckpointHeader) + journalBytes(journalCapacity);
+}
+
+void Checkpoint::append(uint32_t entry) {
+    size_t slot = journalSize.fetch_add(1);
+    // only holes of crashed runs could fill the journal, the entry is then not kept
+    if (slot >= journalCapacity) {
+        return;
+    }
+    std::atomic_thread_fence(std::memory_order_release);
+    journal[slot] = entry;
+}
+
+uint32_t Checkpoint::getLastRestored() const {
+    for (size_t entry = restored.size(); entry > 0; --entry) {
+        if (restored[entry - 1]) {
+            return (uint32_t) (entry - 1);
+        }
+    }
+    return NoEntry;
+}
+
+void Checkpoint::flush() {
+#ifdef RT_HAVE_MMAP
+    msync(mapping, mappingBytes, MS_ASYNC);
+#endif
+}
+
+void Checkpoint::discard() {
+#ifdef RT_HAVE_MMAP
+    munmap(mapping, mappingBytes);
+    mapping = nullptr;
+    unlink(path.c_str());
+#endif
+}
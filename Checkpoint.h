@@ -0,0 +1,54 @@
+#ifndef RT_CHECKPOINT_H
+#define RT_CHECKPOINT_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Progress of a render kept in a memory-mapped file, so that a killed render can be resumed: a header, a journal of
+// what is finished and a data area the renderer lays out as it likes. Whatever an entry records is written to the
+// data area before the entry is appended to the journal, so after a crash the journal only lists finished work.
+// Entries are numbers below the journal capacity and may repeat, appending is thread safe.
+class Checkpoint {
+    unsigned char *mapping;
+    size_t mappingBytes;
+    uint32_t *journal;
+    size_t journalCapacity;
+    std::atomic<size_t> journalSize;
+    // entries found in the file when resuming
+    std::vector<unsigned char> restored;
+    std::string path;
+
+    Checkpoint(unsigned char *mapping, size_t mappingBytes, size_t journalCapacity, const std::string &path);
+
+public:
+    static constexpr uint32_t NoEntry = 0xFFFFFFFF;
+
+    ~Checkpoint();
+
+    // Opens the checkpoint of the job identified by key at path. With resume an existing file of the same job and
+    // layout is continued, otherwise the file is started over. Returns nullptr when the file cannot be mapped.
+    static std::unique_ptr<Checkpoint> Open(const std::string &path, uint64_t key, size_t journalCapacity,
+                                            size_t dataBytes, bool resume);
+
+    unsigned char *getData() const;
+
+    void append(uint32_t entry);
+
+    bool isRestored(uint32_t entry) const {
+        return entry < restored.size() && restored[entry];
+    }
+
+    // largest entry restored, NoEntry if none was
+    uint32_t getLastRestored() const;
+
+    // Writes the mapping back to the file, the OS does so anyway unless the machine goes down first.
+    void flush();
+
+    // Deletes the file once the render it belongs to is complete.
+    void discard();
+};
+
+#endif //RT_CHECKPOINT_H
@@ -0,0 +1,143 @@
+#include <algorithm>
+#include <cmath>
+
+#include "Denoise.h"
+#include "FastMath.h"
+
+// side of the square blocks the threads take in turn
+constexpr int DenoiseTileSize = 32;
+
+// weights of the 3x3 kernel by distance from the centre
+static const Real Kernel[2] = {1.0 / 2, 1.0 / 4};
+
+// How fast the weights fall off: colour in standard deviations of the noise, albedo in its units, depth relative to
+// the change the gradient predicts. Normals are weighted by their cosine to this power.
+constexpr Real SigmaColour = 4;
+constexpr Real SigmaAlbedo = 0.1;
+constexpr Real SigmaDepth = 1;
+constexpr int NormalPowerLog2 = 7;
+
+static inline Real
+luminance(const Pixel &p) {
+    return 0.2126 * p[0] + 0.7152 * p[1] + 0.0722 * p[2];
+}
+
+// Calls visit(i, j) for every pixel, tile by tile in parallel.
+template<typename Visitor>
+static void
+forEachPixel(int width, int height, Visitor visit) {
+    const int tilesX = (width + DenoiseTileSize - 1) / DenoiseTileSize;
+    const int tilesCount = tilesX * ((height + DenoiseTileSize - 1) / DenoiseTileSize);
+#pragma omp parallel for schedule(dynamic)
+    for (int t = 0; t < tilesCount; ++t) {
+        int i0 = t % tilesX * DenoiseTileSize, j0 = t / tilesX * DenoiseTileSize;
+        for (int j = j0; j < std::min(height, j0 + DenoiseTileSize); ++j) {
+            for (int i = i0; i < std::min(width, i0 + DenoiseTileSize); ++i) {
+                visit(i, j);
+            }
+        }
+    }
+}
+
+void
+Denoise(Pixel *frame, int width, int height, int stride, const DenoiseGuides &guides, int iterations) {
+    const size_t size = (size_t) stride * height;
+    std::vector<Pixel> colour(frame, frame + size), next(size);
+    std::vector<Real> variance(size), nextVariance(size), lum(size);
+    // depth change per pixel along x and y, the smaller one-sided difference so edges do not spread
+    std::vector<Real> depthDx(size), depthDy(size);
+
+    forEachPixel(width, height, [&](int i, int j) {
+        size_t p = (size_t) j * stride + i;
+        // noise of the frame from the spread of luminance around the pixel
+        Real sum = 0, sum2 = 0;
+        int count = 0;
+        for (int y = std::max(0, j - 1); y <= std::min(height - 1, j + 1); ++y) {
+            for (int x = std::max(0, i - 1); x <= std::min(width - 1, i + 1); ++x) {
+                Real l = luminance(colour[(size_t) y * stride + x]);
+                sum += l;
+                sum2 += l * l;
+                ++count;
+            }
+        }
+        variance[p] = std::max<Real>(0, sum2 / count - (sum / count) * (sum / count));
+        lum[p] = luminance(colour[p]);
+
+        const std::vector<Real> &z = guides.depth;
+        Real left = i > 0 ? z[p] - z[p - 1] : INFINITY, right = i + 1 < width ? z[p + 1] - z[p] : INFINITY;
+        Real up = j > 0 ? z[p] - z[p - stride] : INFINITY, down = j + 1 < height ? z[p + stride] - z[p] : INFINITY;
+        depthDx[p] = std::min(std::abs(left), std::abs(right));
+        depthDy[p] = std::min(std::abs(up), std::abs(down));
+        depthDx[p] = std::isfinite(depthDx[p]) ? depthDx[p] : 0;
+        depthDy[p] = std::isfinite(depthDy[p]) ? depthDy[p] : 0;
+    });
+
+    for (int iteration = 0; iteration < iterations; ++iteration) {
+        const int step = 1 << iteration;
+        forEachPixel(width, height, [&](int i, int j) {
+            size_t p = (size_t) j * stride + i;
+            // the variance is blurred a little before use, single pixel estimates are too noisy
+            Real blurred = 0, blurWeight = 0;
+            for (int y = std::max(0, j - 1); y <= std::min(height - 1, j + 1); ++y) {
+                for (int x = std::max(0, i - 1); x <= std::min(width - 1, i + 1); ++x) {
+                    Real w = Kernel[std::abs(x - i)] * Kernel[std::abs(y - j)];
+                    blurred += variance[(size_t) y * stride + x] * w;
+                    blurWeight += w;
+                }
+            }
+            Real invColourScale = 1 / (SigmaColour * std::sqrt(blurred / blurWeight) + 1e-4);
+            Real l = lum[p];
+            const Point &n = guides.normal[p];
+            const Colour &a = guides.albedo[p];
+            Real z = guides.depth[p];
+
+            Pixel sum;
+            Real weightSum = 0, varianceSum = 0;
+            for (int dy = -1; dy <= 1; ++dy) {
+                int y = j + dy * step;
+                if (y < 0 || y >= height) {
+                    continue;
+                }
+                for (int dx = -1; dx <= 1; ++dx) {
+                    int x = i + dx * step;
+                    if (x < 0 || x >= width) {
+                        continue;
+                    }
+                    size_t q = (size_t) y * stride + x;
+                    Real w = Kernel[std::abs(dx)] * Kernel[std::abs(dy)];
+                    if (q != p) {
+                        Real cosine = std::max<Real>(0, n * guides.normal[q]);
+                        // pixels that missed the scene have no normal and only look alike
+                        if (n * n == 0 && guides.normal[q] * guides.normal[q] == 0) {
+                            cosine = 1;
+                        }
+                        for (int k = 0; k < NormalPowerLog2; ++k) {
+                            cosine *= cosine;
+                        }
+                        Colour albedoDiff = a - guides.albedo[q];
+                        Real expected = (std::abs(dx) * depthDx[p] + std::abs(dy) * depthDy[p]) * step;
+                        Real exponent = std::abs(z - guides.depth[q]) / (SigmaDepth * expected + 1e-3 * z + EPS) +
+                                        albedoDiff * albedoDiff * (1 / (SigmaAlbedo * SigmaAlbedo)) +
+                                        std::abs(l - lum[q]) * invColourScale;
+                        // the weights need no precision, exp is the bulk of the filter's time
+                        w *= cosine * FastExp2((float) (-exponent * M_LOG2E));
+                    }
+                    sum += colour[q] * w;
+                    weightSum += w;
+                    varianceSum += variance[q] * w * w;
+                }
+            }
+            next[p] = sum * (1 / weightSum);
+            nextVariance[p] = varianceSum / (weightSum * weightSum);
+        });
+        colour.swap(next);
+        variance.swap(nextVariance);
+        forEachPixel(width, height, [&](int i, int j) {
+            lum[(size_t) j * stride + i] = luminance(colour[(size_t) j * stride + i]);
+        });
+    }
+
+    forEachPixel(width, height, [&](int i, int j) {
+        frame[(size_t) j * stride + i] = colour[(size_t) j * stride + i];
+    });
+}
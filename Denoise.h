@@ -0,0 +1,29 @@
+#ifndef RT_DENOISE_H
+#define RT_DENOISE_H
+
+#include <vector>
+
+#include "mygeometry.h"
+
+// What the primary rays of each pixel hit, averaged over its samples: the normal, the diffuse colour and the
+// distance. Pixels whose rays miss the scene get a zero normal and albedo and MAX_DIST. Rows are stride apart.
+struct DenoiseGuides {
+    std::vector<Point> normal;
+    std::vector<Colour> albedo;
+    std::vector<Real> depth;
+    int stride;
+
+    DenoiseGuides(int stride, int height) :
+            normal((size_t) stride * height), albedo((size_t) stride * height), depth((size_t) stride * height, 0),
+            stride(stride) {
+    }
+};
+
+// Edge-avoiding a-trous wavelet filter (Dammertz et al. 2010) with the luminance variance driven weights of SVGF:
+// iterations of a 3x3 kernel with holes doubling every time, neighbours weighted down by how much their normal,
+// albedo, depth and colour differ. Five iterations reach 31 pixels away. The noise is estimated from the frame
+// itself, so any sample count works. frame is filtered in place, tiles of it are processed in parallel.
+void
+Denoise(Pixel *frame, int width, int height, int stride, const DenoiseGuides &guides, int iterations = 5);
+
+#endif //RT_DENOISE_H
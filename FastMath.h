@@ -0,0 +1,69 @@
+#ifndef RT_FASTMATH_H
+#define RT_FASTMATH_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+
+// Branch-free float approximations used by the fast-math shading kernel. The error bounds below hold against the
+// standard library over the whole range the kernel feeds them, tests/FastMathTest.cpp checks them.
+
+static inline uint32_t floatBits(float x) {
+    uint32_t bits;
+    std::memcpy(&bits, &x, sizeof(bits));
+    return bits;
+}
+
+static inline float bitsFloat(uint32_t bits) {
+    float x;
+    std::memcpy(&x, &bits, sizeof(x));
+    return x;
+}
+
+// 1 / sqrt(x) for x >= 0: bit-level initial guess and two Newton steps, relative error below 5e-6. A single step
+// (1.8e-3) is not enough, the normalised vectors become ray directions and sphere tests assume unit length.
+// Zero gives infinity, so normalising a zero vector yields NaNs just like the exact path.
+static inline float FastRsqrt(float x) {
+    float y = bitsFloat(0x5F375A86u - (floatBits(x) >> 1));
+    y *= 1.5f - 0.5f * x * y * y;
+    y *= 1.5f - 0.5f * x * y * y;
+    return x > 0 ? y : std::numeric_limits<float>::infinity();
+}
+
+// 2^x for x in [-126, 126], relative error below 2e-7. Smaller x flush to 0 instead of going through slow denormals.
+static inline float FastExp2(float x) {
+    x = std::min(std::max(x, -127.0f), 126.0f);
+    // x + 127 is not negative, so truncation rounds it down
+    int whole = (int) (x + 127.0f) - 127;
+    float f = x - whole;
+    // degree 5 fit of 2^f on [0, 1] at Chebyshev nodes
+    float p = 1.8937541e-3f;
+    p = p * f + 8.9495904e-3f;
+    p = p * f + 5.5860337e-2f;
+    p = p * f + 2.4014182e-1f;
+    p = p * f + 6.9315449e-1f;
+    p = p * f + 9.9999990e-1f;
+    return p * bitsFloat((uint32_t) (whole + 127) << 23);
+}
+
+// log2(x) for normal x > 0, absolute error below 4e-6 (mostly the rounding of the exponent sum).
+static inline float FastLog2(float x) {
+    // split x into 2^exponent * m with m in [2 / 3, 4 / 3), so the series below converges fast
+    int32_t bits = (int32_t) floatBits(x);
+    int32_t exponent = (bits - 0x3F2AAAAB) >> 23;
+    float m = bitsFloat((uint32_t) (bits - (exponent << 23)));
+    // log2(m) = 2 / ln(2) * atanh(t), t = (m - 1) / (m + 1), |t| <= 0.2
+    float t = (m - 1.0f) / (m + 1.0f), t2 = t * t;
+    float series = t * (1.0f + t2 * (1.0f / 3 + t2 * (1.0f / 5 + t2 * (1.0f / 7 + t2 * (1.0f / 9)))));
+    return exponent + 2.88539008f * series;
+}
+
+// x^y for x in [0, 1] and y in [0, 2000] as used for specular highlights, absolute error below 1e-6.
+static inline float FastPow(float x, float y) {
+    float result = FastExp2(y * FastLog2(x));
+    // 0^0 is 1 as in std::pow
+    return x > 0 ? result : (y > 0 ? 0.0f : 1.0f);
+}
+
+#endif //RT_FASTMATH_H
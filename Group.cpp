@@ -0,0 +1,141 @@
+#include "Group.h"
+
+std::vector<const BasicObject *> Group::bounded(const std::vector<BasicObject *> &objects) {
+    std::vector<const BasicObject *> result;
+    for (const auto &object : objects) {
+        if (object->getBounds().isFinite()) {
+            result.push_back(object);
+        }
+    }
+    return result;
+}
+
+Group::Group(const std::vector<BasicObject *> &objects, Arena *arena) :
+        unbounded(ArenaAllocator<const BasicObject *>(arena, ArenaNodes)), bvh(bounded(objects), arena) {
+    unbounded.reserve(objects.size() - bvh.getObjects().size());
+    for (const auto &object : objects) {
+        if (!object->getBounds().isFinite()) {
+            unbounded.push_back(object);
+        }
+    }
+}
+
+bool Group::intersect(const Point &beamPoint, const Point &direction, Hit &hit) const {
+    return intersect(beamPoint, direction, RayShear(direction), hit);
+}
+
+bool Group::intersect(const Point &beamPoint, const Point &direction, const RayShear &shear, Hit &hit) const {
+    bool found = false;
+    for (const auto &object : unbounded) {
+        if (object->intersect(beamPoint, direction, shear, hit)) {
+            hit.root = object;
+            found = true;
+        }
+    }
+    bvh.traverse(beamPoint, direction, hit.t, [&](const BasicObject *object) {
+        if (object->intersect(beamPoint, direction, shear, hit)) {
+            hit.root = object;
+            found = true;
+        }
+        return false;
+    });
+    return found;
+}
+
+bool Group::occluded(const Point &beamPoint, const Point &direction, const RayShear &shear, Real maxDist,
+                     const BasicObject *&occluder) const {
+    Real dist;
+    for (const auto &object : unbounded) {
+        if (object->areIntersected(beamPoint, direction, shear, dist) && dist >= 0 && dist < maxDist) {
+            occluder = object;
+            return true;
+        }
+    }
+    bool found = false;
+    bvh.traverse(beamPoint, direction, maxDist, [&](const BasicObject *object) {
+        if (object->areIntersected(beamPoint, direction, shear, dist) && dist >= 0 && dist < maxDist) {
+            occluder = object;
+            found = true;
+        }
+        return found;
+    });
+    return found;
+}
+
+bool Group::areIntersected(const Point &beamPoint, const Point &direction, Real &t0) const {
+    Hit hit;
+    if (intersect(beamPoint, direction, hit)) {
+        t0 = hit.t;
+        return true;
+    }
+    return false;
+}
+
+void Group::getMaterials(std::vector<Material> &materials) const {
+    for (const auto &object : unbounded) {
+        object->getMaterials(materials);
+    }
+    for (const auto &object : bvh.getObjects()) {
+        object->getMaterials(materials);
+    }
+}
+
+bool Group::rasterize(RasterTarget &target) const {
+    bool drawn = true;
+    for (const auto &object : unbounded) {
+        drawn = object->rasterize(target) && drawn;
+    }
+    for (const auto &object : bvh.getObjects()) {
+        if (target.overlaps(object->getBounds())) {
+            drawn = object->rasterize(target) && drawn;
+        }
+    }
+    return drawn;
+}
+
+bool Instance::intersect(const Point &beamPoint, const Point &direction, Hit &hit) const {
+    Point localDirection = toLocal.applyVector(direction);
+    Real scale = localDirection.length();
+    Hit local;
+    local.t = hit.t * scale;
+    if (!geometry->intersect(toLocal.applyPoint(beamPoint), localDirection * (1.0 / scale), local)) {
+        return false;
+    }
+    hit = local;
+    hit.t = local.t / scale;
+    hit.instance = this;
+    return true;
+}
+
+bool Instance::areIntersected(const Point &beamPoint, const Point &direction, Real &t0) const {
+    Hit hit;
+    if (intersect(beamPoint, direction, hit)) {
+        t0 = hit.t;
+        return true;
+    }
+    return false;
+}
+
+bool Instance::rasterize(RasterTarget &target) const {
+    target.setInstance(this);
+    bool drawn = geometry->rasterize(target);
+    target.setInstance(nullptr);
+    return drawn;
+}
+
+bool Instance::intersectPrimitive(const Point &beamPoint, const Point &direction, const RayShear &shear,
+                                  const BasicObject *leaf, size_t primitive, Hit &hit) const {
+    Point localDirection = toLocal.applyVector(direction);
+    Real scale = localDirection.length();
+    localDirection = localDirection * (1.0 / scale);
+    Hit local;
+    local.t = hit.t * scale;
+    if (!leaf->intersectPrimitive(toLocal.applyPoint(beamPoint), localDirection, RayShear(localDirection), leaf,
+                                  primitive, local)) {
+        return false;
+    }
+    hit = local;
+    hit.t = local.t / scale;
+    hit.instance = this;
+    return true;
+}
@@ -0,0 +1,116 @@
+#ifndef RT_GROUP_H
+#define RT_GROUP_H
+
+#include <vector>
+
+#include "Bvh.h"
+#include "mygeometry.h"
+
+// Set of objects traced through a BVH, objects without finite bounds (planes) are tested one by one. The BVH is
+// allocated from arena if given.
+// Aggregates are shaded through the primitive recorded in Hit, so their own getNormal/getMaterial are never used.
+class Group : public BasicObject {
+    ArenaVector<const BasicObject *> unbounded;
+    Bvh bvh;
+
+    static std::vector<const BasicObject *> bounded(const std::vector<BasicObject *> &objects);
+
+public:
+    explicit Group(const std::vector<BasicObject *> &objects, Arena *arena = nullptr);
+
+    // shears the ray once for all the objects it meets
+    bool intersect(const Point &beamPoint, const Point &direction, Hit &hit) const;
+
+    bool intersect(const Point &beamPoint, const Point &direction, const RayShear &shear, Hit &hit) const;
+
+    // Finds any object in front of the beam point closer than maxDist and reports the top level object hit.
+    bool occluded(const Point &beamPoint, const Point &direction, const RayShear &shear, Real maxDist,
+                  const BasicObject *&occluder) const;
+
+    bool areIntersected(const Point &beamPoint, const Point &direction, Real &t0) const;
+
+    // objects of the group, intersect tests the unbounded ones first
+    const ArenaVector<const BasicObject *> &getUnbounded() const {
+        return unbounded;
+    }
+
+    const ArenaVector<const BasicObject *> &getBounded() const {
+        return bvh.getObjects();
+    }
+
+    Bounds getBounds() const {
+        return unbounded.empty() ? bvh.getBounds() : Bounds::Infinite();
+    }
+
+    // draws the objects in reach of the target
+    bool rasterize(RasterTarget &target) const;
+
+    void getMaterials(std::vector<Material> &materials) const;
+
+    Material getMaterial(Point &p) const {
+        return Material();
+    }
+
+    Point getNormal(Point &p) const {
+        return Point();
+    }
+};
+
+// Shared geometry placed into the scene with an affine transform. Any number of instances may reference the same
+// geometry, each costs only its transforms and bounds. The geometry itself must not contain instances.
+class Instance : public BasicObject {
+    const BasicObject *geometry;
+    Transform toWorld, toLocal;
+    Bounds bounds;
+
+public:
+    Instance(const BasicObject &geometry, const Transform &transform) :
+            geometry(&geometry), toWorld(transform), toLocal(transform.inverse()),
+            bounds(transform.applyBounds(geometry.getBounds())) {
+    }
+
+    bool intersect(const Point &beamPoint, const Point &direction, Hit &hit) const;
+
+    bool areIntersected(const Point &beamPoint, const Point &direction, Real &t0) const;
+
+    // draws the geometry placed by this instance
+    bool rasterize(RasterTarget &target) const;
+
+    // transforms the ray like intersect and has leaf intersect its primitive
+    bool intersectPrimitive(const Point &beamPoint, const Point &direction, const RayShear &shear,
+                            const BasicObject *leaf, size_t primitive, Hit &hit) const;
+
+    const Transform &getToWorld() const {
+        return toWorld;
+    }
+
+    const Transform &getToLocal() const {
+        return toLocal;
+    }
+
+    Bounds getBounds() const {
+        return bounds;
+    }
+
+    void getMaterials(std::vector<Material> &materials) const {
+        geometry->getMaterials(materials);
+    }
+
+    Point pointToLocal(const Point &p) const {
+        return toLocal.applyPoint(p);
+    }
+
+    Point normalToWorld(const Point &n) const {
+        return toLocal.applyNormal(n).normalized();
+    }
+
+    Material getMaterial(Point &p) const {
+        return Material();
+    }
+
+    Point getNormal(Point &p) const {
+        return Point();
+    }
+};
+
+#endif //RT_GROUP_H
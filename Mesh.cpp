@@ -0,0 +1,756 @@
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define RT_HAVE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#endif
+
+#include "Mesh.h"
+
+void MeshData::computeNormals() {
+    normals.assign(positions.size(), Point());
+    for (size_t i = 0; i + 2 < indices.size(); i += 3) {
+        const Point &p0 = positions[indices[i]];
+        // area weighted face normal
+        Point n = (positions[indices[i + 1]] - p0).cross(positions[indices[i + 2]] - p0);
+        for (size_t k = 0; k < 3; ++k) {
+            normals[indices[i + k]] = normals[indices[i + k]] + n;
+        }
+    }
+    for (auto &normal : normals) {
+        double length = normal.length();
+        normal = length > 0 ? normal * (1.0 / length) : Point(0, 1, 0);
+    }
+}
+
+bool LoadOBJ(const std::string &fname, MeshData &mesh) {
+    std::ifstream in(fname);
+    if (!in) {
+        return false;
+    }
+    mesh = MeshData();
+    std::string line;
+    while (std::getline(in, line)) {
+        std::istringstream tokens(line);
+        std::string type;
+        tokens >> type;
+        if (type == "v") {
+            double x, y, z;
+            if (!(tokens >> x >> y >> z)) {
+                return false;
+            }
+            mesh.positions.emplace_back(x, y, z);
+        } else if (type == "f") {
+            std::vector<unsigned int> face;
+            std::string corner;
+            while (tokens >> corner) {
+                // only the position index of "v/vt/vn" is used, negative indices count from the end
+                long index = std::strtol(corner.c_str(), nullptr, 10);
+                index = index < 0 ? (long) mesh.positions.size() + index : index - 1;
+                if (index < 0 || index >= (long) mesh.positions.size()) {
+                    return false;
+                }
+                face.push_back((unsigned int) index);
+            }
+            for (size_t i = 2; i < face.size(); ++i) {
+                mesh.indices.push_back(face[0]);
+                mesh.indices.push_back(face[i - 1]);
+                mesh.indices.push_back(face[i]);
+            }
+        }
+    }
+    mesh.computeNormals();
+    return !mesh.indices.empty();
+}
+
+MeshData MakeTorus(double radius, double tubeRadius, int rings, int sides) {
+    MeshData mesh;
+    for (int i = 0; i < rings; ++i) {
+        double phi = 2 * M_PI * i / rings;
+        Point ringCenter(radius * cos(phi), 0, radius * sin(phi));
+        for (int j = 0; j < sides; ++j) {
+            double theta = 2 * M_PI * j / sides;
+            Point normal(cos(theta) * cos(phi), sin(theta), cos(theta) * sin(phi));
+            mesh.positions.push_back(ringCenter + normal * tubeRadius);
+            mesh.normals.push_back(normal);
+        }
+    }
+    for (int i = 0; i < rings; ++i) {
+        for (int j = 0; j < sides; ++j) {
+            unsigned int a = i * sides + j, b = ((i + 1) % rings) * sides + j;
+            unsigned int c = ((i + 1) % rings) * sides + (j + 1) % sides, d = i * sides + (j + 1) % sides;
+            unsigned int quad[6] = {a, d, b, b, d, c};
+            mesh.indices.insert(mesh.indices.end(), quad, quad + 6);
+        }
+    }
+    return mesh;
+}
+
+// float bounds that still contain the double value
+static float roundDown(double value) {
+    float result = (float) value;
+    return result > value ? std::nextafter(result, -INFINITY) : result;
+}
+
+static float roundUp(double value) {
+    float result = (float) value;
+    return result < value ? std::nextafter(result, INFINITY) : result;
+}
+
+static unsigned int encodeNormal(const Point &n) {
+    double sum = std::abs(n[0]) + std::abs(n[1]) + std::abs(n[2]);
+    double x = n[0] / sum, y = n[1] / sum;
+    if (n[2] < 0) {
+        double ox = x;
+        x = (1 - std::abs(y)) * (ox >= 0 ? 1 : -1);
+        y = (1 - std::abs(ox)) * (y >= 0 ? 1 : -1);
+    }
+    unsigned short qx = (unsigned short) (short) std::lround(x * 32767);
+    unsigned short qy = (unsigned short) (short) std::lround(y * 32767);
+    return qx | ((unsigned int) qy << 16);
+}
+
+static Point decodeNormal(unsigned int encoded) {
+    double x = (short) (encoded & 0xFFFF) / 32767.0, y = (short) (encoded >> 16) / 32767.0;
+    double z = 1 - std::abs(x) - std::abs(y);
+    if (z < 0) {
+        double ox = x;
+        x = (1 - std::abs(y)) * (ox >= 0 ? 1 : -1);
+        y = (1 - std::abs(ox)) * (y >= 0 ? 1 : -1);
+    }
+    return Point(x, y, z).normalized();
+}
+
+static size_t align(size_t size, size_t alignment) {
+    return (size + alignment - 1) / alignment * alignment;
+}
+
+static size_t positionsBytes(unsigned int precision, size_t vertexCount) {
+    return align(vertexCount * (precision == CompactMesh::Float ? 3 * sizeof(float) : 3 * sizeof(unsigned short)), 4);
+}
+
+namespace {
+    typedef CompactMesh::NodeRecord NodeRecord;
+    typedef CompactMesh::ClusterRecord ClusterRecord;
+
+    // inner nodes laid out together, a treelet fills a page
+    constexpr size_t TreeletNodes = 4096 / sizeof(NodeRecord);
+
+    constexpr size_t NotWritten = ~(size_t) 0;
+
+    // Builds the BVH in memory and writes it out treelet by treelet.
+    class MeshEncoder {
+        struct BuildNode {
+            float min[3], max[3];
+            // -1 for a missing child, both are -1 for leaves
+            int child[2];
+            // triangles of a leaf
+            size_t begin, end;
+            std::vector<unsigned char> cluster;
+            size_t offset;
+        };
+
+        const MeshData &mesh;
+        unsigned int precision;
+        std::vector<unsigned int> triangles;
+        std::vector<Point> centers;
+        std::vector<BuildNode> nodes;
+        // largest extent of a cluster, then the step of the grid all quantized clusters share
+        Point clusterExtent, step;
+
+        template<typename T>
+        static void append(std::vector<unsigned char> &bytes, const T &value) {
+            size_t offset = bytes.size();
+            bytes.resize(offset + sizeof(T));
+            std::memcpy(&bytes[offset], &value, sizeof(T));
+        }
+
+        Bounds exactBounds(size_t begin, size_t end) const {
+            Bounds exact;
+            for (size_t i = begin; i < end; ++i) {
+                for (size_t k = 0; k < 3; ++k) {
+                    exact.grow(mesh.positions[mesh.indices[3 * triangles[i] + k]]);
+                }
+            }
+            return exact;
+        }
+
+        // Origin of a cluster on the grid, a multiple of step at or below min. A power of two step divides every
+        // float whose ulp is not smaller, and those whose ulp is smaller keep the multiple exactly, so the origin is
+        // a float and origin + q * step is computed exactly: a vertex decodes to the same point in every cluster.
+        static float gridOrigin(double min, float step) {
+            if (step == 0) {
+                return roundDown(min);
+            }
+            return (float) (std::floor(roundDown(min) / (double) step) * step);
+        }
+
+        // encodes the cluster and stores the float bounds of its decoded vertices, rounded outwards
+        void encodeCluster(BuildNode &leaf) {
+            std::vector<unsigned char> &bytes = leaf.cluster;
+            std::vector<unsigned int> vertices;
+            std::vector<unsigned char> localIndices;
+            for (size_t i = leaf.begin; i < leaf.end; ++i) {
+                for (size_t k = 0; k < 3; ++k) {
+                    unsigned int vertex = mesh.indices[3 * triangles[i] + k];
+                    size_t local = std::find(vertices.begin(), vertices.end(), vertex) - vertices.begin();
+                    if (local == vertices.size()) {
+                        vertices.push_back(vertex);
+                    }
+                    localIndices.push_back((unsigned char) local);
+                }
+            }
+
+            Bounds exact = exactBounds(leaf.begin, leaf.end);
+            ClusterRecord cluster = {};
+            for (size_t i = 0; i < 3; ++i) {
+                cluster.scale[i] = (float) step[i];
+                cluster.origin[i] = gridOrigin(exact.min[i], cluster.scale[i]);
+            }
+            cluster.vertexCount = (unsigned short) vertices.size();
+            cluster.triangleCount = (unsigned short) (leaf.end - leaf.begin);
+            cluster.precision = precision;
+            append(bytes, cluster);
+
+            Bounds decoded;
+            for (const auto &vertex : vertices) {
+                const Point &p = mesh.positions[vertex];
+                Point d;
+                for (size_t i = 0; i < 3; ++i) {
+                    if (precision == CompactMesh::Float) {
+                        float value = (float) p[i];
+                        append(bytes, value);
+                        d[i] = value;
+                    } else {
+                        // the grid point nearest p less the origin's, the same point whatever the cluster
+                        double steps = cluster.scale[i] > 0 ? std::round(p[i] / cluster.scale[i]) -
+                                                              cluster.origin[i] / (double) cluster.scale[i] : 0;
+                        unsigned short q = (unsigned short) std::max(0.0, std::min(65535.0, steps));
+                        append(bytes, q);
+                        d[i] = cluster.origin[i] + q * (double) cluster.scale[i];
+                    }
+                }
+                decoded.grow(d);
+            }
+            bytes.resize(sizeof(ClusterRecord) + positionsBytes(precision, vertices.size()));
+            for (const auto &vertex : vertices) {
+                append(bytes, encodeNormal(mesh.normals[vertex]));
+            }
+            bytes.insert(bytes.end(), localIndices.begin(), localIndices.end());
+            bytes.resize(align(bytes.size(), 8));
+
+            for (size_t i = 0; i < 3; ++i) {
+                leaf.min[i] = roundDown(decoded.min[i]);
+                leaf.max[i] = roundUp(decoded.max[i]);
+            }
+        }
+
+        // writes the treelet rooted at root, the clusters of its leaves and then the subtrees below it
+        void emit(int root) {
+            out.resize(align(out.size(), sizeof(NodeRecord)));
+            std::vector<int> treelet(1, root);
+            for (size_t i = 0; i < treelet.size(); ++i) {
+                for (int child : nodes[treelet[i]].child) {
+                    if (child >= 0 && nodes[child].child[0] >= 0 && treelet.size() < TreeletNodes) {
+                        treelet.push_back(child);
+                    }
+                }
+            }
+            size_t first = out.size();
+            out.resize(first + treelet.size() * sizeof(NodeRecord));
+            for (size_t i = 0; i < treelet.size(); ++i) {
+                nodes[treelet[i]].offset = first + i * sizeof(NodeRecord);
+            }
+            for (int member : treelet) {
+                for (int child : nodes[member].child) {
+                    if (child >= 0 && nodes[child].child[0] < 0) {
+                        nodes[child].offset = out.size();
+                        out.insert(out.end(), nodes[child].cluster.begin(), nodes[child].cluster.end());
+                        std::vector<unsigned char>().swap(nodes[child].cluster);
+                    }
+                }
+            }
+            for (int member : treelet) {
+                for (int child : nodes[member].child) {
+                    if (child >= 0 && nodes[child].offset == NotWritten) {
+                        emit(child);
+                    }
+                }
+            }
+
+            for (size_t i = 0; i < treelet.size(); ++i) {
+                NodeRecord record = {};
+                for (size_t c = 0; c < 2; ++c) {
+                    int child = nodes[treelet[i]].child[c];
+                    if (child < 0) {
+                        continue;
+                    }
+                    std::copy_n(nodes[child].min, 3, record.min[c]);
+                    std::copy_n(nodes[child].max, 3, record.max[c]);
+                    record.child[c] = nodes[child].offset | (nodes[child].child[0] < 0 ? 1 : 0);
+                }
+                std::memcpy(&out[first + i * sizeof(NodeRecord)], &record, sizeof(record));
+            }
+        }
+
+    public:
+        std::vector<unsigned char> out;
+
+        MeshEncoder(const MeshData &mesh, unsigned int precision) : mesh(mesh), precision(precision) {
+            for (size_t i = 0; i * 3 < mesh.indices.size(); ++i) {
+                triangles.push_back(i);
+                centers.push_back((mesh.positions[mesh.indices[3 * i]] + mesh.positions[mesh.indices[3 * i + 1]] +
+                                   mesh.positions[mesh.indices[3 * i + 2]]) * (1.0 / 3));
+            }
+        }
+
+        int build(size_t begin, size_t end) {
+            int index = (int) nodes.size();
+            nodes.push_back(BuildNode());
+            nodes[index].child[0] = nodes[index].child[1] = -1;
+            nodes[index].offset = NotWritten;
+            if (end - begin <= CompactMesh::MaxClusterTriangles) {
+                nodes[index].begin = begin;
+                nodes[index].end = end;
+                Bounds exact = exactBounds(begin, end);
+                for (size_t i = 0; i < 3; ++i) {
+                    clusterExtent[i] = std::max(clusterExtent[i], exact.max[i] - exact.min[i]);
+                }
+                return index;
+            }
+
+            Bounds centerBounds;
+            for (size_t i = begin; i < end; ++i) {
+                centerBounds.grow(centers[triangles[i]]);
+            }
+            Point extent = centerBounds.max - centerBounds.min;
+            unsigned int axis = extent[0] > extent[1] ? (extent[0] > extent[2] ? 0 : 2) : (extent[1] > extent[2] ? 1 : 2);
+            size_t middle = begin + (end - begin) / 2;
+            std::nth_element(triangles.begin() + begin, triangles.begin() + middle, triangles.begin() + end,
+                             [&](unsigned int a, unsigned int b) {
+                                 return centers[a][axis] < centers[b][axis];
+                             });
+            int first = build(begin, middle);
+            int second = build(middle, end);
+            nodes[index].child[0] = first;
+            nodes[index].child[1] = second;
+            return index;
+        }
+
+        // Encodes the clusters once the tree is built and fits the node bounds to them.
+        void encode(int root) {
+            BuildNode &node = nodes[root];
+            if (node.child[0] < 0) {
+                encodeCluster(node);
+                return;
+            }
+            encode(node.child[0]);
+            encode(node.child[1]);
+            const BuildNode &first = nodes[node.child[0]], &second = nodes[node.child[1]];
+            for (size_t i = 0; i < 3; ++i) {
+                node.min[i] = std::min(first.min[i], second.min[i]);
+                node.max[i] = std::max(first.max[i], second.max[i]);
+            }
+        }
+
+        // Picks the power of two step per axis that lets the largest cluster span its grid cells in 16 bits.
+        void chooseGrid() {
+            for (size_t i = 0; i < 3; ++i) {
+                if (clusterExtent[i] <= 0) {
+                    // every cluster is flat along the axis, its vertices keep the float of their coordinate
+                    step[i] = 0;
+                    continue;
+                }
+                int exponent;
+                std::frexp(clusterExtent[i] / 65534.0, &exponent);
+                step[i] = std::ldexp(1.0, exponent);
+                bool fits = false;
+                while (!fits) {
+                    fits = true;
+                    for (const auto &node : nodes) {
+                        if (node.child[0] >= 0) {
+                            continue;
+                        }
+                        Bounds exact = exactBounds(node.begin, node.end);
+                        if ((exact.max[i] - gridOrigin(exact.min[i], (float) step[i])) / step[i] > 65535) {
+                            fits = false;
+                            step[i] *= 2;
+                            break;
+                        }
+                    }
+                }
+            }
+        }
+
+        void write(int root) {
+            if (nodes[root].child[0] < 0) {
+                // the stream always starts with a node record
+                BuildNode top = nodes[root];
+                top.child[0] = root;
+                top.child[1] = -1;
+                top.cluster.clear();
+                nodes.push_back(top);
+                root = (int) nodes.size() - 1;
+            }
+            emit(root);
+        }
+    };
+}
+
+std::vector<unsigned long long> CompactMesh::Encode(const MeshData &mesh, Precision precision) {
+    MeshData source = mesh;
+    if (source.normals.size() != source.positions.size()) {
+        source.computeNormals();
+    }
+    MeshEncoder encoder(source, precision);
+    int root = encoder.build(0, source.indices.size() / 3);
+    if (precision == Quantized16) {
+        encoder.chooseGrid();
+    }
+    encoder.encode(root);
+    encoder.write(root);
+    std::vector<unsigned long long> words(encoder.out.size() / sizeof(unsigned long long));
+    std::memcpy(words.data(), encoder.out.data(), encoder.out.size());
+    return words;
+}
+
+CompactMesh::CompactMesh(const MeshData &mesh, const Material &material, Precision precision) :
+        material(material), storage(Encode(mesh, precision)),
+        data(reinterpret_cast<const unsigned char *>(storage.data())),
+        dataBytes(storage.size() * sizeof(unsigned long long)), trianglesCount(mesh.indices.size() / 3),
+        touched(nullptr), chunkShift(0) {
+}
+
+// the stream starts on its own page so treelets keep their place within pages
+struct MeshFileHeader {
+    char magic[8];
+    unsigned long long trianglesCount;
+    unsigned long long dataBytes;
+    char padding[4096 - 24];
+};
+
+static const char MeshFileMagic[8] = {'R', 'T', 'M', 'E', 'S', 'H', '1', 0};
+
+bool CompactMesh::Save(const std::string &fname) const {
+    std::unique_ptr<MeshFileHeader> header(new MeshFileHeader());
+    std::memcpy(header->magic, MeshFileMagic, sizeof(MeshFileMagic));
+    header->trianglesCount = trianglesCount;
+    header->dataBytes = dataBytes;
+    std::ofstream out(fname, std::ios::out | std::ios::binary);
+    out.write((const char *) header.get(), sizeof(MeshFileHeader));
+    out.write((const char *) data, dataBytes);
+    return (bool) out.flush();
+}
+
+void CompactMesh::decodeCluster(const ClusterRecord *cluster, Point *positions) const {
+    const unsigned char *raw = reinterpret_cast<const unsigned char *>(cluster + 1);
+    if (cluster->precision == Float) {
+        const float *values = reinterpret_cast<const float *>(raw);
+        for (size_t i = 0; i < cluster->vertexCount; ++i) {
+            positions[i] = Point(values[3 * i], values[3 * i + 1], values[3 * i + 2]);
+        }
+    } else {
+        const unsigned short *values = reinterpret_cast<const unsigned short *>(raw);
+        for (size_t i = 0; i < cluster->vertexCount; ++i) {
+            for (size_t k = 0; k < 3; ++k) {
+                positions[i][k] = cluster->origin[k] + values[3 * i + k] * (double) cluster->scale[k];
+            }
+        }
+    }
+}
+
+const unsigned int *CompactMesh::clusterNormals(const ClusterRecord *cluster) const {
+    const unsigned char *raw = reinterpret_cast<const unsigned char *>(cluster + 1);
+    return reinterpret_cast<const unsigned int *>(raw + positionsBytes(cluster->precision, cluster->vertexCount));
+}
+
+const unsigned char *CompactMesh::clusterIndices(const ClusterRecord *cluster) const {
+    return reinterpret_cast<const unsigned char *>(clusterNormals(cluster) + cluster->vertexCount);
+}
+
+void CompactMesh::touch(size_t begin, size_t end) const {
+    for (size_t chunk = begin >> chunkShift; chunk <= (end - 1) >> chunkShift; ++chunk) {
+        if (touched[chunk].load(std::memory_order_relaxed) != ChunkTouched) {
+            touched[chunk].fetch_or(ChunkTouched, std::memory_order_relaxed);
+        }
+    }
+}
+
+bool CompactMesh::intersect(const Point &beamPoint, const Point &direction, Hit &hit) const {
+    return intersect(beamPoint, direction, RayShear(direction), hit);
+}
+
+bool CompactMesh::intersect(const Point &beamPoint, const Point &direction, const RayShear &shear, Hit &hit) const {
+    Point invDir(1.0 / direction[0], 1.0 / direction[1], 1.0 / direction[2]);
+    Point positions[3 * MaxClusterTriangles];
+    struct Entry {
+        unsigned long long offset;
+        Real tNear;
+    } stack[64];
+    int top = 0;
+    stack[top++] = {0, 0};
+    bool found = false;
+    while (top > 0) {
+        Entry entry = stack[--top];
+        if (entry.tNear > hit.t) {
+            continue;
+        }
+        unsigned long long offset = entry.offset & ~1ULL;
+        if (!(entry.offset & 1)) {
+            if (touched != nullptr) {
+                touch(offset, offset + sizeof(NodeRecord));
+            }
+            const NodeRecord *node = reinterpret_cast<const NodeRecord *>(data + offset);
+            Entry children[2];
+            int count = 0;
+            for (size_t c = 0; c < 2; ++c) {
+                Bounds bounds(Point(node->min[c][0], node->min[c][1], node->min[c][2]),
+                              Point(node->max[c][0], node->max[c][1], node->max[c][2]));
+                Real tNear;
+                if (node->child[c] != 0 && bounds.areIntersected(beamPoint, invDir, hit.t, tNear)) {
+                    children[count++] = {node->child[c], tNear};
+                }
+            }
+            // the nearer child is popped first
+            if (count == 2 && children[0].tNear < children[1].tNear) {
+                std::swap(children[0], children[1]);
+            }
+            for (int c = 0; c < count; ++c) {
+                stack[top++] = children[c];
+            }
+            continue;
+        }
+
+        const ClusterRecord *cluster = reinterpret_cast<const ClusterRecord *>(data + offset);
+        if (touched != nullptr) {
+            touch(offset, clusterIndices(cluster) + 3 * cluster->triangleCount - data);
+        }
+        decodeCluster(cluster, positions);
+        const unsigned char *indices = clusterIndices(cluster);
+        for (size_t i = 0; i < cluster->triangleCount; ++i) {
+            Real t, b1, b2;
+            if (shear.intersect<true>(beamPoint, positions[indices[3 * i]], positions[indices[3 * i + 1]],
+                                      positions[indices[3 * i + 2]], t, b1, b2) && closer(t, hit)) {
+                hit.primitive = (size_t) ((const unsigned char *) cluster - data) * MaxClusterTriangles + i;
+                hit.b1 = b1;
+                hit.b2 = b2;
+                found = true;
+            }
+        }
+    }
+    return found;
+}
+
+bool CompactMesh::areIntersected(const Point &beamPoint, const Point &direction, Real &t0) const {
+    return areIntersected(beamPoint, direction, RayShear(direction), t0);
+}
+
+bool CompactMesh::areIntersected(const Point &beamPoint, const Point &direction, const RayShear &shear,
+                                 Real &t0) const {
+    Hit hit;
+    if (intersect(beamPoint, direction, shear, hit)) {
+        t0 = hit.t;
+        return true;
+    }
+    return false;
+}
+
+bool CompactMesh::rasterize(RasterTarget &target) const {
+    Point viewpoint = target.viewpoint();
+    Point positions[3 * MaxClusterTriangles];
+    unsigned long long stack[64];
+    int top = 0;
+    stack[top++] = 0;
+    while (top > 0) {
+        unsigned long long offset = stack[--top];
+        if (!(offset & 1)) {
+            if (touched != nullptr) {
+                touch(offset, offset + sizeof(NodeRecord));
+            }
+            const NodeRecord *node = reinterpret_cast<const NodeRecord *>(data + offset);
+            Bounds bounds[2];
+            Real distances[2];
+            for (size_t c = 0; c < 2; ++c) {
+                bounds[c] = Bounds(Point(node->min[c][0], node->min[c][1], node->min[c][2]),
+                                   Point(node->max[c][0], node->max[c][1], node->max[c][2]));
+                distances[c] = (bounds[c].center() - viewpoint).length();
+            }
+            // the nearer child is popped first
+            size_t first = distances[0] < distances[1] ? 1 : 0;
+            for (size_t c = first; c < first + 2; ++c) {
+                if (node->child[c % 2] != 0 && target.overlaps(bounds[c % 2])) {
+                    stack[top++] = node->child[c % 2];
+                }
+            }
+            continue;
+        }
+
+        offset &= ~1ULL;
+        const ClusterRecord *cluster = reinterpret_cast<const ClusterRecord *>(data + offset);
+        if (touched != nullptr) {
+            touch(offset, clusterIndices(cluster) + 3 * cluster->triangleCount - data);
+        }
+        decodeCluster(cluster, positions);
+        const unsigned char *indices = clusterIndices(cluster);
+        for (size_t i = 0; i < cluster->triangleCount; ++i) {
+            target.triangle(this, (size_t) offset * MaxClusterTriangles + i, positions[indices[3 * i]],
+                            positions[indices[3 * i + 1]], positions[indices[3 * i + 2]], true);
+        }
+    }
+    return true;
+}
+
+bool CompactMesh::intersectPrimitive(const Point &beamPoint, const Point &direction, const RayShear &shear,
+                                     const BasicObject *leaf, size_t primitive, Hit &hit) const {
+    size_t offset = primitive / MaxClusterTriangles;
+    const ClusterRecord *cluster = reinterpret_cast<const ClusterRecord *>(data + offset);
+    if (touched != nullptr) {
+        touch(offset, clusterIndices(cluster) + 3 * cluster->triangleCount - data);
+    }
+    Point positions[3 * MaxClusterTriangles];
+    decodeCluster(cluster, positions);
+    const unsigned char *indices = clusterIndices(cluster) + 3 * (primitive % MaxClusterTriangles);
+    Real t, b1, b2;
+    if (!shear.intersect<true>(beamPoint, positions[indices[0]], positions[indices[1]], positions[indices[2]], t, b1,
+                               b2) || !closer(t, hit)) {
+        return false;
+    }
+    hit.primitive = primitive;
+    hit.b1 = b1;
+    hit.b2 = b2;
+    return true;
+}
+
+Point CompactMesh::getShadingNormal(const Hit &hit, Point &p) const {
+    const ClusterRecord *cluster = reinterpret_cast<const ClusterRecord *>(data + hit.primitive / MaxClusterTriangles);
+    const unsigned int *normals = clusterNormals(cluster);
+    const unsigned char *indices = clusterIndices(cluster) + 3 * (hit.primitive % MaxClusterTriangles);
+    return (decodeNormal(normals[indices[0]]) * (1 - hit.b1 - hit.b2) + decodeNormal(normals[indices[1]]) * hit.b1 +
+            decodeNormal(normals[indices[2]]) * hit.b2).normalized();
+}
+
+Bounds CompactMesh::getBounds() const {
+    const NodeRecord *root = reinterpret_cast<const NodeRecord *>(data);
+    Bounds bounds;
+    for (size_t c = 0; c < 2; ++c) {
+        if (root->child[c] != 0) {
+            bounds.grow(Point(root->min[c][0], root->min[c][1], root->min[c][2]));
+            bounds.grow(Point(root->max[c][0], root->max[c][1], root->max[c][2]));
+        }
+    }
+    return bounds;
+}
+
+constexpr unsigned int MappedChunkShift = 16;
+
+MappedMesh::MappedMesh(const Material &material, const unsigned char *mapping, size_t mappingBytes,
+                       size_t trianglesCount, size_t budgetBytes) :
+        CompactMesh(material, mapping + sizeof(MeshFileHeader), mappingBytes - sizeof(MeshFileHeader), trianglesCount),
+        mapping(mapping), mappingBytes(mappingBytes), budgetBytes(budgetBytes),
+        chunksCount(((mappingBytes - sizeof(MeshFileHeader)) >> MappedChunkShift) + 1),
+        peakResidentBytes(0), stopping(false) {
+    chunks.reset(new std::atomic<unsigned char>[chunksCount]);
+    for (size_t i = 0; i < chunksCount; ++i) {
+        chunks[i] = 0;
+    }
+    touched = chunks.get();
+    chunkShift = MappedChunkShift;
+    monitor = std::thread(&MappedMesh::trimLoop, this);
+}
+
+MappedMesh::~MappedMesh() {
+    {
+        std::lock_guard<std::mutex> lock(monitorMutex);
+        stopping = true;
+    }
+    monitorWakeup.notify_all();
+    monitor.join();
+#ifdef RT_HAVE_MMAP
+    munmap((void *) mapping, mappingBytes);
+#endif
+}
+
+std::unique_ptr<MappedMesh> MappedMesh::Map(const std::string &fname, const Material &material, size_t budgetBytes) {
+#ifdef RT_HAVE_MMAP
+    int fd = open(fname.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return nullptr;
+    }
+    off_t size = lseek(fd, 0, SEEK_END);
+    void *mapping = size > (off_t) sizeof(MeshFileHeader) ? mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0)
+                                                           : MAP_FAILED;
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        return nullptr;
+    }
+    const MeshFileHeader *header = (const MeshFileHeader *) mapping;
+    if (std::memcmp(header->magic, MeshFileMagic, sizeof(MeshFileMagic)) != 0 ||
+        header->dataBytes + sizeof(MeshFileHeader) > (size_t) size) {
+        munmap(mapping, size);
+        return nullptr;
+    }
+    // the traversal order is unpredictable, read-ahead would mostly bring in pages nobody asked for
+    madvise(mapping, size, MADV_RANDOM);
+    return std::unique_ptr<MappedMesh>(new MappedMesh(material, (const unsigned char *) mapping,
+                                                      header->dataBytes + sizeof(MeshFileHeader),
+                                                      header->trianglesCount, budgetBytes));
+#else
+    return nullptr;
+#endif
+}
+
+void MappedMesh::trimLoop() {
+#ifdef RT_HAVE_MMAP
+    const size_t pageSize = sysconf(_SC_PAGESIZE);
+    const size_t chunkBytes = (size_t) 1 << MappedChunkShift;
+    size_t hand = 0;
+
+    std::unique_lock<std::mutex> lock(monitorMutex);
+    while (!monitorWakeup.wait_for(lock, std::chrono::milliseconds(20), [this] { return stopping; })) {
+        size_t present = 0;
+        for (size_t i = 0; i < chunksCount; ++i) {
+            present += (chunks[i].load(std::memory_order_relaxed) & ChunkPresent) ? 1 : 0;
+        }
+        size_t resident = present * chunkBytes;
+        if (resident > peakResidentBytes) {
+            peakResidentBytes = resident;
+        }
+
+        // clock sweep: recently visited chunks get a second chance, the rest is dropped until under budget
+        for (size_t step = 0; budgetBytes != 0 && resident > budgetBytes && step < 2 * chunksCount; ++step) {
+            hand = (hand + 1) % chunksCount;
+            unsigned char state = chunks[hand].load(std::memory_order_relaxed);
+            if (state & ChunkReferenced) {
+                chunks[hand].fetch_and((unsigned char) ~ChunkReferenced, std::memory_order_relaxed);
+            } else if (state & ChunkPresent) {
+                chunks[hand].fetch_and((unsigned char) ~ChunkPresent, std::memory_order_relaxed);
+                size_t begin = (sizeof(MeshFileHeader) + hand * chunkBytes) / pageSize * pageSize;
+                size_t end = std::min(mappingBytes, sizeof(MeshFileHeader) + (hand + 1) * chunkBytes);
+                madvise((void *) (mapping + begin), end - begin, MADV_DONTNEED);
+                resident -= chunkBytes;
+            }
+        }
+    }
+#endif
+}
+
+size_t PeakProcessMemory() {
+#ifdef RT_HAVE_MMAP
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+    return usage.ru_maxrss;
+#else
+    return usage.ru_maxrss * (size_t) 1024;
+#endif
+#else
+    return 0;
+#endif
+}
@@ -0,0 +1,181 @@
+#ifndef RT_MESH_H
+#define RT_MESH_H
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "mygeometry.h"
+
+// Indexed triangle soup as read from disk, normals are optional.
+struct MeshData {
+    std::vector<Point> positions;
+    std::vector<Point> normals;
+    std::vector<unsigned int> indices;
+
+    void computeNormals();
+};
+
+// Reads vertices and (fan-triangulated) faces of a Wavefront OBJ file, normals are recomputed from the faces.
+bool LoadOBJ(const std::string &fname, MeshData &mesh);
+
+MeshData MakeTorus(double radius, double tubeRadius, int rings, int sides);
+
+// Triangle mesh kept in a compact, read-only form: triangles are grouped into small spatial clusters whose vertices
+// are stored as floats or as 16 bit offsets from the cluster origin, with cluster-local 8 bit indices and
+// octahedral-encoded normals. Everything is decoded on the fly while intersecting. Quantized clusters share one grid
+// over the whole mesh, so a vertex of several clusters decodes to the same point in all of them and leaves no cracks.
+//
+// The BVH and the clusters live in one byte stream of treelets: up to a page worth of neighbouring nodes, followed
+// by the clusters they reference and then by the subtrees below them, so a subtree and its triangles are stored
+// together and a ray walking from the root to a leaf touches only a few pages.
+class CompactMesh : public BasicObject {
+public:
+    enum Precision {
+        Float,
+        Quantized16
+    };
+
+    static constexpr int MaxClusterTriangles = 16;
+
+    // bounds of both children and their offsets in the stream: a NodeRecord, a ClusterRecord when the low bit is
+    // set, 0 when there is no such child
+    struct NodeRecord {
+        float min[2][3], max[2][3];
+        unsigned long long child[2];
+    };
+
+    // followed by vertexCount positions, vertexCount normals and 3 * triangleCount indices, padded to 8 bytes
+    struct ClusterRecord {
+        float origin[3], scale[3];
+        unsigned short vertexCount, triangleCount;
+        unsigned int precision;
+    };
+
+private:
+    Material material;
+    std::vector<unsigned long long> storage;
+    const unsigned char *data;
+    size_t dataBytes;
+    size_t trianglesCount;
+
+    void decodeCluster(const ClusterRecord *cluster, Point *positions) const;
+
+    const unsigned int *clusterNormals(const ClusterRecord *cluster) const;
+
+    const unsigned char *clusterIndices(const ClusterRecord *cluster) const;
+
+    // Serialises mesh into the stream layout described above.
+    static std::vector<unsigned long long> Encode(const MeshData &mesh, Precision precision);
+
+protected:
+    enum ChunkState : unsigned char {
+        // mapped in since the chunk was last dropped
+        ChunkPresent = 1,
+        // visited since the last clock sweep
+        ChunkReferenced = 2,
+        ChunkTouched = ChunkPresent | ChunkReferenced
+    };
+
+    // when set, traversal marks every visited chunk of 1 << chunkShift bytes of the stream as ChunkTouched
+    std::atomic<unsigned char> *touched;
+    unsigned int chunkShift;
+
+    // marks the chunks holding bytes [begin, end) of the stream
+    void touch(size_t begin, size_t end) const;
+
+    CompactMesh(const Material &material, const unsigned char *data, size_t dataBytes, size_t trianglesCount) :
+            material(material), data(data), dataBytes(dataBytes), trianglesCount(trianglesCount), touched(nullptr),
+            chunkShift(0) {
+    }
+
+public:
+    CompactMesh(const MeshData &mesh, const Material &material, Precision precision = Quantized16);
+
+    // Writes the stream to a file that MappedMesh can page in later.
+    bool Save(const std::string &fname) const;
+
+    size_t getTrianglesCount() const {
+        return trianglesCount;
+    }
+
+    size_t getMemoryBytes() const {
+        return dataBytes;
+    }
+
+    // triangles are two sided and tested with the watertight test of Triangle
+    bool intersect(const Point &beamPoint, const Point &direction, Hit &hit) const;
+
+    bool intersect(const Point &beamPoint, const Point &direction, const RayShear &shear, Hit &hit) const;
+
+    bool areIntersected(const Point &beamPoint, const Point &direction, Real &t0) const;
+
+    bool areIntersected(const Point &beamPoint, const Point &direction, const RayShear &shear, Real &t0) const;
+
+    // draws the triangles of the clusters in reach of the target, primitive as in Hit
+    bool rasterize(RasterTarget &target) const;
+
+    bool intersectPrimitive(const Point &beamPoint, const Point &direction, const RayShear &shear,
+                            const BasicObject *leaf, size_t primitive, Hit &hit) const;
+
+    Point getShadingNormal(const Hit &hit, Point &p) const;
+
+    Bounds getBounds() const;
+
+    Material getMaterial(Point &p) const {
+        return material;
+    }
+
+    void getMaterials(std::vector<Material> &materials) const {
+        materials.push_back(material);
+    }
+
+    // meshes are shaded through getShadingNormal
+    Point getNormal(Point &p) const {
+        return Point();
+    }
+};
+
+// CompactMesh whose stream stays in a memory-mapped file written by CompactMesh::Save, so the OS pages geometry in
+// on demand. A monitor thread sweeps the mapping every 20 ms and keeps the chunks visited since they were last
+// dropped under a budget at every sweep: chunks not visited since the previous sweep are released (clock replacement)
+// and read back from the file when a ray needs them again. Between sweeps the resident set may exceed the budget.
+class MappedMesh : public CompactMesh {
+    const unsigned char *mapping;
+    size_t mappingBytes;
+    size_t budgetBytes;
+    std::unique_ptr<std::atomic<unsigned char>[]> chunks;
+    size_t chunksCount;
+    std::atomic<size_t> peakResidentBytes;
+
+    std::thread monitor;
+    std::mutex monitorMutex;
+    std::condition_variable monitorWakeup;
+    bool stopping;
+
+    MappedMesh(const Material &material, const unsigned char *mapping, size_t mappingBytes, size_t trianglesCount,
+               size_t budgetBytes);
+
+    void trimLoop();
+
+public:
+    ~MappedMesh();
+
+    // Maps a file written by CompactMesh::Save, budgetBytes of 0 leaves paging entirely to the OS.
+    // Returns nullptr when the file cannot be mapped.
+    static std::unique_ptr<MappedMesh> Map(const std::string &fname, const Material &material, size_t budgetBytes);
+
+    // Chunks mapped in at once, sampled by the monitor thread.
+    size_t getPeakResidentBytes() const {
+        return peakResidentBytes;
+    }
+};
+
+// Peak resident set size of the whole process.
+size_t PeakProcessMemory();
+
+#endif //RT_MESH_H
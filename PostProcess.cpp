@@ -0,0 +1,118 @@
+#include <algorithm>
+#include <cmath>
+
+#include "FastMath.h"
+#include "PostProcess.h"
+
+// thresholds of a 4x4 Bayer matrix in units of one output level
+static const Real BayerMatrix[4][4] = {
+        {0.5 / 16, 8.5 / 16, 2.5 / 16, 10.5 / 16},
+        {12.5 / 16, 4.5 / 16, 14.5 / 16, 6.5 / 16},
+        {3.5 / 16, 11.5 / 16, 1.5 / 16, 9.5 / 16},
+        {15.5 / 16, 7.5 / 16, 13.5 / 16, 5.5 / 16}
+};
+
+// maps a linear channel to [0, 1]
+template<ToneMapping Op>
+static inline Real
+toneMap(Real v) {
+    if (Op == ToneMapReinhard) {
+        v = v / (1 + v);
+    } else if (Op == ToneMapAces) {
+        v = (v * (2.51 * v + 0.03)) / (v * (2.43 * v + 0.59) + 0.14);
+    }
+    return std::max<Real>(0, std::min<Real>(1, v));
+}
+
+template<bool Fast>
+static inline Real
+power(Real v, Real exponent) {
+    return Fast ? FastPow((float) v, (float) exponent) : std::pow(v, exponent);
+}
+
+template<TransferFunction Transfer, bool Fast>
+static inline Real
+encode(Real v) {
+    if (Transfer == TransferGamma22) {
+        return power<Fast>(v, 1 / 2.2);
+    }
+    if (Transfer == TransferSrgb) {
+        return v <= 0.0031308 ? 12.92 * v : 1.055 * power<Fast>(v, 1 / 2.4) - 0.055;
+    }
+    return v;
+}
+
+template<ToneMapping Op, TransferFunction Transfer, bool Fast, bool Dither>
+static void
+processRow(const Pixel *src, unsigned int *dst, int width, int y) {
+#pragma omp simd
+    for (int x = 0; x < width; ++x) {
+        Pixel p = src[x];
+        if (Op == ToneMapNormalize) {
+            Real maxV = std::max(std::max(p[0], p[1]), p[2]);
+            if (maxV > 1) {
+                p = p * (1.0 / maxV);
+            }
+        }
+        Real offset = Dither ? BayerMatrix[y & 3][x & 3] : 0;
+        unsigned int packed = 0;
+        for (int c = 0; c < 3; ++c) {
+            Real v = encode<Transfer, Fast>(toneMap<Op>(p[c]));
+            packed |= std::min(255u, (unsigned int) (255 * v + offset)) << (8 * c);
+        }
+        dst[x] = packed;
+    }
+}
+
+typedef void (*RowKernel)(const Pixel *, unsigned int *, int, int);
+
+template<ToneMapping Op, TransferFunction Transfer, bool Fast>
+static RowKernel
+selectRow(bool dither) {
+    return dither ? processRow<Op, Transfer, Fast, true> : processRow<Op, Transfer, Fast, false>;
+}
+
+template<ToneMapping Op, TransferFunction Transfer>
+static RowKernel
+selectRow(bool fastMath, bool dither) {
+    return fastMath ? selectRow<Op, Transfer, true>(dither) : selectRow<Op, Transfer, false>(dither);
+}
+
+template<ToneMapping Op>
+static RowKernel
+selectRow(TransferFunction transfer, bool fastMath, bool dither) {
+    switch (transfer) {
+        case TransferGamma22:
+            return selectRow<Op, TransferGamma22>(fastMath, dither);
+        case TransferSrgb:
+            return selectRow<Op, TransferSrgb>(fastMath, dither);
+        default:
+            return selectRow<Op, TransferLinear, false>(dither);
+    }
+}
+
+static RowKernel
+selectRow(const PostProcessOptions &options) {
+    switch (options.toneMapping) {
+        case ToneMapClamp:
+            return selectRow<ToneMapClamp>(options.transfer, options.fastMath, options.dither);
+        case ToneMapReinhard:
+            return selectRow<ToneMapReinhard>(options.transfer, options.fastMath, options.dither);
+        case ToneMapAces:
+            return selectRow<ToneMapAces>(options.transfer, options.fastMath, options.dither);
+        default:
+            return selectRow<ToneMapNormalize>(options.transfer, options.fastMath, options.dither);
+    }
+}
+
+std::vector<unsigned int>
+PostProcess(const Pixel *frame, int width, int height, int stride, const PostProcessOptions &options) {
+    std::vector<unsigned int> packed((size_t) width * height);
+    RowKernel row = selectRow(options);
+#pragma omp parallel for
+    for (int i = 0; i < height; ++i) {
+        // bitmaps are stored bottom-up
+        row(&frame[(size_t) i * stride], &packed[(size_t) (height - i - 1) * width], width, i);
+    }
+    return packed;
+}
@@ -0,0 +1,40 @@
+#ifndef RT_POSTPROCESS_H
+#define RT_POSTPROCESS_H
+
+#include <vector>
+
+#include "mygeometry.h"
+
+enum ToneMapping {
+    // scales pixels brighter than 1 back by their largest channel, keeping the hue
+    ToneMapNormalize,
+    ToneMapClamp,
+    ToneMapReinhard,
+    // Narkowicz's fit of the ACES filmic curve
+    ToneMapAces
+};
+
+enum TransferFunction {
+    TransferLinear,
+    TransferGamma22,
+    TransferSrgb
+};
+
+struct PostProcessOptions {
+    ToneMapping toneMapping;
+    TransferFunction transfer;
+    // 4x4 ordered dithering instead of truncation when quantising to 8 bits
+    bool dither;
+    // the transfer functions use FastPow instead of std::pow
+    bool fastMath;
+
+    PostProcessOptions() : toneMapping(ToneMapNormalize), transfer(TransferLinear), dither(false), fastMath(false) {
+    }
+};
+
+// Turns a top-down linear framebuffer with rows stride pixels apart into the bottom-up packed pixels SaveBMP expects.
+// Rows are processed in parallel, each of them with one loop specialised on the options.
+std::vector<unsigned int>
+PostProcess(const Pixel *frame, int width, int height, int stride, const PostProcessOptions &options);
+
+#endif //RT_POSTPROCESS_H
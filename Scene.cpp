@@ -1,111 +1,1738 @@
 #include <vector>
 #include <cstdlib>
 #include <cmath>
-#include <iostream>
+#include <algorithm>
+#include <array>
 #include <omp.h>
 #include <limits>
+#include <memory>
+#include <cstdint>
+#include <cstring>
+#include <chrono>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
 
 #include "mygeometry.h"
+#include "FastMath.h"
+#include "Group.h"
+#include "Denoise.h"
+#include "PostProcess.h"
+#include "Checkpoint.h"
+#include "Scene.h"
+#include "ShadowMap.h"
+#include "TileCandidates.h"
+#include "Texture.h"
+#include "VisibilityBuffer.h"
+
+constexpr Real GlobalLightning = 0.2;
+
+static const Colour BackgroundColour(0.1, 0.05, 0.1);
 
-constexpr double GlobalLightning = 0.2;
+// Part of a ray traced for a pixel, kept so that a later edit can find the pixels whose rays pass through the space
+// an object was moved into. Floats halve the memory, edited bounds are widened to make up for the rounding.
+struct RaySegment {
+    float orig[3], invDir[3], length;
+    // pixel of the tile the ray was traced for
+    unsigned char pixel;
+    // whether the ray left the camera, it can then only cross what the pixel sees
+    bool primary;
+    // light a shadow ray went to, they are traced again when the light moves
+    unsigned short light;
 
-static unsigned int normalisePixel(double pixel) {
-    return (unsigned int) (255 * std::max(0.0, std::min(1.0, pixel)));
+    static constexpr unsigned short NoLight = 0xFFFF;
+
+    RaySegment(const Point &o, const Point &dir, Real length, unsigned int pixel, bool primary,
+               size_t light = NoLight) :
+            length((float) length), pixel((unsigned char) pixel), primary(primary), light((unsigned short) light) {
+        for (size_t k = 0; k < 3; ++k) {
+            orig[k] = (float) o[k];
+            invDir[k] = (float) (1 / dir[k]);
+        }
+    }
+
+    bool crosses(const Bounds &bounds) const {
+        return bounds.areIntersected(Point(orig[0], orig[1], orig[2]), Point(invDir[0], invDir[1], invDir[2]),
+                                     length);
+    }
+};
+
+static_assert(RenderTileSize * RenderTileSize <= 256, "RaySegment::pixel holds the pixels of a tile");
+
+// One bit of a 64 bit set standing for the object, pixels record the objects they depended on this way.
+static inline uint64_t
+signatureBit(const BasicObject *object) {
+    return 1ull << (((uint64_t) (uintptr_t) object * 0x9E3779B97F4A7C15ull) >> 58);
 }
 
-std::vector<unsigned int>
-vPixel2Ui(const std::vector<Pixel> &frame, const int width, const int height) {
-    std::vector<unsigned int> frameUi(frame.size());
-    for (int i = 0; i < height; ++i) {
-        for (int j = 0; j < width; ++j) {
-            Pixel curPixel = frame[i * width + j];
-            double maxV = std::max(std::max(curPixel[0], curPixel[1]), curPixel[2]);
-            if (maxV > 1) {
-                curPixel = curPixel * (1.0 / maxV);
-            }
-            frameUi[(height - i - 1) * width + j] = (normalisePixel(curPixel[0])) |
-                                                    (normalisePixel(curPixel[1]) << 8) |
-                                                    (normalisePixel(curPixel[2]) << 16);
+// Intersection kept for relighting: everything shading needs except the lights.
+struct ShadingNode {
+    // values of reflection and refraction for rays that were not cast or hit nothing
+    enum {
+        NotTraced = -1,
+        Missed = -2
+    };
+
+    // lights whose shadow rays are cached in the nodes
+    static constexpr size_t CachedLights = 32;
+
+    Point point, N, dir;
+    Material material;
+    // nodes of the reflected and refracted rays, counted from the first node of the pixel
+    int reflection, refraction;
+    // which of the first CachedLights lights were blocked
+    uint32_t shadowed;
+
+    ShadingNode(const Point &point, const Point &N, const Point &dir, const Material &material) :
+            point(point), N(N), dir(dir), material(material), reflection(NotTraced), refraction(NotTraced),
+            shadowed(0) {
+    }
+};
+
+struct TraceContext {
+    // last object that blocked a shadow ray, one slot per light
+    std::vector<const BasicObject *> lastOccluder;
+    // angle covered by one pixel, for texture filtering
+    Real pixelSpread;
+    RenderStats stats;
+    // Only set while an IncrementalRenderer records the frame: segments of the rays of the current tile, the pixel
+    // traced and the signature of the objects it depended on.
+    std::vector<RaySegment> *segments;
+    unsigned int pixel;
+    uint64_t signature;
+    // set when the intersections are kept for relighting, the ones of the current pixel start at firstNode
+    std::vector<ShadingNode> *nodes;
+    size_t firstNode;
+    // while relighting, lights whose shadow rays are taken from the nodes
+    uint32_t cachedShadows;
+    // one per light when shadows are looked up first, never set while recording
+    const std::vector<CubeShadowMap> *shadowMaps;
+
+    TraceContext(size_t lightsCount, Real pixelSpread, const std::vector<CubeShadowMap> *shadowMaps = nullptr) :
+            lastOccluder(lightsCount, nullptr), pixelSpread(pixelSpread), stats(), segments(nullptr), pixel(0),
+            signature(0), nodes(nullptr), firstNode(0), cachedShadows(0), shadowMaps(shadowMaps) {
+    }
+};
+
+// pathLength and context.pixelSpread describe the ray cone used to pick the texture mip level: its width at
+// a point t along the ray is (pathLength + t) * spread. A primary ray whose first hit is known already passes it.
+static bool
+objectIntersect(const Point &orig, const Point &dir, const Group &world, Point &hit, Point &N,
+                Material &material, Real pathLength, TraceContext &context, const Hit *primary = nullptr) {
+    Hit nearest;
+    bool found;
+    if (primary != nullptr) {
+        nearest = *primary;
+        found = nearest.object != nullptr;
+    } else {
+        found = world.intersect(orig, dir, nearest);
+    }
+    if (context.segments != nullptr) {
+        // only primary rays start without a path behind them
+        context.segments->emplace_back(orig, dir, nearest.t, context.pixel, pathLength == 0);
+        if (found) {
+            context.signature |= signatureBit(nearest.root);
+        }
+    }
+    if (!found) {
+        return false;
+    }
+    Real spread = context.pixelSpread;
+    hit = orig + dir * nearest.t;
+    // instanced primitives are shaded in their own space
+    Point local = nearest.instance != nullptr ? nearest.instance->pointToLocal(hit) : hit;
+    N = nearest.object->getShadingNormal(nearest, local);
+    if (nearest.instance != nullptr) {
+        N = nearest.instance->normalToWorld(N);
+    }
+    material = nearest.object->getMaterial(local);
+    if (material.texture != nullptr) {
+        UV uv = nearest.object->getUV(local);
+        Colour texel = material.texture->sample(uv[0], uv[1], (pathLength + nearest.t) * spread * uv[2]);
+        for (size_t i = 0; i < 3; ++i) {
+            material.diffusiveParams[i] *= texel[i];
         }
     }
-    return frameUi;
+    return true;
+}
+
+static bool
+isOccluder(const BasicObject *object, const Point &orig, const Point &dir, const RayShear &shear, Real maxDist) {
+    Real dist;
+    return object->areIntersected(orig, dir, shear, dist) && dist >= 0 && dist < maxDist;
+}
+
+static bool
+shadowIntersect(const Point &orig, const Point &dir, Real maxDist, const Group &world,
+                const BasicObject *&lastOccluder, RenderStats &stats) {
+    ++stats.shadowRays;
+    RayShear shear(dir);
+    if (lastOccluder != nullptr && isOccluder(lastOccluder, orig, dir, shear, maxDist)) {
+        ++stats.occluderCacheHits;
+        return true;
+    }
+    return world.occluded(orig, dir, shear, maxDist, lastOccluder);
 }
 
-bool
-objectIntersect(const Point &orig, const Point &dir, const std::vector<BasicObject *> &objects, Point &hit, Point &N,
-                Material &material) {
-    double spheres_dist = MAX_DIST + 1;
-    for (const auto &object : objects) {
-        double dist2O;
-        if (object->areIntersected(orig, dir, dist2O) && dist2O < spheres_dist) {
-            spheres_dist = dist2O;
-            hit = orig + dir * dist2O;
-            N = object->getNormal(hit);
-            material = object->getMaterial(hit);
+template<unsigned Features>
+static inline Point
+unitVector(const Point &v) {
+    return (Features & FeatureFastMath) ? v * FastRsqrt((float) (v * v)) : v.normalized();
+}
+
+// Direct lighting of the hit point plus the colours brought by the reflected and refracted rays. When the hit is kept
+// in node, its shadow rays are stored there or, for context.cachedShadows, read from there.
+template<unsigned Features>
+static Pixel
+shade(const Point &point, const Point &N, const Point &dir, const Material &material,
+      const ReflectionParams &reflectionParams, const RefractionParams &refractionParams,
+      const std::vector<Light> &lights, const Group &world, TraceContext &context, ShadingNode *node = nullptr) {
+    Real lightDiffIntensity = 0, lightSpecIntensity = 0;
+    for (size_t l = 0; l < lights.size(); ++l) {
+        const Light &light = lights[l];
+        Point toLight = light.getPosition() - point;
+        Point lightDirection;
+        Real lightDist;
+        if (Features & FeatureFastMath) {
+            Real lightDist2 = toLight * toLight, invDist = FastRsqrt((float) lightDist2);
+            lightDirection = toLight * invDist;
+            lightDist = lightDist2 * invDist;
+        } else {
+            lightDirection = toLight.normalized();
+            lightDist = toLight.length();
+        }
+
+        if (Features & FeatureShadows) {
+            uint32_t bit = l < ShadingNode::CachedLights ? 1u << l : 0;
+            bool blocked;
+            CubeShadowMap::Visibility visibility = CubeShadowMap::Unknown;
+            if (node != nullptr && (context.cachedShadows & bit)) {
+                blocked = (node->shadowed & bit) != 0;
+            } else if (context.shadowMaps != nullptr &&
+                       (visibility = (*context.shadowMaps)[l].lookup(point, lightDist)) != CubeShadowMap::Unknown) {
+                blocked = visibility == CubeShadowMap::Shadowed;
+                ++context.stats.shadowMapHits;
+            } else {
+                Point shadowOrigin = point + unitVector<Features>(N * (lightDirection * N)) * RayOffset(point);
+                blocked = shadowIntersect(shadowOrigin, lightDirection, lightDist, world, context.lastOccluder[l],
+                                          context.stats);
+                if (context.segments != nullptr) {
+                    if (blocked) {
+                        context.signature |= signatureBit(context.lastOccluder[l]);
+                    } else {
+                        context.segments->emplace_back(shadowOrigin, lightDirection, lightDist,
+                                                       context.pixel, false, l);
+                    }
+                }
+                if (node != nullptr) {
+                    node->shadowed = blocked ? node->shadowed | bit : node->shadowed & ~bit;
+                }
+            }
+            if (blocked) {
+                continue;
+            }
+        }
+        lightDiffIntensity += light.getIntensity() * std::max<Real>(0, lightDirection * N);
+        if (Features & FeatureSpecular) {
+            Real cosine = std::max<Real>(0, lightDirection.reflect(N) * dir);
+            lightSpecIntensity += ((Features & FeatureFastMath) ? FastPow((float) cosine, (float) material.specularParam)
+                                                                : pow(cosine, material.specularParam)) *
+                                  light.getIntensity();
         }
     }
-    return spheres_dist < MAX_DIST;
+    return material.diffusiveParams * (lightDiffIntensity + GlobalLightning) * material.reflectionParams[0] +
+           Pixel(1.0, 1.0, 1.0) * lightSpecIntensity * material.reflectionParams[1] +
+           reflectionParams * material.reflectionParams[2] + refractionParams * material.refractiveParam;
 }
 
+template<unsigned Features, int MaxDepth>
 Pixel
-cast_ray(const Point &orig, const Point &dir, const std::vector<BasicObject *> &objects,
-         const std::vector<Light> &lights, int refLevel = 1) {
+cast_ray(const Point &orig, const Point &dir, const Group &world,
+         const std::vector<Light> &lights, TraceContext &context, int refLevel = 1, Real pathLength = 0,
+         const Hit *primary = nullptr) {
     Point point, N;
     Material material;
-    if (refComplexity < refLevel || !objectIntersect(orig, dir, objects, point, N, material)) {
-        return Colour(0.1, 0.05, 0.1);
+    if (MaxDepth < refLevel ||
+        !objectIntersect(orig, dir, world, point, N, material, pathLength, context, primary)) {
+        return BackgroundColour;
     }
+    pathLength += (point - orig).length();
 
-    Point reflectDirection = dir.reflect(N);
-    Point reflectOrigin = point + (N * (reflectDirection * N)).normalized() * EPS;
+    size_t node = 0;
+    if (context.nodes != nullptr) {
+        node = context.nodes->size();
+        context.nodes->emplace_back(point, N, dir, material);
+    }
+
+    ReflectionParams reflectionParams;
+    if ((Features & FeatureReflection) && material.reflectionParams[2] != 0) {
+        Point reflectDirection = dir.reflect(N);
+        Point reflectOrigin = point + unitVector<Features>(N * (reflectDirection * N)) * RayOffset(point);
+        size_t child = context.nodes != nullptr ? context.nodes->size() : 0;
+        reflectionParams = cast_ray<Features, MaxDepth>(reflectOrigin, reflectDirection, world, lights, context,
+                                                        refLevel + 1, pathLength);
+        if (context.nodes != nullptr) {
+            (*context.nodes)[node].reflection = context.nodes->size() > child ? (int) (child - context.firstNode)
+                                                                              : ShadingNode::Missed;
+        }
+    }
 
-    Point refractDirection = dir.refract(N, material.refractiveIndex).normalize();
-    Point refractOrigin = point + (N * (refractDirection * N)).normalized() * EPS;
+    RefractionParams refractionParams;
+    if ((Features & FeatureRefraction) && material.refractiveParam != 0) {
+        Point refractDirection = unitVector<Features>(dir.refract(N, material.refractiveIndex));
+        Point refractOrigin = point + unitVector<Features>(N * (refractDirection * N)) * RayOffset(point);
+        size_t child = context.nodes != nullptr ? context.nodes->size() : 0;
+        refractionParams = cast_ray<Features, MaxDepth>(refractOrigin, refractDirection, world, lights, context,
+                                                        refLevel + 1, pathLength);
+        if (context.nodes != nullptr) {
+            (*context.nodes)[node].refraction = context.nodes->size() > child ? (int) (child - context.firstNode)
+                                                                              : ShadingNode::Missed;
+        }
+    }
 
-    ReflectionParams reflectionParams = cast_ray(reflectOrigin, reflectDirection, objects, lights, refLevel + 1);
-    RefractionParams refractionParams = cast_ray(refractOrigin, refractDirection, objects, lights, refLevel + 1);
+    return shade<Features>(point, N, dir, material, reflectionParams, refractionParams, lights, world, context,
+                           context.nodes != nullptr ? &(*context.nodes)[node] : nullptr);
+}
+
+template<unsigned Features>
+static Pixel
+relight(ShadingNode *nodes, int index, const Group &world, const std::vector<Light> &lights,
+        TraceContext &context);
+
+// colour of a ray kept in the shading nodes of a pixel
+template<unsigned Features>
+static inline Pixel
+relightRay(ShadingNode *nodes, int index, const Group &world, const std::vector<Light> &lights,
+           TraceContext &context) {
+    if (index == ShadingNode::NotTraced) {
+        return Pixel();
+    }
+    return index == ShadingNode::Missed ? BackgroundColour : relight<Features>(nodes, index, world, lights, context);
+}
 
-    double lightDiffIntensity = 0, lightSpecIntensity = 0;
-    for (const auto &light : lights) {
-        Point lightDirection = (light.getPosition() - point).normalized();
+// Shades a kept intersection again, only shadow rays of the lights that moved are traced.
+template<unsigned Features>
+static Pixel
+relight(ShadingNode *nodes, int index, const Group &world, const std::vector<Light> &lights,
+        TraceContext &context) {
+    ShadingNode &node = nodes[index];
+    ReflectionParams reflectionParams = relightRay<Features>(nodes, node.reflection, world, lights, context);
+    RefractionParams refractionParams = relightRay<Features>(nodes, node.refraction, world, lights, context);
+    return shade<Features>(node.point, node.N, node.dir, node.material, reflectionParams, refractionParams, lights,
+                           world, context, &node);
+}
+
+// Linear framebuffer whose rows are padded to whole tiles and which starts on a cache line. A tile row then covers
+// whole cache lines, so tiles committed by different threads never share one. The pixels are left unset, clearTile
+// sets them, so that a framebuffer is first touched by the threads that render it.
+class FrameBuffer {
+    static constexpr size_t CacheLineSize = 64;
+
+    std::unique_ptr<unsigned char[]> storage;
+
+public:
+    Pixel *pixels;
+    int stride;
+
+    FrameBuffer(int width, int height) : stride((width + RenderTileSize - 1) / RenderTileSize * RenderTileSize) {
+        storage.reset(new unsigned char[(size_t) stride * height * sizeof(Pixel) + CacheLineSize]);
+        size_t misalignment = (size_t) storage.get() % CacheLineSize;
+        pixels = reinterpret_cast<Pixel *>(storage.get() + (misalignment ? CacheLineSize - misalignment : 0));
+    }
+
+    // the rows of the tile starting at (i0, j0), padding included
+    void clearTile(int i0, int j0, int tileHeight) {
+        for (int j = j0; j < j0 + tileHeight; ++j) {
+            for (int i = i0; i < i0 + RenderTileSize; ++i) {
+                new(&pixels[(size_t) j * stride + i]) Pixel();
+            }
+        }
+    }
+};
 
-        double lightDist = (light.getPosition() - point).length();
-        Point shadowOrigin = point + (N * (lightDirection * N)).normalized() * EPS;
-        Point shadowP, shadowNormal;
-        Material tempMaterial;
-        bool intersect = objectIntersect(shadowOrigin, lightDirection, objects, shadowP, shadowNormal, tempMaterial);
-        if (intersect && (shadowP - shadowOrigin).length() < lightDist) {
+// A view as the kernels see it: where its pixels go and how many of the job's tiles are its, the tiles of a job are
+// numbered view after view.
+struct FrameView {
+    const Camera *camera;
+    FrameBuffer *framebuffer;
+    // first hits of the path tracer's primary rays, summed over the samples
+    DenoiseGuides *guides;
+    // objects the primary rays of every tile are tested against, instead of the BVH
+    const TileCandidates *candidates;
+    // the same rays from the primitives rasterized for every pixel, candidates is set as well
+    const VisibilityBuffer *visibility;
+    // Time budgeted frames: renderFrame traces every steps[t]-th pixel of tile t in both directions, 0 leaves the
+    // tile as it is, and writes the seconds each tile took to costs.
+    const unsigned char *steps;
+    double *costs;
+    int width, height;
+    int tilesX, tilesCount;
+
+    FrameView(const View &view, FrameBuffer &framebuffer) :
+            camera(&view.camera), framebuffer(&framebuffer), guides(nullptr), candidates(nullptr), visibility(nullptr),
+            steps(nullptr), costs(nullptr), width(view.width), height(view.height),
+            tilesX((view.width + RenderTileSize - 1) / RenderTileSize),
+            tilesCount(tilesX * ((view.height + RenderTileSize - 1) / RenderTileSize)) {
+    }
+};
+
+// Finds the view tile t of a job belongs to and makes t the index of the tile inside the view.
+static const FrameView &
+viewOfTile(const std::vector<FrameView> &frames, int &t) {
+    size_t view = 0;
+    while (t >= frames[view].tilesCount) {
+        t -= frames[view].tilesCount;
+        ++view;
+    }
+    return frames[view];
+}
+
+// Clears the framebuffers of a job tile by tile with the schedule the kernels then render them with. With pinned
+// threads the schedule is static, the same tiles go to the same threads, and every page is placed on the NUMA node
+// of a thread that writes it.
+static void
+clearFrames(const std::vector<FrameView> &frames) {
+    int tilesCount = 0;
+    for (const FrameView &frame : frames) {
+        tilesCount += frame.tilesCount;
+    }
+#pragma omp parallel for schedule(runtime)
+    for (int jobTile = 0; jobTile < tilesCount; ++jobTile) {
+        int t = jobTile;
+        const FrameView &view = viewOfTile(frames, t);
+        int i0 = t % view.tilesX * RenderTileSize, j0 = t / view.tilesX * RenderTileSize;
+        view.framebuffer->clearTile(i0, j0, std::min(view.height - j0, RenderTileSize));
+    }
+}
+
+// What an IncrementalRenderer keeps between renders: the linear frame, the ray segments of every tile and, for every
+// pixel, whether it has to be traced again and the signature of the objects it depended on.
+struct FrameRecord {
+    FrameBuffer framebuffer;
+    std::vector<std::vector<RaySegment>> segments;
+    std::vector<uint64_t> signatures;
+    std::vector<unsigned char> dirty;
+    // When relightable, the shading nodes of every tile are kept as well, those of pixel p of a tile are
+    // [firstNode[p], firstNode[p + 1]). With relight set the pixels that are not dirty are shaded again from them,
+    // reusing the shadow rays of movedLights' complement.
+    bool relightable, relight;
+    uint32_t movedLights;
+    std::vector<Light> lights;
+    std::vector<std::vector<ShadingNode>> nodes;
+    std::vector<std::vector<unsigned int>> firstNode;
+    // kernel the nodes were traced with
+    unsigned features;
+    int maxDepth;
+
+    FrameRecord(int width, int height, bool relightable, unsigned features, int maxDepth) :
+            framebuffer(width, height),
+            segments((size_t) ((width + RenderTileSize - 1) / RenderTileSize) *
+                     ((height + RenderTileSize - 1) / RenderTileSize)),
+            signatures((size_t) width * height, 0), dirty((size_t) width * height, 1), relightable(relightable),
+            relight(false), movedLights(0), nodes(relightable ? segments.size() : 0),
+            firstNode(relightable ? segments.size() : 0,
+                      std::vector<unsigned int>(RenderTileSize * RenderTileSize + 1, 0)),
+            features(features), maxDepth(maxDepth) {
+        for (int j0 = 0; j0 < height; j0 += RenderTileSize) {
+            for (int i0 = 0; i0 < width; i0 += RenderTileSize) {
+                framebuffer.clearTile(i0, j0, std::min(height - j0, RenderTileSize));
+            }
+        }
+    }
+};
+
+// Place of tile t of a job in the checkpoint of a Whitted frame, the tiles are kept whole in job order.
+static Pixel *
+checkpointTile(Checkpoint &checkpoint, int t) {
+    return (Pixel *) checkpoint.getData() + (size_t) t * RenderTileSize * RenderTileSize;
+}
+
+// Binds every thread of the OpenMP team to its own CPU out of those the process may run on.
+static void
+pinThreads() {
+#ifdef __linux__
+    cpu_set_t allowed;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        return;
+    }
+    std::vector<int> cpus;
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, &allowed)) {
+            cpus.push_back(cpu);
+        }
+    }
+#pragma omp parallel
+    {
+        cpu_set_t own;
+        CPU_ZERO(&own);
+        CPU_SET(cpus[omp_get_thread_num() % cpus.size()], &own);
+        pthread_setaffinity_np(pthread_self(), sizeof(own), &own);
+    }
+#endif
+}
+
+template<unsigned Features, int MaxDepth>
+static void
+renderFrame(const Group &world, const std::vector<Light> &lights, const std::vector<FrameView> &frames,
+            RenderStats &total, std::atomic<size_t> &doneTiles, const std::atomic<bool> &cancelled,
+            FrameRecord *record, const std::vector<CubeShadowMap> *shadowMaps, Checkpoint *checkpoint) {
+    int tilesCount = 0;
+    for (const FrameView &frame : frames) {
+        tilesCount += frame.tilesCount;
+    }
+
+#pragma omp parallel
+    {
+        // every thread keeps its own occluder cache, so no synchronisation is needed in cast_ray
+        TraceContext context(lights.size(), 0, shadowMaps);
+        // tiles are traced into a buffer of the thread and committed row by row once finished
+        std::vector<Pixel> tile(RenderTileSize * RenderTileSize);
+        std::vector<Hit> primary(RenderTileSize * RenderTileSize);
+#pragma omp for schedule(runtime)
+        for (int jobTile = 0; jobTile < tilesCount; ++jobTile) {
+            // tiles already started are finished, the remaining ones are skipped
+            if (cancelled.load(std::memory_order_relaxed)) {
+                continue;
+            }
+            if (checkpoint != nullptr && checkpoint->isRestored(jobTile)) {
+                doneTiles.fetch_add(1, std::memory_order_relaxed);
+                continue;
+            }
+            int t = jobTile;
+            const FrameView &view = viewOfTile(frames, t);
+            const int step = view.steps != nullptr ? view.steps[t] : 1;
+            if (step == 0) {
+                doneTiles.fetch_add(1, std::memory_order_relaxed);
+                continue;
+            }
+            auto started = std::chrono::steady_clock::now();
+            const Camera &camera = *view.camera;
+            FrameBuffer &framebuffer = *view.framebuffer;
+            const int width = view.width, height = view.height, tilesX = view.tilesX;
+            context.pixelSpread = camera.pixelSpread(height);
+            int i0 = t % tilesX * RenderTileSize, j0 = t / tilesX * RenderTileSize;
+            int tileWidth = std::min(width - i0, RenderTileSize), tileHeight = std::min(height - j0, RenderTileSize);
+            // shading nodes of the tile and the first node of each pixel, rebuilt every time the tile is rendered
+            std::vector<ShadingNode> nodes;
+            std::vector<unsigned int> first;
+            if (record != nullptr) {
+                int dirty = 0;
+                for (int j = 0; j < tileHeight; j++) {
+                    dirty += std::count(&record->dirty[(size_t) (j0 + j) * width + i0],
+                                        &record->dirty[(size_t) (j0 + j) * width + i0 + tileWidth], 1);
+                }
+                if (dirty == 0 && !record->relight) {
+                    doneTiles.fetch_add(1, std::memory_order_relaxed);
+                    continue;
+                }
+                // segments of the pixels traced again, and of the shadow rays when relighting, are replaced
+                std::vector<RaySegment> &segments = record->segments[t];
+                segments.erase(std::remove_if(segments.begin(), segments.end(), [&](const RaySegment &segment) {
+                    return (record->relight && segment.light != RaySegment::NoLight &&
+                            (segment.light >= ShadingNode::CachedLights ||
+                             (record->movedLights >> segment.light & 1))) ||
+                           record->dirty[(size_t) (j0 + segment.pixel / RenderTileSize) * width + i0 +
+                                         segment.pixel % RenderTileSize] != 0;
+                }), segments.end());
+                context.segments = &segments;
+                // the lists only change when pixels are traced again
+                context.nodes = record->relightable && dirty > 0 ? &nodes : nullptr;
+            }
+            if (view.visibility != nullptr) {
+                view.visibility->traceTile(t, primary.data(), step);
+            } else if (view.candidates != nullptr) {
+                view.candidates->traceTile(t, primary.data(), step);
+            }
+            for (int j = 0; j < tileHeight; j++) {
+                for (int i = 0; i < tileWidth; i++) {
+                    if (i % step != 0 || j % step != 0) {
+                        continue;
+                    }
+                    size_t pixel = (size_t) (j0 + j) * width + i0 + i;
+                    context.pixel = j * RenderTileSize + i;
+                    // pixels past the edge of the frame get empty lists
+                    while (context.nodes != nullptr && first.size() <= context.pixel) {
+                        first.push_back((unsigned int) nodes.size());
+                    }
+                    if (record != nullptr && !record->dirty[pixel]) {
+                        ShadingNode *kept = nullptr;
+                        size_t keptCount = 0;
+                        if (record->relightable) {
+                            const std::vector<unsigned int> &oldFirst = record->firstNode[t];
+                            kept = record->nodes[t].data() + oldFirst[context.pixel];
+                            keptCount = oldFirst[context.pixel + 1] - oldFirst[context.pixel];
+                            // moved to the new list of the tile when it is being rebuilt
+                            if (context.nodes != nullptr && keptCount > 0) {
+                                size_t begin = nodes.size();
+                                nodes.insert(nodes.end(), kept, kept + keptCount);
+                                kept = &nodes[begin];
+                            }
+                        }
+                        if (record->relight) {
+                            context.signature = record->signatures[pixel];
+                            context.cachedShadows = ~record->movedLights;
+                            tile[j * RenderTileSize + i] = keptCount > 0 ?
+                                                           relight<Features>(kept, 0, world, lights, context) :
+                                                           BackgroundColour;
+                            record->signatures[pixel] = context.signature;
+                        } else {
+                            tile[j * RenderTileSize + i] = framebuffer.pixels[(size_t) (j0 + j) * framebuffer.stride +
+                                                                              i0 + i];
+                        }
+                        continue;
+                    }
+                    context.signature = 0;
+                    context.cachedShadows = 0;
+                    context.firstNode = nodes.size();
+                    tile[j * RenderTileSize + i] = cast_ray<Features, MaxDepth>(
+                            camera.getPosition(), camera.direction(i0 + i, j0 + j, width, height), world, lights,
+                            context, 1, 0, view.candidates != nullptr ? &primary[context.pixel] : nullptr);
+                    if (record != nullptr) {
+                        record->signatures[pixel] = context.signature;
+                        record->dirty[pixel] = 0;
+                    }
+                }
+            }
+            // every block of a coarse tile takes the colour of its traced corner
+            if (step > 1) {
+                for (int j = 0; j < tileHeight; j++) {
+                    for (int i = 0; i < tileWidth; i++) {
+                        tile[j * RenderTileSize + i] = tile[(j - j % step) * RenderTileSize + i - i % step];
+                    }
+                }
+            }
+            if (view.costs != nullptr) {
+                view.costs[t] = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+            }
+            if (context.nodes != nullptr) {
+                first.resize(RenderTileSize * RenderTileSize + 1, (unsigned int) nodes.size());
+                record->nodes[t].swap(nodes);
+                record->firstNode[t].swap(first);
+            }
+            for (int j = 0; j < tileHeight; j++) {
+                std::copy_n(&tile[j * RenderTileSize], tileWidth,
+                            &framebuffer.pixels[(size_t) (j0 + j) * framebuffer.stride + i0]);
+            }
+            if (checkpoint != nullptr) {
+                std::copy(tile.begin(), tile.end(), checkpointTile(*checkpoint, jobTile));
+                checkpoint->append(jobTile);
+            }
+            doneTiles.fetch_add(1, std::memory_order_relaxed);
+        }
+#pragma omp critical
+        total += context.stats;
+    }
+}
+
+// A reflected or refracted ray waiting to be traced, what it brings is added to its pixel scaled by weight.
+struct QueuedRay {
+    Point orig, dir;
+    Real weight, pathLength;
+    unsigned int pixel;
+};
+
+// Spreads the low 9 bits of v out to every third bit.
+static inline uint32_t
+spreadBits(uint32_t v) {
+    v &= 0x1FF;
+    v = (v | v << 16) & 0x30000FF;
+    v = (v | v << 8) & 0x300F00F;
+    v = (v | v << 4) & 0x30C30C3;
+    v = (v | v << 2) & 0x9249249;
+    return v;
+}
+
+// Order to trace rays in: by the octant of their direction, then along a Morton curve through the box of their
+// origins, so rays next to each other walk the same BVH nodes in the same order. The key has the octant in its top
+// 3 bits and the 27 bit Morton code of a 512^3 grid at the bottom.
+static void
+sortRays(const std::vector<QueuedRay> &rays, std::vector<std::pair<uint32_t, unsigned int>> &order) {
+    Bounds bounds;
+    for (const QueuedRay &ray : rays) {
+        bounds.grow(ray.orig);
+    }
+    Point extent = bounds.max - bounds.min;
+    order.resize(rays.size());
+    for (size_t r = 0; r < rays.size(); ++r) {
+        const QueuedRay &ray = rays[r];
+        uint32_t key = (ray.dir[0] < 0) << 29 | (ray.dir[1] < 0) << 30 | (uint32_t) (ray.dir[2] < 0) << 31;
+        for (int axis = 0; axis < 3; ++axis) {
+            Real cell = extent[axis] > 0 ? (ray.orig[axis] - bounds.min[axis]) / extent[axis] * 511 : 0;
+            key |= spreadBits((uint32_t) cell) << axis;
+        }
+        order[r] = std::make_pair(key, (unsigned int) r);
+    }
+    std::sort(order.begin(), order.end());
+}
+
+// Queues a secondary ray of a pixel, or adds the background colour cast_ray returns past MaxDepth right away.
+template<int MaxDepth>
+static inline void
+queueRay(int level, const Point &orig, const Point &dir, Real weight, Real pathLength, unsigned int pixel,
+         std::vector<QueuedRay> &queue, std::vector<Pixel> &tile) {
+    if (level > MaxDepth) {
+        tile[pixel] += BackgroundColour * weight;
+    } else {
+        queue.push_back({orig, dir, weight, pathLength, pixel});
+    }
+}
+
+// renderFrame tracing each tile breadth first: the rays of every level of the ray trees are gathered, sorted with
+// sortRays and traced together. The colour of a ray tree is a weighted sum of the direct lighting at its hits, so
+// every hit simply adds its share to the pixel. Frames come out the same as with cast_ray up to rounding. It takes
+// no FrameRecord, frames of an IncrementalRenderer are always rendered by renderFrame.
+template<unsigned Features, int MaxDepth>
+static void
+renderFrameSorted(const Group &world, const std::vector<Light> &lights, const std::vector<FrameView> &frames,
+                  RenderStats &total, std::atomic<size_t> &doneTiles, const std::atomic<bool> &cancelled,
+                  FrameRecord *, const std::vector<CubeShadowMap> *shadowMaps, Checkpoint *checkpoint) {
+    int tilesCount = 0;
+    for (const FrameView &frame : frames) {
+        tilesCount += frame.tilesCount;
+    }
+
+#pragma omp parallel
+    {
+        TraceContext context(lights.size(), 0, shadowMaps);
+        std::vector<Pixel> tile(RenderTileSize * RenderTileSize);
+        std::vector<QueuedRay> rays, next;
+        std::vector<std::pair<uint32_t, unsigned int>> order;
+        std::vector<Hit> primary(RenderTileSize * RenderTileSize);
+#pragma omp for schedule(runtime)
+        for (int jobTile = 0; jobTile < tilesCount; ++jobTile) {
+            if (cancelled.load(std::memory_order_relaxed)) {
+                continue;
+            }
+            if (checkpoint != nullptr && checkpoint->isRestored(jobTile)) {
+                doneTiles.fetch_add(1, std::memory_order_relaxed);
+                continue;
+            }
+            int t = jobTile;
+            const FrameView &view = viewOfTile(frames, t);
+            const Camera &camera = *view.camera;
+            FrameBuffer &framebuffer = *view.framebuffer;
+            const int width = view.width, height = view.height, tilesX = view.tilesX;
+            context.pixelSpread = camera.pixelSpread(height);
+            int i0 = t % tilesX * RenderTileSize, j0 = t / tilesX * RenderTileSize;
+            int tileWidth = std::min(width - i0, RenderTileSize), tileHeight = std::min(height - j0, RenderTileSize);
+
+            // primary rays are coherent already and go in scanline order
+            if (view.visibility != nullptr) {
+                view.visibility->traceTile(t, primary.data());
+            } else if (view.candidates != nullptr) {
+                view.candidates->traceTile(t, primary.data());
+            }
+            rays.clear();
+            order.clear();
+            for (int j = 0; j < tileHeight; j++) {
+                for (int i = 0; i < tileWidth; i++) {
+                    unsigned int pixel = j * RenderTileSize + i;
+                    tile[pixel] = Pixel();
+                    order.emplace_back(0, (unsigned int) rays.size());
+                    rays.push_back({camera.getPosition(), camera.direction(i0 + i, j0 + j, width, height), 1, 0,
+                                    pixel});
+                }
+            }
+            for (int level = 1; !rays.empty(); ++level) {
+                if (level > 1) {
+                    sortRays(rays, order);
+                }
+                next.clear();
+                for (const auto &entry : order) {
+                    const QueuedRay &ray = rays[entry.second];
+                    Point point, N;
+                    Material material;
+                    if (!objectIntersect(ray.orig, ray.dir, world, point, N, material, ray.pathLength, context,
+                                         level == 1 && view.candidates != nullptr ? &primary[ray.pixel] : nullptr)) {
+                        tile[ray.pixel] += BackgroundColour * ray.weight;
+                        continue;
+                    }
+                    Real pathLength = ray.pathLength + (point - ray.orig).length();
+                    tile[ray.pixel] += shade<Features>(point, N, ray.dir, material, ReflectionParams(),
+                                                       RefractionParams(), lights, world, context) * ray.weight;
+
+                    if ((Features & FeatureReflection) && material.reflectionParams[2] != 0) {
+                        Point reflectDirection = ray.dir.reflect(N);
+                        Point reflectOrigin = point + unitVector<Features>(N * (reflectDirection * N)) *
+                                                      RayOffset(point);
+                        queueRay<MaxDepth>(level + 1, reflectOrigin, reflectDirection,
+                                           ray.weight * material.reflectionParams[2], pathLength, ray.pixel, next,
+                                           tile);
+                    }
+                    if ((Features & FeatureRefraction) && material.refractiveParam != 0) {
+                        Point refractDirection = unitVector<Features>(ray.dir.refract(N, material.refractiveIndex));
+                        Point refractOrigin = point + unitVector<Features>(N * (refractDirection * N)) *
+                                                      RayOffset(point);
+                        queueRay<MaxDepth>(level + 1, refractOrigin, refractDirection,
+                                           ray.weight * material.refractiveParam, pathLength, ray.pixel, next, tile);
+                    }
+                }
+                rays.swap(next);
+            }
+
+            for (int j = 0; j < tileHeight; j++) {
+                std::copy_n(&tile[j * RenderTileSize], tileWidth,
+                            &framebuffer.pixels[(size_t) (j0 + j) * framebuffer.stride + i0]);
+            }
+            if (checkpoint != nullptr) {
+                std::copy(tile.begin(), tile.end(), checkpointTile(*checkpoint, jobTile));
+                checkpoint->append(jobTile);
+            }
+            doneTiles.fetch_add(1, std::memory_order_relaxed);
+        }
+#pragma omp critical
+        total += context.stats;
+    }
+}
+
+// PCG32 by M. E. O'Neill. The path tracer keys it by pixel and sample, so every sample gets the same numbers
+// whichever thread traces it and the image does not depend on the number of threads.
+class Pcg32 {
+    uint64_t state, increment;
+
+public:
+    Pcg32(uint64_t seed, uint64_t stream) : state(0), increment(stream << 1u | 1u) {
+        next();
+        state += seed;
+        next();
+    }
+
+    uint32_t next() {
+        uint64_t old = state;
+        state = old * 6364136223846793005ull + increment;
+        uint32_t shifted = (uint32_t) (((old >> 18u) ^ old) >> 27u);
+        uint32_t rotation = (uint32_t) (old >> 59u);
+        return (shifted >> rotation) | (shifted << ((32 - rotation) & 31));
+    }
+
+    // uniform in [0, 1), 24 bits so that single precision never rounds it up to 1
+    Real uniform() {
+        return (next() >> 8) * (1.0 / 16777216);
+    }
+};
+
+static unsigned
+greatestCommonDivisor(unsigned a, unsigned b) {
+    while (b != 0) {
+        unsigned r = a % b;
+        a = b;
+        b = r;
+    }
+    return a;
+}
+
+// Stratified samples of the unit square: the first strata^2 samples of a pixel fall into distinct cells, the order
+// of the cells is shuffled per pixel and per use so that different dimensions are not correlated.
+struct Strata {
+    unsigned strata;
+    uint32_t key;
+
+    Strata(int samples, uint32_t key) : strata((unsigned) std::sqrt((double) samples)), key(key) {
+    }
+
+    void sample(int s, unsigned dimension, Pcg32 &random, Real &u, Real &v) const {
+        u = random.uniform();
+        v = random.uniform();
+        unsigned cells = strata * strata;
+        if (strata < 2 || (unsigned) s >= cells) {
+            return;
+        }
+        // affine maps with a factor coprime to the number of cells permute them
+        uint32_t hash = (key ^ (dimension * 0x9E3779B9u)) * 0x85EBCA6Bu;
+        unsigned factor = (hash % cells) | 1;
+        while (greatestCommonDivisor(factor, cells) != 1) {
+            factor += 2;
+        }
+        unsigned cell = (unsigned) (((uint64_t) factor * s + (hash >> 16)) % cells);
+        u = (cell % strata + u) / strata;
+        v = (cell / strata + v) / strata;
+    }
+};
+
+// unit vectors u and v completing w to an orthonormal basis
+static void
+basis(const Point &w, Point &u, Point &v) {
+    u = w.cross(std::abs(w[0]) < 0.9 ? Point(1, 0, 0) : Point(0, 1, 0)).normalized();
+    v = w.cross(u);
+}
+
+// the samples a path takes from its Strata, the rest come from the generator
+enum {
+    PixelDimension,
+    LightDimension,
+    BounceDimension
+};
+
+// bounces before Russian roulette may end a path, and the hard limit
+constexpr int PathRouletteDepth = 3;
+constexpr int PathMaxDepth = 32;
+
+// Direction towards a point of the light seen from point, uniform over the cone the sphere covers, and the distance
+// to that point. Point lights and points inside the sphere get the centre.
+static Point
+sampleLight(const Light &light, const Point &point, Real u, Real v, Real &distance) {
+    Point toCentre = light.getPosition() - point;
+    Real centreDist = toCentre.length();
+    Point w = toCentre * (1 / centreDist);
+    Real radius = light.getRadius();
+    if (radius <= 0 || centreDist <= radius) {
+        distance = centreDist;
+        return w;
+    }
+    Real sinMax2 = radius * radius / (centreDist * centreDist);
+    Real cosMax = std::sqrt(std::max<Real>(0, 1 - sinMax2));
+    Real cosTheta = 1 - u * (1 - cosMax), sinTheta = std::sqrt(std::max<Real>(0, 1 - cosTheta * cosTheta));
+    Real phi = 2 * M_PI * v;
+    Point a, b;
+    basis(w, a, b);
+    Point dir = a * (sinTheta * std::cos(phi)) + b * (sinTheta * std::sin(phi)) + w * cosTheta;
+    // nearer intersection of the ray with the sphere
+    Real along = centreDist * cosTheta;
+    distance = along - std::sqrt(std::max<Real>(0, radius * radius - centreDist * centreDist + along * along));
+    return dir;
+}
+
+// One sample of the light arriving along the ray. Direct light is gathered at every hit from one point of each
+// light, with the same terms the Whitted kernel uses, and the path goes on along one lobe of the material picked
+// in proportion to its weight: the diffuse one (cosine-weighted), the mirror or refraction. Lights are not hit by
+// the path itself, and the background lights the scene instead of the constant ambient term.
+// The normal, diffuse colour and distance of the first hit are reported for the denoiser.
+static Pixel
+tracePath(Point orig, Point dir, const Group &world, const std::vector<Light> &lights, bool shadows,
+          TraceContext &context, Pcg32 &random, const Strata &strata, int s, Point &firstNormal, Colour &firstAlbedo,
+          Real &firstDepth) {
+    Pixel radiance, throughput(1, 1, 1);
+    firstNormal = firstAlbedo = Point();
+    firstDepth = MAX_DIST;
+    for (int depth = 0; depth < PathMaxDepth; ++depth) {
+        Point point, N;
+        Material material;
+        if (!objectIntersect(orig, dir, world, point, N, material, 0, context)) {
+            return radiance + throughput.modulated(BackgroundColour);
+        }
+        // normal on the side the ray came from
+        Point facing = dir * N < 0 ? N : -N;
+        if (depth == 0) {
+            firstNormal = facing;
+            firstAlbedo = material.diffusiveParams * material.reflectionParams[0];
+            firstDepth = (point - orig).length();
+        }
+
+        for (size_t l = 0; l < lights.size(); ++l) {
+            Real u, v, lightDist;
+            if (depth == 0) {
+                strata.sample(s, LightDimension + 2 * l, random, u, v);
+            } else {
+                u = random.uniform();
+                v = random.uniform();
+            }
+            Point lightDirection = sampleLight(lights[l], point, u, v, lightDist);
+            if (lightDirection * facing <= 0) {
+                continue;
+            }
+            Point shadowOrigin = point + facing * RayOffset(point);
+            if (shadows && shadowIntersect(shadowOrigin, lightDirection, lightDist, world, context.lastOccluder[l],
+                                           context.stats)) {
+                continue;
+            }
+            Real intensity = lights[l].getIntensity();
+            Real cosine = std::max<Real>(0, lightDirection.reflect(N) * dir);
+            radiance += throughput.modulated(material.diffusiveParams * (intensity * (lightDirection * facing)) *
+                                             material.reflectionParams[0] +
+                                             Pixel(1, 1, 1) * (pow(cosine, material.specularParam) * intensity *
+                                                               material.reflectionParams[1]));
+        }
+
+        Pixel diffuse = material.diffusiveParams * material.reflectionParams[0];
+        Real diffuseWeight = std::max<Real>(0, (diffuse[0] + diffuse[1] + diffuse[2]) / 3);
+        Real mirrorWeight = std::max<Real>(0, material.reflectionParams[2]);
+        Real refractionWeight = std::max<Real>(0, material.refractiveParam);
+        Real total = diffuseWeight + mirrorWeight + refractionWeight;
+        if (total <= 0) {
+            break;
+        }
+        // survival probability follows the throughput, which keeps the weights of the paths that go on bounded
+        if (depth >= PathRouletteDepth) {
+            Real survival = std::min<Real>(1, std::max(std::max(throughput[0], throughput[1]), throughput[2]) *
+                                              std::min<Real>(1, total));
+            if (random.uniform() >= survival) {
+                break;
+            }
+            throughput = throughput * (1 / survival);
+        }
+
+        Real u, v;
+        if (depth == 0) {
+            strata.sample(s, BounceDimension + 2 * lights.size(), random, u, v);
+        } else {
+            u = random.uniform();
+            v = random.uniform();
+        }
+        // u picks the lobe and is then rescaled to [0, 1) for the lobe itself
+        Real pick = u * total;
+        if (pick < diffuseWeight) {
+            u = pick / diffuseWeight;
+            Real r = std::sqrt(u), phi = 2 * M_PI * v;
+            Point a, b;
+            basis(facing, a, b);
+            dir = a * (r * std::cos(phi)) + b * (r * std::sin(phi)) + facing * std::sqrt(std::max<Real>(0, 1 - u));
+            throughput = throughput.modulated(diffuse) * (total / diffuseWeight);
+        } else {
+            Point next;
+            if (pick < diffuseWeight + mirrorWeight) {
+                next = dir.reflect(N);
+                throughput = throughput * (material.reflectionParams[2] * total / mirrorWeight);
+            } else {
+                next = dir.refract(N, material.refractiveIndex);
+                // total internal reflection
+                if (next * next == 0) {
+                    next = dir.reflect(N);
+                }
+                throughput = throughput * (material.refractiveParam * total / refractionWeight);
+            }
+            dir = next.normalized();
+        }
+        orig = point + (dir * facing > 0 ? facing : -facing) * RayOffset(point);
+    }
+    return radiance;
+}
+
+// Adds sample s of every pixel of the views to their framebuffers and, when they have guides, its first hit to them.
+static void
+renderPathPass(const Group &world, const std::vector<Light> &lights, bool shadows,
+               const std::vector<FrameView> &frames, int s, int samples, RenderStats &total,
+               std::atomic<size_t> &doneTiles, const std::atomic<bool> &cancelled) {
+    int tilesCount = 0;
+    for (const FrameView &frame : frames) {
+        tilesCount += frame.tilesCount;
+    }
+
+#pragma omp parallel
+    {
+        TraceContext context(lights.size(), 0);
+#pragma omp for schedule(runtime)
+        for (int jobTile = 0; jobTile < tilesCount; ++jobTile) {
+            if (cancelled.load(std::memory_order_relaxed)) {
+                continue;
+            }
+            int t = jobTile;
+            const FrameView &view = viewOfTile(frames, t);
+            const Camera &camera = *view.camera;
+            FrameBuffer &framebuffer = *view.framebuffer;
+            DenoiseGuides *guides = view.guides;
+            const int width = view.width, height = view.height, tilesX = view.tilesX;
+            context.pixelSpread = camera.pixelSpread(height);
+            int i0 = t % tilesX * RenderTileSize, j0 = t / tilesX * RenderTileSize;
+            int tileWidth = std::min(width - i0, RenderTileSize), tileHeight = std::min(height - j0, RenderTileSize);
+            for (int j = j0; j < j0 + tileHeight; j++) {
+                for (int i = i0; i < i0 + tileWidth; i++) {
+                    uint32_t pixel = (uint32_t) j * width + i;
+                    Pcg32 random(pixel, (uint64_t) s);
+                    Strata strata(samples, pixel * 0x27D4EB2Du);
+                    Real u, v;
+                    strata.sample(s, PixelDimension, random, u, v);
+                    // the pixel's primary rays go through its corner, samples cover the square from there
+                    Point origin = camera.getPosition();
+                    Point corner = camera.direction(i, j, width, height), right = camera.direction(i + 1, j, width,
+                                                                                                    height);
+                    Point below = camera.direction(i, j + 1, width, height);
+                    Point dir = (corner + (right - corner) * u + (below - corner) * v).normalized();
+                    Point normal;
+                    Colour albedo;
+                    Real depth;
+                    size_t index = (size_t) j * framebuffer.stride + i;
+                    framebuffer.pixels[index] += tracePath(origin, dir, world, lights, shadows, context, random,
+                                                           strata, s, normal, albedo, depth);
+                    if (guides != nullptr) {
+                        guides->normal[index] += normal;
+                        guides->albedo[index] += albedo;
+                        guides->depth[index] += depth;
+                    }
+                }
+            }
+            doneTiles.fetch_add(1, std::memory_order_relaxed);
+        }
+#pragma omp critical
+        total += context.stats;
+    }
+}
+
+typedef void (*FrameKernel)(const Group &, const std::vector<Light> &, const std::vector<FrameView> &,
+                            RenderStats &, std::atomic<size_t> &, const std::atomic<bool> &, FrameRecord *,
+                            const std::vector<CubeShadowMap> *, Checkpoint *);
+
+// Walks every (features, depth) pair down from the widest one, so each of them gets its own instantiation.
+template<unsigned Features, int MaxDepth>
+struct KernelTable {
+    static FrameKernel select(unsigned features, int maxDepth, bool sorted) {
+        if (features == Features && maxDepth == MaxDepth) {
+            return sorted ? renderFrameSorted<Features, MaxDepth> : renderFrame<Features, MaxDepth>;
+        }
+        return KernelTable<Features, MaxDepth - 1>::select(features, maxDepth, sorted);
+    }
+};
+
+template<unsigned Features>
+struct KernelTable<Features, 0> {
+    static FrameKernel select(unsigned features, int maxDepth, bool sorted) {
+        return KernelTable<Features - 1, refComplexity>::select(features, maxDepth, sorted);
+    }
+};
+
+template<>
+struct KernelTable<0, 0> {
+    static FrameKernel select(unsigned, int, bool sorted) {
+        return sorted ? renderFrameSorted<0, 1> : renderFrame<0, 1>;
+    }
+};
+
+static unsigned
+materialFeatures(const Group &world) {
+    std::vector<Material> materials;
+    world.getMaterials(materials);
+    unsigned features = 0;
+    for (const auto &material : materials) {
+        if (material.reflectionParams[1] != 0) {
+            features |= FeatureSpecular;
+        }
+        if (material.reflectionParams[2] != 0) {
+            features |= FeatureReflection;
+        }
+        if (material.refractiveParam != 0) {
+            features |= FeatureRefraction;
+        }
+    }
+    return features;
+}
+
+Scene::Scene(const std::vector<BasicObject *> &objects, const std::vector<Light> &lights, Arena *arena) :
+        objects(objects), arena(arena), world(objects, arena), lights(lights),
+        materialFeatures(::materialFeatures(world)), lightChanges(0) {
+}
+
+void Scene::update(const BasicObject *object) {
+    world = Group(objects, arena);
+    materialFeatures = ::materialFeatures(world);
+    edits.push_back(object);
+}
+
+void Scene::setLights(const std::vector<Light> &lights) {
+    this->lights = lights;
+    ++lightChanges;
+}
+
+// Narrowest kernel that renders the scene with the options.
+static unsigned
+kernelFeatures(const Scene &scene, const RenderOptions &options, int &maxDepth) {
+    unsigned features = scene.getMaterialFeatures();
+    if (options.shadows && !scene.getLights().empty()) {
+        features |= FeatureShadows;
+    }
+    if (options.fastMath) {
+        features |= FeatureFastMath;
+    }
+    // without secondary rays nothing is traced past the primary hit
+    maxDepth = (features & (FeatureReflection | FeatureRefraction)) ?
+               std::max(1, std::min(refComplexity, options.maxDepth)) : 1;
+    return features;
+}
+
+RenderJob::RenderJob(const Scene &scene, const Camera &camera, int width, int height, const RenderOptions &options) :
+        RenderJob(scene, std::vector<View>{View(camera, width, height)}, options) {
+}
+
+RenderJob::RenderJob(const Scene &scene, const std::vector<View> &views, const RenderOptions &options) :
+        scene(scene), views(views), options(options), images(views.size()), tilesCount(0), doneTiles(0),
+        cancelled(false), finished(false), record(nullptr) {
+    for (const View &view : views) {
+        tilesCount += (size_t) ((view.width + RenderTileSize - 1) / RenderTileSize) *
+                      ((view.height + RenderTileSize - 1) / RenderTileSize) * std::max(1, options.samples);
+    }
+    // a time budgeted Whitted frame goes over its tiles twice, to probe and to refine them
+    if (options.timeBudget > 0 && options.samples == 0) {
+        tilesCount *= 2;
+    }
+}
+
+RenderJob::~RenderJob() {
+    cancel();
+    wait();
+}
+
+void RenderJob::start() {
+    worker = std::thread(&RenderJob::run, this);
+    if (options.progress) {
+        reporter = std::thread(&RenderJob::report, this);
+    }
+}
+
+// Identifies the job a checkpoint belongs to: the views, where they look from, the kernel, the post-processing and
+// the scene, told apart by its lights, its materials, how many objects it has and the bounds of the bounded ones.
+static uint64_t
+checkpointKey(const Scene &scene, const std::vector<FrameView> &frames, const RenderOptions &options,
+              unsigned features, int maxDepth) {
+    const Group &world = scene.getWorld();
+    Bounds bounds;
+    for (const BasicObject *object : world.getBounded()) {
+        bounds.grow(object->getBounds());
+    }
+    std::vector<double> values = {(double) features, (double) maxDepth, (double) options.samples,
+                                  (double) options.denoise, (double) options.shadowMapSize, (double) sizeof(Real),
+                                  (double) options.post.toneMapping, (double) options.post.transfer,
+                                  (double) options.post.dither, (double) options.post.fastMath,
+                                  (double) world.getBounded().size(), (double) world.getUnbounded().size(),
+                                  bounds.min[0], bounds.min[1], bounds.min[2], bounds.max[0], bounds.max[1],
+                                  bounds.max[2]};
+    for (const Light &light : scene.getLights()) {
+        Point position = light.getPosition();
+        values.insert(values.end(), {position[0], position[1], position[2], light.getIntensity(),
+                                     light.getRadius()});
+    }
+    std::vector<Material> materials;
+    world.getMaterials(materials);
+    for (const Material &material : materials) {
+        const Texture *texture = material.texture;
+        values.insert(values.end(), {material.reflectionParams[0], material.reflectionParams[1],
+                                     material.reflectionParams[2], material.diffusiveParams[0],
+                                     material.diffusiveParams[1], material.diffusiveParams[2], material.specularParam,
+                                     material.refractiveParam, material.refractiveIndex,
+                                     texture != nullptr ? (double) texture->getWidth() : -1.0,
+                                     texture != nullptr ? (double) texture->getHeight() : -1.0});
+    }
+    for (const FrameView &frame : frames) {
+        const Camera &camera = *frame.camera;
+        Point position = camera.getPosition(), first = camera.direction(0, 0, frame.width, frame.height),
+                last = camera.direction(frame.width, frame.height, frame.width, frame.height);
+        values.insert(values.end(), {(double) frame.width, (double) frame.height, (double) camera.getProjection(),
+                                     position[0], position[1], position[2], first[0], first[1], first[2], last[0],
+                                     last[1], last[2]});
+    }
+    // FNV-1a
+    uint64_t key = 14695981039346656037ull;
+    for (double value : values) {
+        const unsigned char *bytes = (const unsigned char *) &value;
+        for (size_t i = 0; i < sizeof(value); ++i) {
+            key = (key ^ bytes[i]) * 1099511628211ull;
+        }
+    }
+    return key;
+}
+
+// Bytes of the sums of all views the path tracer keeps in a checkpoint after a pass, guides included.
+static size_t
+pathSnapshotBytes(const std::vector<FrameView> &frames, bool denoise) {
+    size_t bytes = 0;
+    for (const FrameView &frame : frames) {
+        bytes += (size_t) frame.framebuffer->stride * frame.height *
+                 (sizeof(Pixel) + (denoise ? sizeof(Point) + sizeof(Colour) + sizeof(Real) : 0));
+    }
+    return bytes;
+}
+
+// Copies the tiles of a Whitted frame found in the checkpoint to the framebuffers, returns how many there were.
+static size_t
+restoreTiles(Checkpoint &checkpoint, const std::vector<FrameView> &frames) {
+    size_t restored = 0, tilesCount = 0;
+    for (const FrameView &frame : frames) {
+        tilesCount += frame.tilesCount;
+    }
+    for (int jobTile = 0; jobTile < (int) tilesCount; ++jobTile) {
+        if (!checkpoint.isRestored(jobTile)) {
             continue;
         }
-        lightDiffIntensity += light.getIntensity() * std::max(0., lightDirection * N);
-        lightSpecIntensity +=
-                pow(std::max(0.0, lightDirection.reflect(N) * dir), material.specularParam) * light.getIntensity();
+        int t = jobTile;
+        const FrameView &view = viewOfTile(frames, t);
+        FrameBuffer &framebuffer = *view.framebuffer;
+        int i0 = t % view.tilesX * RenderTileSize, j0 = t / view.tilesX * RenderTileSize;
+        int tileWidth = std::min(view.width - i0, RenderTileSize);
+        int tileHeight = std::min(view.height - j0, RenderTileSize);
+        const Pixel *tile = checkpointTile(checkpoint, jobTile);
+        for (int j = 0; j < tileHeight; j++) {
+            std::copy_n(&tile[j * RenderTileSize], tileWidth,
+                        &framebuffer.pixels[(size_t) (j0 + j) * framebuffer.stride + i0]);
+        }
+        ++restored;
     }
-    return material.diffusiveParams * (lightDiffIntensity + GlobalLightning) * material.reflectionParams[0] +
-           Pixel(1.0, 1.0, 1.0) * lightSpecIntensity * material.reflectionParams[1] +
-           reflectionParams * material.reflectionParams[2] + refractionParams * material.refractiveParam;
+    return restored;
 }
 
-std::vector<unsigned int>
-scene(const std::vector<BasicObject *> &objects, const std::vector<Light> &lights, const int height, const int width,
-      int threads) {
-    omp_set_num_threads(threads);
+// Probes a Whitted frame at a quarter of the resolution, then traces tiles again at half or full resolution in the
+// order of the contrast the probe found in and around them while their estimated cost fits before deadline. Tiles
+// the probe found flat come last, a feature between its samples still gets them refined when time is left.
+static void
+renderBudgeted(FrameKernel kernel, const Group &world, const std::vector<Light> &lights,
+               std::vector<FrameView> &frames, const std::vector<CubeShadowMap> *shadowMaps,
+               std::chrono::steady_clock::time_point deadline, int threads, RenderStats &stats,
+               std::atomic<size_t> &doneTiles, const std::atomic<bool> &cancelled) {
+    const int coarse = 4;
+    size_t tilesCount = 0;
+    for (const FrameView &frame : frames) {
+        tilesCount += frame.tilesCount;
+    }
+    std::vector<unsigned char> steps(tilesCount, coarse);
+    std::vector<double> costs(tilesCount, 0);
+    for (size_t v = 0, first = 0; v < frames.size(); first += frames[v].tilesCount, ++v) {
+        frames[v].steps = &steps[first];
+        frames[v].costs = &costs[first];
+    }
+    kernel(world, lights, frames, stats, doneTiles, cancelled, nullptr, shadowMaps, nullptr);
+
+    // seconds a tile takes to trace with a step, from the time per pixel of the probe, and the contrast of the probe
+    std::vector<std::array<double, coarse + 1>> estimates(tilesCount);
+    std::vector<std::pair<Real, int>> order;
+    for (int jobTile = 0; jobTile < (int) tilesCount; ++jobTile) {
+        int t = jobTile;
+        const FrameView &view = viewOfTile(frames, t);
+        int i0 = t % view.tilesX * RenderTileSize, j0 = t / view.tilesX * RenderTileSize;
+        int tileWidth = std::min(view.width - i0, RenderTileSize);
+        int tileHeight = std::min(view.height - j0, RenderTileSize);
+        auto traced = [&](int step) {
+            return (double) ((tileWidth + step - 1) / step) * ((tileHeight + step - 1) / step);
+        };
+        for (int step = 1; step <= coarse; step *= 2) {
+            estimates[jobTile][step] = costs[jobTile] / traced(coarse) * traced(step);
+        }
+        // the probe samples of the tile and the nearest ones of the tiles around it, so an edge running between
+        // the samples of two tiles shows in both
+        Pixel low(INFINITY, INFINITY, INFINITY), high(-INFINITY, -INFINITY, -INFINITY);
+        for (int j = std::max(0, j0 - coarse); j <= std::min(view.height - 1, j0 + tileHeight); j += coarse) {
+            for (int i = std::max(0, i0 - coarse); i <= std::min(view.width - 1, i0 + tileWidth); i += coarse) {
+                const Pixel &pixel = view.framebuffer->pixels[(size_t) j * view.framebuffer->stride + i];
+                for (size_t c = 0; c < 3; ++c) {
+                    low[c] = std::min(low[c], pixel[c]);
+                    high[c] = std::max(high[c], pixel[c]);
+                }
+            }
+        }
+        order.emplace_back(std::max(high[0] - low[0], std::max(high[1] - low[1], high[2] - low[2])), jobTile);
+    }
+    std::sort(order.begin(), order.end(), [](const std::pair<Real, int> &a, const std::pair<Real, int> &b) {
+        return a.first > b.first;
+    });
+
+    // thread seconds left, with some held back for tiles that do not spread evenly over the threads
+    double left = std::chrono::duration<double>(deadline - std::chrono::steady_clock::now()).count() * threads * 0.8;
+    std::fill(steps.begin(), steps.end(), 0);
+    // every tile with contrast at half resolution first, then as many as possible at full resolution, and the flat
+    // ones the same way with what is left
+    for (bool flat : {false, true}) {
+        for (int step = coarse / 2; step >= 1; step /= 2) {
+            for (const auto &entry : order) {
+                int t = entry.second;
+                if ((entry.first == 0) != flat) {
+                    continue;
+                }
+                double cost = estimates[t][step] - (steps[t] ? estimates[t][steps[t]] : 0);
+                if ((steps[t] == 0 || steps[t] > step) && cost <= left) {
+                    left -= cost;
+                    steps[t] = (unsigned char) step;
+                }
+            }
+        }
+    }
+    for (unsigned char step : steps) {
+        ++stats.budgetTiles[step == 1 ? 0 : step == 2 ? 1 : 2];
+    }
+    if (!cancelled) {
+        kernel(world, lights, frames, stats, doneTiles, cancelled, nullptr, shadowMaps, nullptr);
+    }
+    for (FrameView &frame : frames) {
+        frame.steps = nullptr;
+        frame.costs = nullptr;
+    }
+}
 
-    const double fov = M_PI / 3.0;
-    std::vector<Pixel> framebuffer(width * height);
+// room in a checkpoint journal for the holes left by threads killed while appending
+constexpr size_t CheckpointSlack = 1024;
+// how often the path tracer saves its sums at most, every save copies and writes back whole frames
+constexpr std::chrono::seconds CheckpointInterval(5);
+// and how many times as long as the last save took it renders before the next one, large frames stay under 1% saving
+constexpr int CheckpointCostRatio = 100;
 
-    for (size_t j = 0; j < height; j++) {
-        std::cout << "\rGenerated: " << (j + 1.0) / height * 100 << "%" << std::flush;
+void RenderJob::run() {
+    started = std::chrono::steady_clock::now();
+    omp_set_num_threads(options.threads);
+    // the kernels take tiles as threads get free, pinned threads keep to a static share so their pages stay local
+    omp_set_schedule(options.pinThreads ? omp_sched_static : omp_sched_dynamic, options.pinThreads ? 0 : 1);
 
+    if (options.pinThreads) {
+        pinThreads();
+    }
+    // an IncrementalRenderer renders a single view into the frame it keeps
+    std::vector<std::unique_ptr<FrameBuffer>> ownFramebuffers;
+    std::vector<FrameView> frames;
+    for (const View &view : views) {
+        if (record == nullptr) {
+            ownFramebuffers.emplace_back(new FrameBuffer(view.width, view.height));
+        }
+        frames.emplace_back(view, record != nullptr ? record->framebuffer : *ownFramebuffers.back());
+    }
+    if (record == nullptr) {
+        clearFrames(frames);
+    }
+    // the frame of an IncrementalRenderer is mostly kept, only its dirty pixels are traced
+    std::vector<std::unique_ptr<TileCandidates>> candidates;
+    std::vector<std::unique_ptr<VisibilityBuffer>> visibility;
+    if ((options.tileCandidates || options.rasterize) && options.samples == 0 && record == nullptr) {
+        for (FrameView &frame : frames) {
+            if (frame.camera->getProjection() == Camera::Perspective) {
+                candidates.emplace_back(new TileCandidates(scene.getWorld(), *frame.camera, frame.width,
+                                                           frame.height, RenderTileSize));
+                frame.candidates = candidates.back().get();
+                if (options.rasterize) {
+                    visibility.emplace_back(new VisibilityBuffer(*frame.candidates, *frame.camera, frame.width,
+                                                                 frame.height, RenderTileSize));
+                    frame.visibility = visibility.back().get();
+                }
+            }
+        }
+    }
+    const std::vector<Light> &lights = scene.getLights();
+
+    stats.features = kernelFeatures(scene, options, stats.maxDepth);
+    // an IncrementalRenderer keeps what it rendered itself
+    std::unique_ptr<Checkpoint> checkpoint;
+    if (!options.checkpoint.empty() && options.timeBudget == 0 && record == nullptr) {
+        bool paths = options.samples > 0;
+        // entries are tiles, or snapshots of the passes path traced so far
+        checkpoint = Checkpoint::Open(options.checkpoint,
+                                      checkpointKey(scene, frames, options, stats.features, stats.maxDepth),
+                                      (paths ? 2 * options.samples : tilesCount) + CheckpointSlack,
+                                      paths ? 2 * pathSnapshotBytes(frames, options.denoise) :
+                                      tilesCount * RenderTileSize * RenderTileSize * sizeof(Pixel), options.resume);
+        stats.checkpointed = checkpoint != nullptr;
+        if (checkpoint != nullptr && !paths) {
+            stats.resumedTiles = restoreTiles(*checkpoint, frames);
+        }
+    }
+
+    if (options.samples > 0 && record == nullptr) {
+        runPaths(frames, checkpoint.get());
+    } else {
+        // looked up shadows would end up in the nodes of an IncrementalRenderer, which relights them exactly
+        std::vector<CubeShadowMap> shadowMaps;
+        if (options.shadowMapSize > 0 && (stats.features & FeatureShadows) && record == nullptr) {
+            for (const Light &light : lights) {
+                shadowMaps.emplace_back(scene.getWorld(), light.getPosition(), options.shadowMapSize);
+            }
+        }
+        // the frame an IncrementalRenderer keeps, and the steps of a budgeted one, are only taken by renderFrame
+        FrameKernel kernel = KernelTable<FeatureAll, refComplexity>::select(
+                stats.features, stats.maxDepth, options.sortRays && options.timeBudget == 0 && record == nullptr);
+        if (options.timeBudget > 0) {
+            renderBudgeted(kernel, scene.getWorld(), lights, frames, shadowMaps.empty() ? nullptr : &shadowMaps,
+                           started + std::chrono::milliseconds(options.timeBudget), options.threads, stats,
+                           doneTiles, cancelled);
+        } else {
+            kernel(scene.getWorld(), lights, frames, stats, doneTiles, cancelled, record,
+                   shadowMaps.empty() ? nullptr : &shadowMaps, checkpoint.get());
+        }
+        for (size_t v = 0; v < frames.size(); ++v) {
+            images[v] = PostProcess(frames[v].framebuffer->pixels, frames[v].width, frames[v].height,
+                                    frames[v].framebuffer->stride, options.post);
+        }
+    }
+    if (checkpoint != nullptr && !cancelled) {
+        checkpoint->discard();
+    }
+    stats.milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count();
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        finished = true;
+    }
+    finishedSignal.notify_all();
+}
+
+void RenderJob::runPaths(std::vector<FrameView> &frames, Checkpoint *checkpoint) {
+    stats.features &= FeatureShadows;
+    stats.maxDepth = PathMaxDepth;
+    // the averaged frames, padded like the sums
+    std::vector<std::vector<Pixel>> averages;
+    std::vector<std::unique_ptr<DenoiseGuides>> guideSums, guides;
+    for (FrameView &frame : frames) {
+        averages.emplace_back((size_t) frame.framebuffer->stride * frame.height);
+        if (options.denoise) {
+            guideSums.emplace_back(new DenoiseGuides(frame.framebuffer->stride, frame.height));
+            guides.emplace_back(new DenoiseGuides(frame.framebuffer->stride, frame.height));
+            frame.guides = guideSums.back().get();
+        }
+    }
+    auto publish = [&](int samples) {
+        Real scale = 1.0 / std::max(1, samples);
+        for (size_t v = 0; v < frames.size(); ++v) {
+            const FrameBuffer &sums = *frames[v].framebuffer;
+            std::vector<Pixel> &average = averages[v];
+            const int width = frames[v].width, height = frames[v].height;
 #pragma omp parallel for
-        for (size_t i = 0; i < width; i++) {
-            double x = (2 * i / (double) width - 1) * tan(fov / 2.0) * width / (double) height;
-            double y = -(2 * j / (double) height - 1) * tan(fov / 2.0);
-            Point dir = Point(x, y, -1);
-            framebuffer[i + j * width] = cast_ray(Point(0, 0, 0), dir.normalize(), objects, lights, 1);
+            for (int j = 0; j < height; ++j) {
+                for (int i = 0; i < width; ++i) {
+                    size_t index = (size_t) j * sums.stride + i;
+                    average[index] = sums.pixels[index] * scale;
+                    if (options.denoise) {
+                        guides[v]->normal[index] = guideSums[v]->normal[index] * scale;
+                        guides[v]->albedo[index] = guideSums[v]->albedo[index] * scale;
+                        guides[v]->depth[index] = guideSums[v]->depth[index] * scale;
+                    }
+                }
+            }
+            if (options.denoise) {
+                Denoise(average.data(), width, height, sums.stride, *guides[v]);
+            }
+            images[v] = PostProcess(average.data(), width, height, sums.stride, options.post);
+        }
+        stats.samples = samples;
+    };
+    // The sums are saved at most every CheckpointInterval or CheckpointCostRatio times the last save, whichever is
+    // longer, alternating between two slots so that the last complete ones are never overwritten. The journal entry
+    // of a snapshot is its number of passes times two plus its slot.
+    auto snapshot = [&](int slot, bool restore) {
+        unsigned char *data = checkpoint->getData() + slot * pathSnapshotBytes(frames, options.denoise);
+        auto transfer = [&](void *memory, size_t bytes) {
+            if (restore) {
+                std::memcpy(memory, data, bytes);
+            } else {
+                std::memcpy(data, memory, bytes);
+            }
+            data += bytes;
+        };
+        for (size_t v = 0; v < frames.size(); ++v) {
+            size_t count = (size_t) frames[v].framebuffer->stride * frames[v].height;
+            transfer(frames[v].framebuffer->pixels, count * sizeof(Pixel));
+            if (options.denoise) {
+                transfer(guideSums[v]->normal.data(), count * sizeof(Point));
+                transfer(guideSums[v]->albedo.data(), count * sizeof(Colour));
+                transfer(guideSums[v]->depth.data(), count * sizeof(Real));
+            }
+        }
+    };
+    int first = 0, slot = 0;
+    if (checkpoint != nullptr && checkpoint->getLastRestored() != Checkpoint::NoEntry) {
+        uint32_t entry = checkpoint->getLastRestored();
+        first = (int) (entry / 2);
+        snapshot(entry % 2, true);
+        slot = 1 - entry % 2;
+        stats.resumedTiles = (size_t) first * (tilesCount / options.samples);
+        doneTiles = stats.resumedTiles;
+    }
+    auto saved = std::chrono::steady_clock::now(), passesStarted = saved;
+    std::chrono::steady_clock::duration saveInterval = CheckpointInterval;
+    for (int s = first; s < options.samples && !cancelled; ++s) {
+        renderPathPass(scene.getWorld(), scene.getLights(), (stats.features & FeatureShadows) != 0, frames, s,
+                       options.samples, stats, doneTiles, cancelled);
+        // the last pass completes the render, the checkpoint goes away then
+        if (checkpoint != nullptr && !cancelled && s + 1 < options.samples &&
+            std::chrono::steady_clock::now() - saved >= saveInterval) {
+            auto saving = std::chrono::steady_clock::now();
+            snapshot(slot, false);
+            checkpoint->append((uint32_t) (s + 1) * 2 + slot);
+            checkpoint->flush();
+            slot = 1 - slot;
+            saved = std::chrono::steady_clock::now();
+            saveInterval = std::max<std::chrono::steady_clock::duration>(CheckpointInterval,
+                                                                         (saved - saving) * CheckpointCostRatio);
+        }
+        if (options.passFinished && !cancelled) {
+            publish(s + 1);
+            options.passFinished(s + 1, images[0]);
         }
+        // stops when another pass, taking as long as those so far, would not fit
+        auto now = std::chrono::steady_clock::now();
+        if (options.timeBudget > 0 &&
+            now + (now - passesStarted) / (s + 1 - first) > started + std::chrono::milliseconds(options.timeBudget)) {
+            if (!options.passFinished) {
+                publish(s + 1);
+            }
+            // the passes left out are given up, the frame is complete
+            doneTiles = tilesCount;
+            return;
+        }
+    }
+    // a cancelled frame is averaged over the passes started, tiles the last one did not reach come out darker
+    if (!options.passFinished || cancelled) {
+        publish((int) ((doneTiles + tilesCount / options.samples - 1) / (tilesCount / options.samples)));
     }
-    std::cout << std::endl;
+}
 
-    return vPixel2Ui(framebuffer, width, height);
+void RenderJob::report() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!finishedSignal.wait_for(lock, std::chrono::milliseconds(options.progressInterval),
+                                    [this] { return finished; })) {
+        lock.unlock();
+        options.progress(doneTiles, tilesCount);
+        lock.lock();
+    }
+    lock.unlock();
+    options.progress(doneTiles, tilesCount);
+}
+
+void RenderJob::cancel() {
+    cancelled = true;
+}
+
+bool RenderJob::wait() {
+    if (worker.joinable()) {
+        worker.join();
+    }
+    if (reporter.joinable()) {
+        reporter.join();
+    }
+    return doneTiles == tilesCount;
+}
+
+bool RenderJob::isFinished() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return finished;
+}
+
+std::unique_ptr<RenderJob>
+Renderer::start(const Scene &scene, const Camera &camera, int width, int height) const {
+    std::unique_ptr<RenderJob> job(new RenderJob(scene, camera, width, height, options));
+    job->start();
+    return job;
+}
+
+std::unique_ptr<RenderJob>
+Renderer::start(const Scene &scene, const std::vector<View> &views) const {
+    std::unique_ptr<RenderJob> job(new RenderJob(scene, views, options));
+    job->start();
+    return job;
+}
+
+std::vector<unsigned int>
+Renderer::render(const Scene &scene, const Camera &camera, int width, int height, RenderStats *stats) const {
+    RenderJob job(scene, camera, width, height, options);
+    job.start();
+    job.wait();
+
+    if (stats != nullptr) {
+        *stats = job.getStats();
+    }
+
+    return job.getImage();
+}
+
+std::vector<std::vector<unsigned int>>
+Renderer::render(const Scene &scene, const std::vector<View> &views, RenderStats *stats) const {
+    RenderJob job(scene, views, options);
+    job.start();
+    job.wait();
+
+    if (stats != nullptr) {
+        *stats = job.getStats();
+    }
+
+    std::vector<std::vector<unsigned int>> images;
+    for (size_t v = 0; v < views.size(); ++v) {
+        images.push_back(job.getImage(v));
+    }
+    return images;
+}
+
+IncrementalRenderer::IncrementalRenderer(const Scene &scene, const Camera &camera, int width, int height,
+                                         const RenderOptions &options, bool relightable) :
+        scene(scene), camera(camera), width(width), height(height), options(options), relightable(relightable),
+        seenEdits(0), seenLightChanges(0), tracedPixels(0) {
+    // the frames are Whitted ones traced in full, the job would otherwise count budgeted tiles twice
+    this->options.samples = 0;
+    this->options.timeBudget = 0;
+}
+
+IncrementalRenderer::~IncrementalRenderer() = default;
+
+const std::vector<unsigned int> &
+IncrementalRenderer::render(RenderStats *stats) {
+    const std::vector<const BasicObject *> &edits = scene.getEdits();
+    int maxDepth;
+    unsigned features = kernelFeatures(scene, options, maxDepth);
+    bool relight = scene.getLightChanges() != seenLightChanges;
+    seenLightChanges = scene.getLightChanges();
+    // clean pixels stay valid under any kernel, relighting needs the one the nodes were traced with
+    bool full = record == nullptr ||
+                (relight && (!relightable || features != record->features || maxDepth != record->maxDepth));
+    uint64_t changed = 0;
+    std::vector<Bounds> moved;
+    for (size_t e = seenEdits; e < edits.size(); ++e) {
+        Bounds bounds = edits[e]->getBounds();
+        // objects without bounds may be anywhere
+        full = full || !bounds.isFinite();
+        // widened by far more than the rounding of the segments to floats
+        Point margin = (bounds.max - bounds.min) * 1e-4 + Point(EPS, EPS, EPS);
+        for (size_t k = 0; k < 3; ++k) {
+            margin[k] += std::max(std::abs(bounds.min[k]), std::abs(bounds.max[k])) * 1e-5;
+        }
+        moved.emplace_back(bounds.min - margin, bounds.max + margin);
+        changed |= signatureBit(edits[e]);
+    }
+    seenEdits = edits.size();
+
+    if (full) {
+        record.reset(new FrameRecord(width, height, relightable, features, maxDepth));
+    } else if (!moved.empty()) {
+        // pixels that depended on an edited object and those with rays crossing where the objects are now
+        const int tilesX = (width + RenderTileSize - 1) / RenderTileSize;
+        const int tilesCount = tilesX * ((height + RenderTileSize - 1) / RenderTileSize);
+        // Primary rays can only cross a box within its screen-space bounds, the others may reach it from anywhere.
+        std::vector<int> rects(moved.size() * 4);
+        for (size_t b = 0; b < moved.size(); ++b) {
+            int *rect = &rects[b * 4];
+            if (camera.getProjection() != Camera::Perspective) {
+                rect[0] = rect[2] = 0;
+                rect[1] = width - 1;
+                rect[3] = height - 1;
+            } else if (!camera.projectBounds(moved[b], width, height, rect[0], rect[1], rect[2], rect[3])) {
+                rect[0] = rect[2] = 0;
+                rect[1] = rect[3] = -1;
+            }
+        }
+#pragma omp parallel for schedule(dynamic) num_threads(options.threads)
+        for (int t = 0; t < tilesCount; ++t) {
+            int i0 = t % tilesX * RenderTileSize, j0 = t / tilesX * RenderTileSize;
+            for (int j = j0; j < std::min(height, j0 + RenderTileSize); ++j) {
+                for (int i = i0; i < std::min(width, i0 + RenderTileSize); ++i) {
+                    size_t pixel = (size_t) j * width + i;
+                    record->dirty[pixel] = (record->signatures[pixel] & changed) != 0;
+                }
+            }
+            for (const auto &segment : record->segments[t]) {
+                int i = i0 + segment.pixel % RenderTileSize, j = j0 + segment.pixel / RenderTileSize;
+                unsigned char &dirty = record->dirty[(size_t) j * width + i];
+                for (size_t b = 0; b < moved.size() && !dirty; ++b) {
+                    const int *rect = &rects[b * 4];
+                    if (segment.primary && (i < rect[0] || i > rect[1] || j < rect[2] || j > rect[3])) {
+                        continue;
+                    }
+                    dirty = segment.crosses(moved[b]);
+                }
+            }
+        }
+    }
+    tracedPixels = std::count(record->dirty.begin(), record->dirty.end(), 1);
+    record->relight = relight && !full;
+    // shadow rays are reused for lights that kept their place, changing the intensity traces none
+    const std::vector<Light> &lights = scene.getLights();
+    record->movedLights = 0;
+    for (size_t l = 0; l < std::min(lights.size(), ShadingNode::CachedLights); ++l) {
+        Point shift = l < record->lights.size() ? lights[l].getPosition() - record->lights[l].getPosition()
+                                                : Point(1, 0, 0);
+        if (shift * shift != 0) {
+            record->movedLights |= 1u << l;
+        }
+    }
+    record->lights = lights;
+
+    RenderJob job(scene, camera, width, height, options);
+    job.record = record.get();
+    job.start();
+    if (!job.wait()) {
+        // the frame is only partly traced, start over next time
+        record.reset();
+    }
+    if (stats != nullptr) {
+        *stats = job.getStats();
+    }
+    image = job.getImage();
+    return image;
 }
@@ -1,9 +1,299 @@
 #ifndef RT_SCENE_H
 #define RT_SCENE_H
 
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Camera.h"
+#include "Group.h"
 #include "mygeometry.h"
+#include "PostProcess.h"
+
+// Optional parts of the shading kernel, the renderer instantiates it once per combination.
+enum KernelFeatures : unsigned {
+    FeatureShadows = 1,
+    FeatureSpecular = 2,
+    FeatureReflection = 4,
+    FeatureRefraction = 8,
+    // approximate sqrt and pow, see FastMath.h
+    FeatureFastMath = 16,
+    FeatureAll = 31
+};
+
+struct RenderOptions {
+    int threads;
+    bool shadows;
+    // recursion limit, capped by refComplexity
+    int maxDepth;
+    bool fastMath;
+    PostProcessOptions post;
+    // called from a separate thread every progressInterval ms while rendering and once at the end
+    std::function<void(size_t doneTiles, size_t tilesCount)> progress;
+    int progressInterval;
+    // Binds render threads to CPUs (Linux only) and hands out tiles statically instead of dynamically, so the pages of
+    // the framebuffers are first touched on the NUMA node of the thread that renders them.
+    bool pinThreads;
+    // Samples per pixel of the path tracer, 0 keeps the Whitted kernel. Samples are taken one per pass over the
+    // frame, passFinished is then called from the render thread with the image of the first view averaged so far.
+    int samples;
+    std::function<void(int samples, const std::vector<unsigned int> &image)> passFinished;
+    // filters path traced frames, previews included, guided by what the primary rays hit
+    bool denoise;
+    // Whitted kernel only: traces the reflected and refracted rays of a tile level by level, sorted by direction
+    // and origin, instead of depth first
+    bool sortRays;
+    // Whitted kernel only: texels of the cube shadow map built around every light, 0 traces all shadow rays. Away
+    // from depth discontinuities the shadows are then looked up instead of traced.
+    int shadowMapSize;
+    // Whitted kernel only: the primary rays of perspective views are cast against the objects binned to their tile
+    // instead of traversing the BVH, the image stays the same
+    bool tileCandidates;
+    // Whitted kernel only: the primary hits of perspective views come from a visibility buffer the primitives of the
+    // tile candidates are rasterized into, each pixel intersects only the primitive found there; implies
+    // tileCandidates, the image stays the same
+    bool rasterize;
+    // File keeping finished tiles, or the sums of finished passes when path tracing, while rendering. With resume
+    // the progress found in it is taken over when the job, views, kernel, post-processing, lights and materials are
+    // the same and the objects have the same count and bounds. The file is deleted once the render completes.
+    std::string checkpoint;
+    bool resume;
+    // Milliseconds the job should take, 0 for no limit. A Whitted frame is probed at a quarter of the resolution
+    // first and its tiles are then traced at half or full resolution, those with the most contrast first, as long as
+    // the estimated cost fits. The path tracer stops after the last pass that fits. Checkpoints are not kept.
+    int timeBudget;
+
+    RenderOptions() : threads(1), shadows(true), maxDepth(refComplexity), fastMath(false), progressInterval(100),
+                      pinThreads(false), samples(0), denoise(false), sortRays(false), shadowMapSize(0),
+                      tileCandidates(false), rasterize(false), resume(false), timeBudget(0) {
+    }
+};
+
+struct RenderStats {
+    unsigned long long shadowRays;
+    unsigned long long occluderCacheHits;
+    // shadow tests answered by a shadow map, these trace no shadow ray
+    unsigned long long shadowMapHits;
+    // whether options.checkpoint could be used, and tiles taken from it instead of rendered
+    bool checkpointed;
+    unsigned long long resumedTiles;
+    // tiles of a time budgeted Whitted frame traced at full, half and a quarter of the resolution
+    unsigned budgetTiles[3];
+    // wall time of the job
+    double milliseconds;
+    // kernel the frame was rendered with, samples is 0 unless path traced
+    unsigned features;
+    int maxDepth;
+    int samples;
+
+    RenderStats() : shadowRays(0), occluderCacheHits(0), shadowMapHits(0), checkpointed(false), resumedTiles(0),
+                    budgetTiles(), milliseconds(0), features(0), maxDepth(0), samples(0) {
+    }
+
+    RenderStats &operator+=(const RenderStats &right) {
+        shadowRays += right.shadowRays;
+        occluderCacheHits += right.occluderCacheHits;
+        shadowMapHits += right.shadowMapHits;
+        return *this;
+    }
+
+    double occluderHitRate() const {
+        return shadowRays ? (double) occluderCacheHits / shadowRays : 0.0;
+    }
+};
+
+// Objects and lights prepared for rendering: the BVH is built once and shared by every render of the scene.
+// The objects have to outlive the scene.
+class Scene {
+    std::vector<BasicObject *> objects;
+    Arena *arena;
+    Group world;
+    std::vector<Light> lights;
+    unsigned materialFeatures;
+    std::vector<const BasicObject *> edits;
+    size_t lightChanges;
+
+public:
+    // The BVH is allocated from arena if given, the objects are not owned either way.
+    Scene(const std::vector<BasicObject *> &objects, const std::vector<Light> &lights, Arena *arena = nullptr);
+
+    const Group &getWorld() const {
+        return world;
+    }
+
+    const std::vector<Light> &getLights() const {
+        return lights;
+    }
+
+    // Narrowest feature set that still renders every material of the scene exactly.
+    unsigned getMaterialFeatures() const {
+        return materialFeatures;
+    }
+
+    // Call after changing one of the objects in place, e.g. moving it or editing its material. The BVH is rebuilt
+    // and the edit is logged for incremental renderers. Not safe while a render of the scene is running. With an
+    // arena the old BVH stays allocated until the arena is released.
+    void update(const BasicObject *object);
+
+    // every object passed to update so far, oldest first
+    const std::vector<const BasicObject *> &getEdits() const {
+        return edits;
+    }
+
+    // Replaces the lights, not safe while a render of the scene is running either.
+    void setLights(const std::vector<Light> &lights);
+
+    // number of setLights calls so far
+    size_t getLightChanges() const {
+        return lightChanges;
+    }
+};
+
+// Side of the square blocks of pixels the threads take in turn.
+constexpr int RenderTileSize = 16;
+
+struct FrameRecord;
+struct FrameView;
+class Checkpoint;
+class FrameBuffer;
+
+// One image of a render: the camera and the size it is rendered at.
+struct View {
+    Camera camera;
+    int width, height;
+
+    View(const Camera &camera, int width, int height) : camera(camera), width(width), height(height) {
+    }
+};
+
+// Render running in the background. Progress is counted in finished tiles, every pass of the path tracer counts
+// them again, and cancellation takes effect between tiles. The scene has to outlive the job.
+// A job may render several views of the scene, the tiles of all of them are handed out to the threads together.
+class RenderJob {
+    const Scene &scene;
+    std::vector<View> views;
+    RenderOptions options;
+
+    std::vector<std::vector<unsigned int>> images;
+    RenderStats stats;
+    size_t tilesCount;
+    std::atomic<size_t> doneTiles;
+    std::atomic<bool> cancelled;
+
+    std::thread worker, reporter;
+    mutable std::mutex mutex;
+    std::condition_variable finishedSignal;
+    bool finished;
+
+    // set by IncrementalRenderer: the frame is kept there and only its dirty pixels are traced
+    FrameRecord *record;
+    std::chrono::steady_clock::time_point started;
+
+    friend class IncrementalRenderer;
+
+    void run();
+
+    // path traces options.samples passes, adding them up in the framebuffers of the views
+    void runPaths(std::vector<FrameView> &frames, Checkpoint *checkpoint);
+
+    void report();
+
+public:
+    RenderJob(const Scene &scene, const Camera &camera, int width, int height, const RenderOptions &options);
+
+    RenderJob(const Scene &scene, const std::vector<View> &views, const RenderOptions &options);
+
+    // cancels the render and waits for it
+    ~RenderJob();
+
+    void start();
+
+    void cancel();
+
+    // Blocks until the render ends, returns false when it was cancelled before finishing every tile.
+    bool wait();
+
+    bool isFinished() const;
+
+    size_t getDoneTiles() const {
+        return doneTiles;
+    }
+
+    size_t getTilesCount() const {
+        return tilesCount;
+    }
+
+    // valid once the job has finished
+    const std::vector<unsigned int> &getImage(size_t view = 0) const {
+        return images[view];
+    }
+
+    const RenderStats &getStats() const {
+        return stats;
+    }
+};
+
+// Renders scenes with a fixed set of options, the same renderer can be used for any number of scenes and cameras.
+class Renderer {
+    RenderOptions options;
+
+public:
+    explicit Renderer(const RenderOptions &options = RenderOptions()) : options(options) {
+    }
+
+    RenderOptions &getOptions() {
+        return options;
+    }
+
+    std::unique_ptr<RenderJob> start(const Scene &scene, const Camera &camera, int width, int height) const;
+
+    std::unique_ptr<RenderJob> start(const Scene &scene, const std::vector<View> &views) const;
+
+    // Renders synchronously.
+    std::vector<unsigned int>
+    render(const Scene &scene, const Camera &camera, int width, int height, RenderStats *stats = nullptr) const;
+
+    // Renders every view in one job, the images come in the order of the views.
+    std::vector<std::vector<unsigned int>>
+    render(const Scene &scene, const std::vector<View> &views, RenderStats *stats = nullptr) const;
+};
+
+// Renders a scene again after edits tracing only the pixels the edits may change: those whose rays hit or were
+// blocked by an edited object and those whose rays cross its new bounds. To find them, every render keeps the ray
+// segments of each pixel and a signature of the objects it depended on, about 30 bytes per ray.
+// Frames are always rendered with the Whitted kernel. A relightable renderer also keeps every intersection of the
+// ray trees, about 160 bytes each. After the lights are changed it shades them again tracing only shadow rays,
+// otherwise a light change means rendering the whole frame.
+class IncrementalRenderer {
+    const Scene &scene;
+    Camera camera;
+    int width, height;
+    RenderOptions options;
+    bool relightable;
+    std::unique_ptr<FrameRecord> record;
+    size_t seenEdits, seenLightChanges;
+    size_t tracedPixels;
+    std::vector<unsigned int> image;
+
+public:
+    IncrementalRenderer(const Scene &scene, const Camera &camera, int width, int height,
+                        const RenderOptions &options = RenderOptions(), bool relightable = false);
+
+    ~IncrementalRenderer();
+
+    // The first call renders the whole frame, later ones only what the edits made since the previous call affect.
+    const std::vector<unsigned int> &render(RenderStats *stats = nullptr);
 
-std::vector<unsigned int>
-scene(const std::vector<BasicObject*> &objects, const std::vector<Light> &lights, const int height, const int width, int threads);
+    // pixels traced by the last render, relit ones do not count
+    size_t getTracedPixels() const {
+        return tracedPixels;
+    }
+};
 
 #endif //RT_SCENE_H
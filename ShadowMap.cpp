@@ -0,0 +1,48 @@
+#include <algorithm>
+#include <cmath>
+
+#include "ShadowMap.h"
+
+// Depth margin of a lookup in texels: surfaces tilted up to about 75 degrees from facing the light are classified
+// from the map, steeper ones and the ends of shadows are left to shadow rays.
+constexpr Real SlopeTexels = 4;
+
+CubeShadowMap::CubeShadowMap(const Group &world, const Point &position, int size) :
+        position(position), size(size), depths((size_t) 6 * size * size) {
+#pragma omp parallel for schedule(dynamic)
+    for (int row = 0; row < 6 * size; ++row) {
+        int face = row / size, y = row % size, axis = face / 2;
+        for (int x = 0; x < size; ++x) {
+            Point direction;
+            direction[axis] = face % 2 ? -1 : 1;
+            direction[(axis + 1) % 3] = (x + 0.5) / size * 2 - 1;
+            direction[(axis + 2) % 3] = (y + 0.5) / size * 2 - 1;
+            Hit hit;
+            depths[(size_t) row * size + x] = world.intersect(position, direction.normalized(), hit) ? (float) hit.t
+                                                                                                      : INFINITY;
+        }
+    }
+}
+
+CubeShadowMap::Visibility
+CubeShadowMap::lookup(const Point &point, Real dist) const {
+    Point d = point - position;
+    Real dx = std::abs(d[0]), dy = std::abs(d[1]), dz = std::abs(d[2]);
+    int axis = dx > dy ? (dx > dz ? 0 : 2) : (dy > dz ? 1 : 2);
+    int face = 2 * axis + (d[axis] < 0);
+    Real scale = 1 / std::abs(d[axis]);
+    Real x = (d[(axis + 1) % 3] * scale + 1) / 2 * size - 0.5, y = (d[(axis + 2) % 3] * scale + 1) / 2 * size - 0.5;
+    int x0 = (int) std::floor(x), y0 = (int) std::floor(y);
+    if (x0 < 0 || y0 < 0 || x0 + 1 >= size || y0 + 1 >= size) {
+        return Unknown;
+    }
+    const float *texels = &depths[((size_t) face * size + y0) * size + x0];
+    float nearest = std::min(std::min(texels[0], texels[1]), std::min(texels[size], texels[size + 1]));
+    float farthest = std::max(std::max(texels[0], texels[1]), std::max(texels[size], texels[size + 1]));
+    // a texel spans up to 2 / size radians
+    Real margin = dist * SlopeTexels * 2 / size + EPS;
+    if (nearest >= dist - margin) {
+        return Lit;
+    }
+    return farthest < dist - margin ? Shadowed : Unknown;
+}
@@ -0,0 +1,37 @@
+#ifndef RT_SHADOWMAP_H
+#define RT_SHADOWMAP_H
+
+#include <vector>
+
+#include "Group.h"
+#include "mygeometry.h"
+
+// Distances from a point light to the nearest surface in every direction, one square depth map for each face of a
+// cube around the light. Built by tracing a ray through the centre of every texel.
+class CubeShadowMap {
+    Point position;
+    int size;
+    // faces +x, -x, +y, -y, +z, -z one after another, rows of size texels
+    std::vector<float> depths;
+
+public:
+    enum Visibility {
+        Lit,
+        Shadowed,
+        // near a depth discontinuity or a face border, a shadow ray has to decide
+        Unknown
+    };
+
+    // The faces are built in parallel.
+    CubeShadowMap(const Group &world, const Point &position, int size);
+
+    // Whether point, dist away from the light, sees it. The four texels around the direction to the point all have
+    // to agree, with a margin of a few texels' worth of depth for sloped surfaces, or the answer is Unknown.
+    Visibility lookup(const Point &point, Real dist) const;
+
+    size_t getMemoryBytes() const {
+        return depths.size() * sizeof(float);
+    }
+};
+
+#endif //RT_SHADOWMAP_H
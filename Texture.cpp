@@ -0,0 +1,391 @@
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <fstream>
+
+#ifdef RT_HAVE_PNG
+#include <png.h>
+#endif
+
+#include "Bitmap.h"
+#include "Texture.h"
+
+// Decodes an image one row at a time, top row first, as 8-bit R, G, B triples.
+class ImageReader {
+public:
+    int width = 0, height = 0;
+
+    virtual ~ImageReader() {
+    }
+
+    virtual bool readRow(unsigned char *rgb) = 0;
+};
+
+class BMPImageReader : public ImageReader {
+    BMPReader bmp;
+
+public:
+    bool open(const std::string &fname) {
+        if (!bmp.open(fname.c_str())) {
+            return false;
+        }
+        width = bmp.width;
+        height = bmp.height;
+        return true;
+    }
+
+    bool readRow(unsigned char *rgb) {
+        return bmp.readRow(rgb);
+    }
+};
+
+class PPMReader : public ImageReader {
+    std::ifstream in;
+    bool ascii;
+    int maxValue;
+    std::vector<unsigned char> raw;
+
+public:
+    bool open(const std::string &fname) {
+        in.open(fname, std::ios::in | std::ios::binary);
+        std::string magic;
+        if (!(in >> magic) || (magic != "P3" && magic != "P6")) {
+            return false;
+        }
+        int header[3];
+        for (int &value : header) {
+            while (in >> std::ws && in.peek() == '#') {
+                in.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+            }
+            if (!(in >> value) || value <= 0) {
+                return false;
+            }
+        }
+        width = header[0];
+        height = header[1];
+        maxValue = header[2];
+        ascii = magic == "P3";
+        if (!ascii) {
+            in.get();
+            raw.resize(width * 3 * (maxValue > 255 ? 2 : 1));
+        }
+        return true;
+    }
+
+    bool readRow(unsigned char *rgb) {
+        if (!ascii && !in.read((char *) raw.data(), raw.size())) {
+            return false;
+        }
+        for (int i = 0; i < width * 3; ++i) {
+            int value;
+            if (ascii) {
+                if (!(in >> value)) {
+                    return false;
+                }
+            } else {
+                value = maxValue > 255 ? (raw[2 * i] << 8) | raw[2 * i + 1] : raw[i];
+            }
+            rgb[i] = (unsigned char) ((std::min(value, maxValue) * 255 + maxValue / 2) / maxValue);
+        }
+        return true;
+    }
+};
+
+#ifdef RT_HAVE_PNG
+class PNGReader : public ImageReader {
+    std::FILE *file = nullptr;
+    png_structp png = nullptr;
+    png_infop info = nullptr;
+    // interlaced images are only complete after the last pass, so they are decoded at once
+    std::vector<unsigned char> image;
+    int next = 0;
+
+public:
+    ~PNGReader() {
+        if (png != nullptr) {
+            png_destroy_read_struct(&png, &info, nullptr);
+        }
+        if (file != nullptr) {
+            std::fclose(file);
+        }
+    }
+
+    bool open(const std::string &fname) {
+        unsigned char signature[8];
+        file = std::fopen(fname.c_str(), "rb");
+        if (file == nullptr || std::fread(signature, 1, 8, file) != 8 || png_sig_cmp(signature, 0, 8) != 0) {
+            return false;
+        }
+        png = png_create_read_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+        info = png != nullptr ? png_create_info_struct(png) : nullptr;
+        if (info == nullptr) {
+            return false;
+        }
+        std::vector<png_bytep> rows;
+        if (setjmp(png_jmpbuf(png))) {
+            return false;
+        }
+        png_init_io(png, file);
+        png_set_sig_bytes(png, 8);
+        png_read_info(png, info);
+        png_set_expand(png);
+        png_set_strip_16(png);
+        png_set_strip_alpha(png);
+        png_set_gray_to_rgb(png);
+        int passes = png_set_interlace_handling(png);
+        png_read_update_info(png, info);
+        width = png_get_image_width(png, info);
+        height = png_get_image_height(png, info);
+        if (passes > 1) {
+            image.resize((size_t) width * height * 3);
+            for (int i = 0; i < height; ++i) {
+                rows.push_back(&image[(size_t) i * width * 3]);
+            }
+            png_read_image(png, rows.data());
+        }
+        return true;
+    }
+
+    bool readRow(unsigned char *rgb) {
+        if (!image.empty()) {
+            std::copy_n(&image[(size_t) next++ * width * 3], width * 3, rgb);
+            return true;
+        }
+        if (setjmp(png_jmpbuf(png))) {
+            return false;
+        }
+        png_read_row(png, rgb, nullptr);
+        return true;
+    }
+};
+#endif
+
+static std::unique_ptr<ImageReader> OpenImage(const std::string &fname) {
+    std::unique_ptr<BMPImageReader> bmp(new BMPImageReader());
+    if (bmp->open(fname)) {
+        return std::move(bmp);
+    }
+#ifdef RT_HAVE_PNG
+    std::unique_ptr<PNGReader> png(new PNGReader());
+    if (png->open(fname)) {
+        return std::move(png);
+    }
+#endif
+    std::unique_ptr<PPMReader> ppm(new PPMReader());
+    if (ppm->open(fname)) {
+        return std::move(ppm);
+    }
+    return nullptr;
+}
+
+static unsigned long long tileKey(unsigned int textureId, int level, int tile) {
+    return ((unsigned long long) textureId << 40) | ((unsigned long long) level << 32) | (unsigned int) tile;
+}
+
+TextureCache::TextureCache(size_t budgetBytes) :
+        tilesPerShard(std::max<size_t>(1, budgetBytes / sizeof(TextureTile) / ShardsCount)),
+        hits(0), misses(0), resident(0), peakResident(0) {
+}
+
+std::shared_ptr<const TextureTile> TextureCache::fetch(const Texture &texture, int level, int tile) {
+    unsigned long long key = tileKey(texture.id, level, tile);
+    Shard &shard = shards[(key * 0x9E3779B97F4A7C15ULL) >> 60];
+    {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto found = shard.tiles.find(key);
+        if (found != shard.tiles.end()) {
+            shard.lru.splice(shard.lru.begin(), shard.lru, found->second.second);
+            ++hits;
+            return found->second.first;
+        }
+    }
+
+    // the disk read happens outside of the shard lock so other threads keep hitting the cache meanwhile
+    std::shared_ptr<TextureTile> loaded = std::make_shared<TextureTile>();
+    texture.readTile(texture.levels[level].firstTile + tile, *loaded);
+    ++misses;
+
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    auto found = shard.tiles.find(key);
+    if (found != shard.tiles.end()) {
+        return found->second.first;
+    }
+    while (shard.tiles.size() >= tilesPerShard) {
+        shard.tiles.erase(shard.lru.back());
+        shard.lru.pop_back();
+        --resident;
+    }
+    shard.lru.push_front(key);
+    shard.tiles[key] = std::make_pair(std::shared_ptr<const TextureTile>(loaded), shard.lru.begin());
+    unsigned long long now = ++resident;
+    unsigned long long peak = peakResident;
+    while (now > peak && !peakResident.compare_exchange_weak(peak, now)) {
+    }
+    return loaded;
+}
+
+Texture::Texture(TextureCache &cache, std::FILE *backing) : cache(cache), backing(backing) {
+    static std::atomic<unsigned int> nextId(0);
+    id = nextId++;
+}
+
+Texture::~Texture() {
+    std::fclose(backing);
+}
+
+// Rows of one mip level that are still being assembled into tiles.
+struct Texture::Strip {
+    std::vector<TextureTile> tiles;
+    // even row waiting for the one below it to be averaged into the next level
+    std::vector<float> above, below;
+    int rows = 0;
+};
+
+// Quantizes a row of texels (0..255) into the tiles of its strip and writes the strip out once it is complete,
+// then averages row pairs into the next level, so no level is ever held in memory as a whole.
+bool Texture::addRow(std::vector<Strip> &strips, int level, const float *row) {
+    const Level &l = levels[level];
+    Strip &strip = strips[level];
+    int y = strip.rows++, tileY = y % TextureTileSize;
+    for (int x = 0; x < l.tilesX * TextureTileSize; ++x) {
+        const float *src = &row[std::min(x, l.width - 1) * 3];
+        TextureTile &tile = strip.tiles[x / TextureTileSize];
+        unsigned char *dst = &tile.texels[(tileY * TextureTileSize + x % TextureTileSize) * 3];
+        for (int c = 0; c < 3; ++c) {
+            dst[c] = (unsigned char) std::lround(src[c]);
+        }
+    }
+    if (y == l.height - 1) {
+        // the last strip is padded with copies of the last row
+        for (TextureTile &tile : strip.tiles) {
+            for (int i = tileY + 1; i < TextureTileSize; ++i) {
+                std::copy_n(&tile.texels[tileY * TextureTileSize * 3], TextureTileSize * 3,
+                            &tile.texels[i * TextureTileSize * 3]);
+            }
+        }
+    }
+    if (tileY == TextureTileSize - 1 || y == l.height - 1) {
+        long offset = (long) (l.firstTile + y / TextureTileSize * l.tilesX) * sizeof(TextureTile);
+        if (std::fseek(backing, offset, SEEK_SET) != 0 ||
+            std::fwrite(strip.tiles.data(), sizeof(TextureTile), strip.tiles.size(), backing) != strip.tiles.size()) {
+            return false;
+        }
+    }
+    if (level + 1 == (int) levels.size()) {
+        return true;
+    }
+
+    const float *above = row;
+    if (l.height > 1) {
+        if (y % 2 == 0) {
+            strip.above.assign(row, row + l.width * 3);
+            return true;
+        }
+        above = strip.above.data();
+    }
+    const Level &next = levels[level + 1];
+    strip.below.resize(next.width * 3);
+    for (int x = 0; x < next.width; ++x) {
+        for (int c = 0; c < 3; ++c) {
+            float sum = 0;
+            for (int k = 0; k < 4; ++k) {
+                int srcX = std::min(2 * x + k % 2, l.width - 1);
+                sum += (k < 2 ? above : row)[srcX * 3 + c];
+            }
+            strip.below[x * 3 + c] = sum / 4;
+        }
+    }
+    return addRow(strips, level + 1, strip.below.data());
+}
+
+std::unique_ptr<Texture> Texture::Load(const std::string &fname, TextureCache &cache) {
+    std::unique_ptr<ImageReader> reader = OpenImage(fname);
+    if (!reader) {
+        return nullptr;
+    }
+    std::FILE *backing = std::tmpfile();
+    if (backing == nullptr) {
+        return nullptr;
+    }
+    std::unique_ptr<Texture> texture(new Texture(cache, backing));
+
+    int w = reader->width, h = reader->height, firstTile = 0;
+    while (true) {
+        Level level = {w, h, (w + TextureTileSize - 1) / TextureTileSize, firstTile};
+        texture->levels.push_back(level);
+        firstTile += level.tilesX * ((h + TextureTileSize - 1) / TextureTileSize);
+        if (w == 1 && h == 1) {
+            break;
+        }
+        w = std::max(1, w / 2);
+        h = std::max(1, h / 2);
+    }
+
+    // the image is decoded row by row and every level is written out one strip of tiles at a time
+    std::vector<Strip> strips(texture->levels.size());
+    for (size_t i = 0; i < strips.size(); ++i) {
+        strips[i].tiles.resize(texture->levels[i].tilesX);
+    }
+    std::vector<unsigned char> bytes(reader->width * 3);
+    std::vector<float> row(bytes.size());
+    for (int y = 0; y < reader->height; ++y) {
+        if (!reader->readRow(bytes.data())) {
+            return nullptr;
+        }
+        std::copy(bytes.begin(), bytes.end(), row.begin());
+        if (!texture->addRow(strips, 0, row.data())) {
+            return nullptr;
+        }
+    }
+    std::fflush(backing);
+    return texture;
+}
+
+void Texture::readTile(int tile, TextureTile &out) const {
+    std::lock_guard<std::mutex> lock(backingMutex);
+    std::fseek(backing, (long) tile * sizeof(TextureTile), SEEK_SET);
+    if (std::fread(&out, sizeof(TextureTile), 1, backing) != 1) {
+        std::fill_n(out.texels, TextureTileSize * TextureTileSize * 3, 0);
+    }
+}
+
+Colour Texture::texel(int level, int x, int y, std::shared_ptr<const TextureTile> &tile, int &tileIdx) const {
+    const Level &l = levels[level];
+    x = ((x % l.width) + l.width) % l.width;
+    y = ((y % l.height) + l.height) % l.height;
+    int idx = (y / TextureTileSize) * l.tilesX + x / TextureTileSize;
+    if (idx != tileIdx) {
+        tile = cache.fetch(*this, level, idx);
+        tileIdx = idx;
+    }
+    const unsigned char *t = &tile->texels[((y % TextureTileSize) * TextureTileSize + x % TextureTileSize) * 3];
+    return Colour(t[0] / 255.0f, t[1] / 255.0f, t[2] / 255.0f);
+}
+
+Colour Texture::bilinear(int level, double u, double v) const {
+    const Level &l = levels[level];
+    double x = u * l.width - 0.5, y = v * l.height - 0.5;
+    double x0 = std::floor(x), y0 = std::floor(y);
+    double fx = x - x0, fy = y - y0;
+    std::shared_ptr<const TextureTile> tile;
+    int tileIdx = -1;
+    int ix = (int) x0, iy = (int) y0;
+    return texel(level, ix, iy, tile, tileIdx) * ((1 - fx) * (1 - fy)) +
+           texel(level, ix + 1, iy, tile, tileIdx) * (fx * (1 - fy)) +
+           texel(level, ix, iy + 1, tile, tileIdx) * ((1 - fx) * fy) +
+           texel(level, ix + 1, iy + 1, tile, tileIdx) * (fx * fy);
+}
+
+Colour Texture::sample(double u, double v, double footprint) const {
+    u -= std::floor(u);
+    v -= std::floor(v);
+    double lod = std::log2(std::max(footprint * std::max(getWidth(), getHeight()), 1.0));
+    int maxLevel = (int) levels.size() - 1;
+    if (lod >= maxLevel) {
+        return bilinear(maxLevel, u, v);
+    }
+    int level = (int) lod;
+    double t = lod - level;
+    Colour fine = bilinear(level, u, v);
+    return t > 0 ? fine * (1 - t) + bilinear(level + 1, u, v) * t : fine;
+}
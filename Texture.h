@@ -0,0 +1,104 @@
+#ifndef RT_TEXTURE_H
+#define RT_TEXTURE_H
+
+#include <atomic>
+#include <cstdio>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "mygeometry.h"
+
+constexpr int TextureTileSize = 16;
+
+// 8-bit texels of one TextureTileSize x TextureTileSize block, row by row. They become floats only when sampled.
+struct TextureTile {
+    unsigned char texels[TextureTileSize * TextureTileSize * 3];
+};
+
+class Texture;
+
+// Bounded pool of texture tiles shared by all textures of a scene.
+// Tiles are read from the textures' backing files on a miss and the least recently used ones are dropped
+// once the budget is exceeded, so memory use does not depend on the total texture size.
+class TextureCache {
+    static constexpr size_t ShardsCount = 16;
+
+    struct Shard {
+        std::mutex mutex;
+        std::list<unsigned long long> lru;
+        std::unordered_map<unsigned long long,
+                std::pair<std::shared_ptr<const TextureTile>, std::list<unsigned long long>::iterator>> tiles;
+    };
+
+    Shard shards[ShardsCount];
+    size_t tilesPerShard;
+    std::atomic<unsigned long long> hits, misses, resident, peakResident;
+
+public:
+    explicit TextureCache(size_t budgetBytes);
+
+    std::shared_ptr<const TextureTile> fetch(const Texture &texture, int level, int tile);
+
+    unsigned long long getHits() const {
+        return hits;
+    }
+
+    unsigned long long getMisses() const {
+        return misses;
+    }
+
+    size_t getPeakBytes() const {
+        return peakResident * sizeof(TextureTile);
+    }
+};
+
+// Mip-mapped image texture. Every level is stored on disk in TextureTileSize tiles and paged in through the
+// TextureCache on demand.
+class Texture {
+    struct Level {
+        int width, height, tilesX, firstTile;
+    };
+
+    struct Strip;
+
+    friend class TextureCache;
+
+    TextureCache &cache;
+    unsigned int id;
+    std::vector<Level> levels;
+    std::FILE *backing;
+    mutable std::mutex backingMutex;
+
+    Texture(TextureCache &cache, std::FILE *backing);
+
+    bool addRow(std::vector<Strip> &strips, int level, const float *row);
+
+    void readTile(int tile, TextureTile &out) const;
+
+    Colour texel(int level, int x, int y, std::shared_ptr<const TextureTile> &tile, int &tileIdx) const;
+
+    Colour bilinear(int level, double u, double v) const;
+
+public:
+    ~Texture();
+
+    // Loads a BMP, PPM or (when built with libpng) PNG file. Returns nullptr when the file cannot be read.
+    static std::unique_ptr<Texture> Load(const std::string &fname, TextureCache &cache);
+
+    int getWidth() const {
+        return levels[0].width;
+    }
+
+    int getHeight() const {
+        return levels[0].height;
+    }
+
+    // Trilinear lookup with repeat addressing. footprint is the size of the sampled area in uv units.
+    Colour sample(double u, double v, double footprint) const;
+};
+
+#endif //RT_TEXTURE_H
@@ -0,0 +1,124 @@
+#include <algorithm>
+#include <cmath>
+
+#include "TileCandidates.h"
+
+TileCandidates::TileCandidates(const Group &world, const Camera &camera, int width, int height, int tileSize) :
+        world(world), camera(camera), width(width), height(height), tileSize(tileSize),
+        tilesX((width + tileSize - 1) / tileSize),
+        bins((size_t) tilesX * ((height + tileSize - 1) / tileSize)) {
+    const ArenaVector<const BasicObject *> &objects = world.getBounded();
+    // tile range of every object, empty when it is behind the camera
+    std::vector<int> rects(objects.size() * 4);
+    std::vector<Real> nears(objects.size());
+#pragma omp parallel for schedule(static)
+    for (int o = 0; o < (int) objects.size(); ++o) {
+        Bounds bounds = objects[o]->getBounds();
+        const Point &position = camera.getPosition();
+        Point nearest;
+        for (size_t k = 0; k < 3; ++k) {
+            nearest[k] = std::max(bounds.min[k], std::min(bounds.max[k], position[k]));
+        }
+        // a little closer than the box, so rounding never skips an object whose hit ties with the nearest one
+        nears[o] = (nearest - position).length() * (1 - 1e-4);
+
+        int *rect = &rects[(size_t) o * 4];
+        int left, right, top, bottom;
+        if (camera.projectBounds(bounds, width, height, left, right, top, bottom)) {
+            rect[0] = left / tileSize;
+            rect[1] = right / tileSize + 1;
+            rect[2] = top / tileSize;
+            rect[3] = bottom / tileSize + 1;
+        } else {
+            rect[0] = rect[1] = rect[2] = rect[3] = 0;
+        }
+    }
+    for (size_t o = 0; o < objects.size(); ++o) {
+        const int *rect = &rects[o * 4];
+        for (int ty = rect[2]; ty < rect[3]; ++ty) {
+            for (int tx = rect[0]; tx < rect[1]; ++tx) {
+                bins[(size_t) ty * tilesX + tx].bounded.push_back({objects[o], nears[o]});
+            }
+        }
+    }
+#pragma omp parallel for schedule(dynamic)
+    for (int t = 0; t < (int) bins.size(); ++t) {
+        cull(t);
+    }
+}
+
+// Keeps the objects of tile t that its frustum reaches, widened by a pixel on every side for rounding.
+void TileCandidates::cull(int t) {
+    int i0 = t % tilesX * tileSize, j0 = t / tilesX * tileSize;
+    int i1 = std::min(i0 + tileSize, width), j1 = std::min(j0 + tileSize, height);
+    const Point corners[4] = {camera.direction(i0 - 1, j0 - 1, width, height),
+                              camera.direction(i1, j0 - 1, width, height),
+                              camera.direction(i1, j1, width, height),
+                              camera.direction(i0 - 1, j1, width, height)};
+    Point axis = corners[0] + corners[1] + corners[2] + corners[3];
+    Bin &bin = bins[t];
+    for (int k = 0; k < 4; ++k) {
+        bin.normals[k] = corners[k].cross(corners[(k + 1) % 4]);
+        if (bin.normals[k] * axis < 0) {
+            bin.normals[k] = bin.normals[k] * -1;
+        }
+    }
+
+    for (const BasicObject *object : world.getUnbounded()) {
+        if (object->mayBeHit(camera.getPosition(), corners, 4)) {
+            bin.unbounded.push_back(object);
+        }
+    }
+    bin.bounded.erase(std::remove_if(bin.bounded.begin(), bin.bounded.end(), [&](const Candidate &candidate) {
+        return !overlaps(t, candidate.object->getBounds());
+    }), bin.bounded.end());
+    std::sort(bin.bounded.begin(), bin.bounded.end(), [](const Candidate &a, const Candidate &b) {
+        return a.near < b.near;
+    });
+}
+
+bool TileCandidates::overlaps(int t, const Bounds &bounds) const {
+    const Point &position = camera.getPosition();
+    for (const Point &normal : bins[t].normals) {
+        // corner of the box farthest inside the plane
+        Point corner;
+        for (size_t k = 0; k < 3; ++k) {
+            corner[k] = normal[k] >= 0 ? bounds.max[k] : bounds.min[k];
+        }
+        if ((corner - position) * normal < 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void TileCandidates::tracePixel(int t, const Point &direction, const RayShear &shear, Hit &hit) const {
+    const Bin &bin = bins[t];
+    const Point &position = camera.getPosition();
+    for (const BasicObject *object : bin.unbounded) {
+        if (object->intersect(position, direction, shear, hit)) {
+            hit.root = object;
+        }
+    }
+    for (const Candidate &candidate : bin.bounded) {
+        if (candidate.near >= hit.t) {
+            break;
+        }
+        if (candidate.object->intersect(position, direction, shear, hit)) {
+            hit.root = candidate.object;
+        }
+    }
+}
+
+void TileCandidates::traceTile(int t, Hit *hits, int step) const {
+    int i0 = t % tilesX * tileSize, j0 = t / tilesX * tileSize;
+    int tileWidth = std::min(width - i0, tileSize), tileHeight = std::min(height - j0, tileSize);
+    for (int j = 0; j < tileHeight; j += step) {
+        for (int i = 0; i < tileWidth; i += step) {
+            Point direction = camera.direction(i0 + i, j0 + j, width, height);
+            Hit &hit = hits[j * tileSize + i];
+            hit = Hit();
+            tracePixel(t, direction, RayShear(direction), hit);
+        }
+    }
+}
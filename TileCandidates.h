@@ -0,0 +1,63 @@
+#ifndef RT_TILECANDIDATES_H
+#define RT_TILECANDIDATES_H
+
+#include <vector>
+
+#include "Camera.h"
+#include "Group.h"
+#include "mygeometry.h"
+
+// First hits of the primary rays of a perspective view, found by screen-space binned ray casting instead of BVH
+// traversal. The top level objects of the world are binned to the tiles their projected bounds cover, and every tile
+// then keeps those whose bounds meet its frustum and the unbounded ones the frustum can reach. Every pixel of a tile
+// casts its ray at the candidates of its tile, nearest first, with their own intersection routines along the very ray
+// the kernels trace, so the hits are the ones world.intersect reports. VisibilityBuffer rasterizes the same candidates.
+class TileCandidates {
+public:
+    struct Candidate {
+        const BasicObject *object;
+        // no hit on the object is closer to the camera
+        Real near;
+    };
+
+private:
+    struct Bin {
+        // in the order of the world, intersect takes them before the others
+        std::vector<const BasicObject *> unbounded;
+        // nearest first
+        std::vector<Candidate> bounded;
+        // side planes of the frustum through the camera, normals pointing inside
+        Point normals[4];
+    };
+
+    const Group &world;
+    const Camera &camera;
+    int width, height, tileSize, tilesX;
+    std::vector<Bin> bins;
+
+    void cull(int t);
+
+public:
+    // The objects are projected and the tiles culled in parallel. camera has to be a perspective one.
+    TileCandidates(const Group &world, const Camera &camera, int width, int height, int tileSize);
+
+    const std::vector<const BasicObject *> &getUnbounded(int t) const {
+        return bins[t].unbounded;
+    }
+
+    const std::vector<Candidate> &getBounded(int t) const {
+        return bins[t].bounded;
+    }
+
+    // False when no ray of tile t, widened by a pixel on every side, meets bounds.
+    bool overlaps(int t, const Bounds &bounds) const;
+
+    // First hit of the ray of tile t along direction, with root set as world.intersect sets it.
+    void tracePixel(int t, const Point &direction, const RayShear &shear, Hit &hit) const;
+
+    // Fills the tileSize rows of tileSize hits with the first hits of every step-th pixel of tile t in both
+    // directions, the ones a coarse tile traces. Misses have no object, the other hits are left as they are.
+    void traceTile(int t, Hit *hits, int step = 1) const;
+};
+
+#endif //RT_TILECANDIDATES_H
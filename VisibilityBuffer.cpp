@@ -0,0 +1,317 @@
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#include "Group.h"
+#include "VisibilityBuffer.h"
+
+// Relative slack of the rasterizer. Coverage is widened by it, so a primitive a ray hits is drawn at its pixel
+// whatever the rounding, and a fragment that close to the nearest one may be the actual hit.
+static const Real RasterTolerance = std::sqrt(std::numeric_limits<Real>::epsilon());
+
+// Depth buffer of one tile, drawn into by the objects of the tile.
+class TileRaster : public RasterTarget {
+public:
+    struct Fragment {
+        // distance to the nearest fragment and to the one behind it
+        Real depth, second;
+        const BasicObject *root, *leaf;
+        const Instance *instance;
+        size_t primitive;
+        // the nearest primitive cannot be told
+        bool traced;
+    };
+
+    // object of the scene being drawn
+    const BasicObject *root;
+    std::vector<Fragment> fragments;
+
+private:
+    const TileCandidates &candidates;
+    const Camera &camera;
+    int t, width, height, tileSize, i0, j0, tileWidth, tileHeight;
+    std::vector<Point> directions;
+    const Instance *instance;
+    // farthest() as of a while ago and the fragments drawn since
+    Real limit;
+    int drawn;
+
+    Bounds toWorld(const Bounds &bounds) const {
+        return instance != nullptr ? instance->getToWorld().applyBounds(bounds) : bounds;
+    }
+
+    // Pixels [x0, x1) x [y0, y1) of the tile the box, in the world, may cover.
+    bool rect(const Bounds &bounds, int &x0, int &x1, int &y0, int &y1) const {
+        int left, right, top, bottom;
+        if (!camera.projectBounds(bounds, width, height, left, right, top, bottom)) {
+            return false;
+        }
+        x0 = std::max(left - i0, 0);
+        x1 = std::min(right - i0 + 1, tileWidth);
+        y0 = std::max(top - j0, 0);
+        y1 = std::min(bottom - j0 + 1, tileHeight);
+        return x0 < x1 && y0 < y1;
+    }
+
+    // Ray of pixel in the space of the primitives drawn and the factor taking distances along it to the world.
+    Point localDirection(int pixel, Real &scale) const {
+        if (instance == nullptr) {
+            scale = 1;
+            return directions[pixel];
+        }
+        Point direction = instance->getToLocal().applyVector(directions[pixel]);
+        scale = direction.length();
+        return direction * (1.0 / scale);
+    }
+
+    Point localPosition() const {
+        return instance != nullptr ? instance->getToLocal().applyPoint(camera.getPosition()) : camera.getPosition();
+    }
+
+    void draw(int pixel, Real depth, const BasicObject *leaf, size_t primitive) {
+        ++drawn;
+        Fragment &fragment = fragments[pixel];
+        if (depth < fragment.depth) {
+            fragment.second = fragment.depth;
+            fragment.depth = depth;
+            fragment.root = root;
+            fragment.leaf = leaf;
+            fragment.instance = instance;
+            fragment.primitive = primitive;
+        } else if (depth < fragment.second) {
+            fragment.second = depth;
+        }
+    }
+
+public:
+    TileRaster(const TileCandidates &candidates, const Camera &camera, int t, int width, int height, int tileSize) :
+            root(nullptr), candidates(candidates), camera(camera), t(t), width(width), height(height),
+            tileSize(tileSize), i0(t % ((width + tileSize - 1) / tileSize) * tileSize),
+            j0(t / ((width + tileSize - 1) / tileSize) * tileSize), tileWidth(std::min(width - i0, tileSize)),
+            tileHeight(std::min(height - j0, tileSize)), directions(tileSize * tileSize), instance(nullptr),
+            limit(std::numeric_limits<Real>::infinity()), drawn(0) {
+        Fragment empty = {std::numeric_limits<Real>::infinity(), std::numeric_limits<Real>::infinity(), nullptr,
+                          nullptr, nullptr, 0, false};
+        fragments.assign(tileSize * tileSize, empty);
+        for (int j = 0; j < tileHeight; ++j) {
+            for (int i = 0; i < tileWidth; ++i) {
+                directions[j * tileSize + i] = camera.direction(i0 + i, j0 + j, width, height);
+            }
+        }
+    }
+
+    // Depth beyond which a fragment changes no pixel of the tile, infinite while some pixel is empty.
+    Real farthest() const {
+        Real result = 0;
+        for (int j = 0; j < tileHeight; ++j) {
+            for (int i = 0; i < tileWidth; ++i) {
+                result = std::max(result, fragments[j * tileSize + i].depth);
+            }
+        }
+        return result * (1 + RasterTolerance);
+    }
+
+    bool overlaps(const Bounds &bounds) {
+        Bounds world = toWorld(bounds);
+        if (!candidates.overlaps(t, world)) {
+            return false;
+        }
+        // the farthest depth is brought up to date once enough has been drawn to move it
+        if (drawn >= tileSize * tileSize) {
+            limit = farthest();
+            drawn = 0;
+        }
+        const Point &position = camera.getPosition();
+        Point nearest;
+        for (size_t k = 0; k < 3; ++k) {
+            nearest[k] = std::max(world.min[k], std::min(world.max[k], position[k]));
+        }
+        return (nearest - position).length() <= limit;
+    }
+
+    Point viewpoint() const {
+        return localPosition();
+    }
+
+    // The edge functions are the triple products of the pixel ray with the rays to two vertices, all of them are
+    // negative inside a triangle facing the camera.
+    void triangle(const BasicObject *leaf, size_t primitive, const Point &p0, const Point &p1, const Point &p2,
+                  bool twoSided) {
+        Point p[3] = {p0, p1, p2};
+        // the pixels inside the projected triangle, a small part of one wider for rounding
+        Real iMin = INFINITY, iMax = -INFINITY, jMin = INFINITY, jMax = -INFINITY;
+        bool behind = false;
+        for (Point &vertex : p) {
+            if (instance != nullptr) {
+                vertex = instance->getToWorld().applyPoint(vertex);
+            }
+            Real i, j;
+            behind = behind || !camera.project(vertex, width, height, i, j);
+            iMin = std::min(iMin, i);
+            iMax = std::max(iMax, i);
+            jMin = std::min(jMin, j);
+            jMax = std::max(jMax, j);
+        }
+        int x0 = 0, x1 = tileWidth, y0 = 0, y1 = tileHeight;
+        if (!behind) {
+            x0 = std::max(x0, (int) std::ceil(iMin - 1e-3) - i0);
+            x1 = std::min(x1, (int) std::floor(iMax + 1e-3) - i0 + 1);
+            y0 = std::max(y0, (int) std::ceil(jMin - 1e-3) - j0);
+            y1 = std::min(y1, (int) std::floor(jMax + 1e-3) - j0 + 1);
+            if (x0 >= x1 || y0 >= y1) {
+                return;
+            }
+        }
+        const Point &position = camera.getPosition();
+        Point a[3] = {p[0] - position, p[1] - position, p[2] - position};
+        Real lengths[3] = {a[0].length(), a[1].length(), a[2].length()};
+        Point edges[3];
+        Real margins[3];
+        for (int k = 0; k < 3; ++k) {
+            edges[k] = a[k].cross(a[(k + 1) % 3]);
+            margins[k] = RasterTolerance * lengths[k] * lengths[(k + 1) % 3];
+        }
+        Point normal = (p[1] - p[0]).cross(p[2] - p[0]);
+        Real distance = normal * a[0], minSlope = RasterTolerance * normal.length();
+        // an instance may mirror the winding, so its triangles are taken from either side
+        bool frontOnly = !twoSided && instance == nullptr;
+        for (int y = y0; y < y1; ++y) {
+            for (int x = x0; x < x1; ++x) {
+                int pixel = y * tileSize + x;
+                const Point &d = directions[pixel];
+                Real e0 = edges[0] * d, e1 = edges[1] * d, e2 = edges[2] * d;
+                if (!(e0 <= margins[0] && e1 <= margins[1] && e2 <= margins[2]) &&
+                    (frontOnly || !(e0 >= -margins[0] && e1 >= -margins[1] && e2 >= -margins[2]))) {
+                    continue;
+                }
+                Real slope = normal * d;
+                if (std::abs(slope) <= minSlope) {
+                    // seen edge on, the depth is anyone's guess
+                    fragments[pixel].traced = true;
+                    continue;
+                }
+                Real depth = distance / slope;
+                if (depth > 0) {
+                    draw(pixel, depth, leaf, primitive);
+                }
+            }
+        }
+    }
+
+    void sphere(const BasicObject *leaf, const Point &center, Real radius) {
+        int x0, x1, y0, y1;
+        Bounds bounds(center - Point(radius, radius, radius), center + Point(radius, radius, radius));
+        if (!rect(toWorld(bounds), x0, x1, y0, y1)) {
+            return;
+        }
+        Point toCenter = center - localPosition();
+        Real radius2 = radius * radius;
+        for (int y = y0; y < y1; ++y) {
+            for (int x = x0; x < x1; ++x) {
+                int pixel = y * tileSize + x;
+                Real scale;
+                Point d = localDirection(pixel, scale);
+                Real along = toCenter * d, distance2 = toCenter * toCenter - along * along;
+                if (distance2 > radius2 * (1 + RasterTolerance)) {
+                    continue;
+                }
+                Real half = std::sqrt(std::max<Real>(0, radius2 - distance2));
+                Real depth = along - half;
+                if (depth < 0) {
+                    depth = along + half;
+                }
+                if (depth >= 0) {
+                    draw(pixel, depth / scale, leaf, 0);
+                }
+            }
+        }
+    }
+
+    // the distance along the ray the way Plane computes it
+    void plane(const BasicObject *leaf, const Point &point, const Point &normal) {
+        Real offset = (localPosition() - point) * normal;
+        for (int y = 0; y < tileHeight; ++y) {
+            for (int x = 0; x < tileWidth; ++x) {
+                int pixel = y * tileSize + x;
+                Real scale;
+                Real slope = localDirection(pixel, scale) * normal;
+                if (std::abs(slope) > EPS / 100 && -offset / slope > 0) {
+                    draw(pixel, -offset / slope / scale, leaf, 0);
+                }
+            }
+        }
+    }
+
+    void setInstance(const Instance *instance) {
+        this->instance = instance;
+    }
+};
+
+VisibilityBuffer::VisibilityBuffer(const TileCandidates &candidates, const Camera &camera, int width, int height,
+                                   int tileSize) :
+        candidates(candidates), camera(camera), width(width), height(height), tileSize(tileSize),
+        tilesX((width + tileSize - 1) / tileSize), samples((size_t) width * height) {
+    int tilesCount = tilesX * ((height + tileSize - 1) / tileSize);
+#pragma omp parallel for schedule(dynamic)
+    for (int t = 0; t < tilesCount; ++t) {
+        rasterizeTile(t);
+    }
+}
+
+void VisibilityBuffer::rasterizeTile(int t) {
+    TileRaster raster(candidates, camera, t, width, height, tileSize);
+    bool traced = false;
+    for (const BasicObject *object : candidates.getUnbounded(t)) {
+        raster.root = object;
+        traced = traced || !object->rasterize(raster);
+    }
+    for (const TileCandidates::Candidate &candidate : candidates.getBounded(t)) {
+        // the candidates are sorted nearest first, the rest are hidden behind the tile as drawn so far
+        if (traced || candidate.near > raster.farthest()) {
+            break;
+        }
+        raster.root = candidate.object;
+        traced = !candidate.object->rasterize(raster);
+    }
+
+    int i0 = t % tilesX * tileSize, j0 = t / tilesX * tileSize;
+    int tileWidth = std::min(width - i0, tileSize), tileHeight = std::min(height - j0, tileSize);
+    for (int j = 0; j < tileHeight; ++j) {
+        for (int i = 0; i < tileWidth; ++i) {
+            const TileRaster::Fragment &fragment = raster.fragments[j * tileSize + i];
+            Sample &sample = samples[(size_t) (j0 + j) * width + i0 + i];
+            sample.root = fragment.root;
+            sample.leaf = fragment.leaf;
+            sample.instance = fragment.instance;
+            sample.primitive = fragment.primitive;
+            sample.traced = traced || fragment.traced ||
+                            (fragment.leaf != nullptr && fragment.second <= fragment.depth * (1 + RasterTolerance));
+        }
+    }
+}
+
+void VisibilityBuffer::traceTile(int t, Hit *hits, int step) const {
+    int i0 = t % tilesX * tileSize, j0 = t / tilesX * tileSize;
+    int tileWidth = std::min(width - i0, tileSize), tileHeight = std::min(height - j0, tileSize);
+    const Point &position = camera.getPosition();
+    for (int j = 0; j < tileHeight; j += step) {
+        for (int i = 0; i < tileWidth; i += step) {
+            const Sample &sample = samples[(size_t) (j0 + j) * width + i0 + i];
+            Hit &hit = hits[j * tileSize + i];
+            hit = Hit();
+            if (sample.leaf == nullptr && !sample.traced) {
+                continue;
+            }
+            Point direction = camera.direction(i0 + i, j0 + j, width, height);
+            RayShear shear(direction);
+            if (!sample.traced) {
+                const BasicObject *owner = sample.instance != nullptr ? sample.instance : sample.leaf;
+                if (owner->intersectPrimitive(position, direction, shear, sample.leaf, sample.primitive, hit)) {
+                    hit.root = sample.root;
+                    continue;
+                }
+            }
+            candidates.tracePixel(t, direction, shear, hit);
+        }
+    }
+}
@@ -0,0 +1,40 @@
+#ifndef RT_VISIBILITYBUFFER_H
+#define RT_VISIBILITYBUFFER_H
+
+#include <vector>
+
+#include "Camera.h"
+#include "TileCandidates.h"
+#include "mygeometry.h"
+
+// Primary visibility of a perspective view found by rasterization. Every tile draws the primitives of the objects
+// TileCandidates keeps for it into a depth buffer: triangles through edge functions of the pixel rays, spheres and
+// planes analytically. The buffer keeps the nearest primitive of every pixel, and only that primitive is intersected
+// along the pixel's ray, with the test traversal uses, so the hit is the one world.intersect reports. Pixels whose
+// two nearest fragments are too close to tell apart, whose primitive the ray misses after all, and those of tiles
+// with objects that cannot be rasterized are traced against the candidates of their tile instead.
+class VisibilityBuffer {
+    struct Sample {
+        // nothing covers the pixel when leaf is nullptr
+        const BasicObject *root, *leaf;
+        const Instance *instance;
+        size_t primitive;
+        bool traced;
+    };
+
+    const TileCandidates &candidates;
+    const Camera &camera;
+    int width, height, tileSize, tilesX;
+    std::vector<Sample> samples;
+
+    void rasterizeTile(int t);
+
+public:
+    // Rasterizes all the tiles in parallel. camera has to be a perspective one.
+    VisibilityBuffer(const TileCandidates &candidates, const Camera &camera, int width, int height, int tileSize);
+
+    // As TileCandidates::traceTile.
+    void traceTile(int t, Hit *hits, int step = 1) const;
+};
+
+#endif //RT_VISIBILITYBUFFER_H
@@ -1,12 +1,21 @@
+#include <algorithm>
 #include <iostream>
 #include <cstdint>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
 
+#include <random>
 #include <string>
 #include <vector>
 #include <unordered_map>
 
+#include "Arena.h"
 #include "Bitmap.h"
+#include "Group.h"
+#include "Mesh.h"
 #include "Scene.h"
+#include "Texture.h"
 
 const uint32_t RED = 0x000000FF;
 const uint32_t GREEN = 0x0000FF00;
@@ -36,13 +45,184 @@ int main(int argc, const char **argv) {
     if (cmdLineParams.find("-scene") != cmdLineParams.end())
         sceneId = atoi(cmdLineParams["-scene"].c_str());
 
-    int threads = 1;
+    RenderOptions options;
     if (cmdLineParams.find("-threads") != cmdLineParams.end())
-        threads = atoi(cmdLineParams["-threads"].c_str());
+        options.threads = atoi(cmdLineParams["-threads"].c_str());
+
+    if (cmdLineParams.find("-shadows") != cmdLineParams.end())
+        options.shadows = atoi(cmdLineParams["-shadows"].c_str()) != 0;
+
+    if (cmdLineParams.find("-depth") != cmdLineParams.end())
+        options.maxDepth = atoi(cmdLineParams["-depth"].c_str());
+
+    if (cmdLineParams.find("-pin") != cmdLineParams.end())
+        options.pinThreads = atoi(cmdLineParams["-pin"].c_str()) != 0;
+
+    if (cmdLineParams.find("-fast-math") != cmdLineParams.end())
+        options.fastMath = atoi(cmdLineParams["-fast-math"].c_str()) != 0;
+    options.post.fastMath = options.fastMath;
+
+    if (cmdLineParams.find("-tonemap") != cmdLineParams.end()) {
+        const std::string &op = cmdLineParams["-tonemap"];
+        options.post.toneMapping = op == "clamp" ? ToneMapClamp : op == "reinhard" ? ToneMapReinhard :
+                                   op == "aces" ? ToneMapAces : ToneMapNormalize;
+    }
+
+    if (cmdLineParams.find("-gamma") != cmdLineParams.end()) {
+        const std::string &transfer = cmdLineParams["-gamma"];
+        options.post.transfer = transfer == "2.2" ? TransferGamma22 : transfer == "srgb" ? TransferSrgb :
+                                TransferLinear;
+    }
+
+    if (cmdLineParams.find("-dither") != cmdLineParams.end())
+        options.post.dither = atoi(cmdLineParams["-dither"].c_str()) != 0;
+
+    if (cmdLineParams.find("-spp") != cmdLineParams.end())
+        options.samples = atoi(cmdLineParams["-spp"].c_str());
+
+    if (cmdLineParams.find("-denoise") != cmdLineParams.end())
+        options.denoise = atoi(cmdLineParams["-denoise"].c_str()) != 0;
+
+    if (cmdLineParams.find("-sort-rays") != cmdLineParams.end())
+        options.sortRays = atoi(cmdLineParams["-sort-rays"].c_str()) != 0;
+
+    if (cmdLineParams.find("-shadow-map") != cmdLineParams.end())
+        options.shadowMapSize = atoi(cmdLineParams["-shadow-map"].c_str());
+
+    if (cmdLineParams.find("-tile-candidates") != cmdLineParams.end())
+        options.tileCandidates = atoi(cmdLineParams["-tile-candidates"].c_str()) != 0;
+
+    if (cmdLineParams.find("-rasterize") != cmdLineParams.end())
+        options.rasterize = atoi(cmdLineParams["-rasterize"].c_str()) != 0;
+
+    if (cmdLineParams.find("-time-budget") != cmdLineParams.end())
+        options.timeBudget = atoi(cmdLineParams["-time-budget"].c_str());
+
+    if (cmdLineParams.find("-checkpoint") != cmdLineParams.end())
+        options.checkpoint = cmdLineParams["-checkpoint"];
+
+    if (cmdLineParams.find("-resume") != cmdLineParams.end()) {
+        options.checkpoint = cmdLineParams["-resume"];
+        options.resume = true;
+    }
+
+    double lightRadius = 0;
+    if (cmdLineParams.find("-light-radius") != cmdLineParams.end())
+        lightRadius = atof(cmdLineParams["-light-radius"].c_str());
+
+    options.progress = [](size_t doneTiles, size_t tilesCount) {
+        std::cout << "\rGenerated: " << 100.0 * doneTiles / tilesCount << "%" << std::flush;
+        if (doneTiles == tilesCount)
+            std::cout << std::endl;
+    };
+
+    size_t textureCacheMb = 64;
+    if (cmdLineParams.find("-texture-cache") != cmdLineParams.end())
+        textureCacheMb = atoi(cmdLineParams["-texture-cache"].c_str());
+
+    TextureCache textureCache(textureCacheMb << 20);
+    std::unique_ptr<Texture> floorTexture;
+    if (cmdLineParams.find("-texture") != cmdLineParams.end()) {
+        floorTexture = Texture::Load(cmdLineParams["-texture"], textureCache);
+        if (!floorTexture) {
+            std::cerr << "Can't load texture " << cmdLineParams["-texture"] << std::endl;
+            return 1;
+        }
+    }
+
+    // primitives and BVHs of the scene, released together at exit
+    bool hugePages = false;
+    if (cmdLineParams.find("-huge-pages") != cmdLineParams.end())
+        hugePages = atoi(cmdLineParams["-huge-pages"].c_str()) != 0;
+    Arena arena(hugePages);
 
     int height = 600;
     int width = 600;
-    std::vector<unsigned int> image;
+
+    // The views rendered, all in one job: a pinhole camera, a stereo pair, the six faces of a cubemap or a 360 degree
+    // panorama. Several views are saved next to -out with the name of the view appended.
+    auto parsePoint = [](const std::string &text) {
+        double x = 0, y = 0, z = 0;
+        sscanf(text.c_str(), "%lf,%lf,%lf", &x, &y, &z);
+        return Point(x, y, z);
+    };
+    Point cameraPosition, cameraTarget(0, 0, -1);
+    if (cmdLineParams.find("-camera-position") != cmdLineParams.end())
+        cameraPosition = parsePoint(cmdLineParams["-camera-position"]);
+    if (cmdLineParams.find("-camera-target") != cmdLineParams.end())
+        cameraTarget = parsePoint(cmdLineParams["-camera-target"]);
+
+    std::string cameraType = "pinhole";
+    if (cmdLineParams.find("-camera") != cmdLineParams.end())
+        cameraType = cmdLineParams["-camera"];
+
+    std::vector<View> views;
+    std::vector<std::string> viewNames;
+    if (cameraType == "stereo") {
+        double eyeDistance = 0.5;
+        if (cmdLineParams.find("-eye-distance") != cmdLineParams.end())
+            eyeDistance = atof(cmdLineParams["-eye-distance"].c_str());
+        for (const Camera &eye : Camera::Stereo(cameraPosition, cameraTarget, eyeDistance))
+            views.emplace_back(eye, width, height);
+        viewNames = {"_left", "_right"};
+    } else if (cameraType == "cubemap") {
+        for (const Camera &face : Camera::Cubemap(cameraPosition))
+            views.emplace_back(face, height, height);
+        viewNames = {"_px", "_nx", "_py", "_ny", "_pz", "_nz"};
+    } else if (cameraType == "panorama") {
+        width = 2 * height;
+        views.emplace_back(Camera::Panorama(cameraPosition, cameraTarget), width, height);
+    } else {
+        views.emplace_back(Camera(cameraPosition, cameraTarget), width, height);
+    }
+
+    // an image rendered earlier to compare the result with, e.g. by the double precision build
+    std::vector<unsigned int> reference;
+    if (cmdLineParams.find("-reference") != cmdLineParams.end()) {
+        int refWidth, refHeight;
+        if (!LoadBMP(cmdLineParams["-reference"].c_str(), reference, refWidth, refHeight) || refWidth != width ||
+            refHeight != height) {
+            std::cout << "Reference: cannot compare with " << cmdLineParams["-reference"] << std::endl;
+            return 1;
+        }
+    }
+
+    // Time to noise: with a path traced reference, e.g. one rendered with many samples, prints the error after every
+    // power of two samples and when it first drops below -noise-target.
+    double noiseTarget = 0;
+    if (cmdLineParams.find("-noise-target") != cmdLineParams.end())
+        noiseTarget = atof(cmdLineParams["-noise-target"].c_str());
+    auto renderStart = std::chrono::steady_clock::now();
+    bool targetReached = false;
+    if (options.samples > 0 && !reference.empty()) {
+        options.passFinished = [&](int samples, const std::vector<unsigned int> &pass) {
+            bool report = (samples & (samples - 1)) == 0 || samples == options.samples;
+            if (!report && (noiseTarget <= 0 || targetReached))
+                return;
+            double sum = 0;
+            for (size_t i = 0; i < reference.size(); ++i) {
+                for (int c = 0; c < 3; ++c) {
+                    int a = (pass[i] >> (8 * c)) & 0xFF, b = (reference[i] >> (8 * c)) & 0xFF;
+                    double d = (a - b) / 255.0;
+                    sum += d * d;
+                }
+            }
+            double rmse = std::sqrt(sum / (3 * reference.size()));
+            std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - renderStart;
+            if (report)
+                std::cout << "\rSamples " << samples << ": RMSE " << rmse << " after " << elapsed.count() << " ms"
+                          << std::endl;
+            if (noiseTarget > 0 && !targetReached && rmse <= noiseTarget) {
+                targetReached = true;
+                std::cout << "\rNoise target " << noiseTarget << " reached with " << samples << " samples in "
+                          << elapsed.count() << " ms" << std::endl;
+            }
+        };
+    }
+
+    Renderer renderer(options);
+    std::vector<std::vector<unsigned int>> images;
+    RenderStats stats;
     if (sceneId == 1) {
         // planes
         Material gray_polished(ReflectionParams(0.5, 0.3, 0.1), DiffusiveParams(0.3, 0.4, 0.4), 45.0, 0.0, 1.0);
@@ -50,87 +230,341 @@ int main(int argc, const char **argv) {
         Material green_polished(ReflectionParams(0.5, 0.3, 0.1), DiffusiveParams(0.3, 0.5, 0.3), 45.0, 0.0, 1.0);
         Material red_polished(ReflectionParams(0.5, 0.3, 0.1), DiffusiveParams(0.5, 0.2, 0.2), 45.0, 0.0, 1.0);
         Material yellow_polished(ReflectionParams(0.5, 0.3, 0.1), DiffusiveParams(0.7, 0.5, 0.0), 45.0, 0.0, 1.0);
-        Material pastel_matte_plane(ReflectionParams(0.8, 0.2, 0.0), DiffusiveParams(0.4, 0.4, 0.3), 10.0, 0.0, 1.0);
-        Material blue_matte(ReflectionParams(0.9, 0.1, 0.0), DiffusiveParams(0.1, 0.1, 0.3), 10.0, 0.0, 1.0);
+        Material pastel_matte_plane(ReflectionParams(0.8, 0.2, 0.0), DiffusiveParams(0.4, 0.4, 0.3), 10.0, 0.0, 1.0,
+                                    floorTexture.get());
+        Material blue_matte(ReflectionParams(0.9, 0.1, 0.0), DiffusiveParams(0.1, 0.1, 0.3), 10.0, 0.0, 1.0,
+                            floorTexture.get());
         Material dark_glass(ReflectionParams(0.0, 0.5, 0.1), DiffusiveParams(0.5, 0.6, 0.7), 125., 0.8, 1.5);
 
         std::vector<BasicObject *> objects;
-        Sphere sp1 = Sphere(Point(-4, -4, -16), 3, gray_polished);
-        objects.push_back(&sp1);
-        Sphere sp2 = Sphere(Point(4, -4, -14), 2.5, green_polished);
-        objects.push_back(&sp2);
-
-        Sphere sp3 = Sphere(Point(-1, -1, -11), 2, dark_glass);
-        objects.push_back(&sp3);
-        Sphere sp4 = Sphere(Point(1.5, -0.5, -30), 4, pink_polished);
-        objects.push_back(&sp4);
-        Sphere sp5 = Sphere(Point(8, -6, -24), 6, red_polished);
-        objects.push_back(&sp5);
-        Sphere sp6 = Sphere(Point(-10, 2, -24), 4, yellow_polished);
-        objects.push_back(&sp6);
-
-        Plane plane = Plane(Point(0.0, -7.0, 0.0), Point(0.0, 1.0, 0.0), blue_matte, pastel_matte_plane);
-        objects.push_back(&plane);
+        Sphere *sp1 = arena.make<Sphere>(ArenaPrimitives, Point(-4, -4, -16), 3, gray_polished);
+        objects.push_back(sp1);
+        Sphere *sp2 = arena.make<Sphere>(ArenaPrimitives, Point(4, -4, -14), 2.5, green_polished);
+        objects.push_back(sp2);
+
+        Sphere *sp3 = arena.make<Sphere>(ArenaPrimitives, Point(-1, -1, -11), 2, dark_glass);
+        objects.push_back(sp3);
+        Sphere *sp4 = arena.make<Sphere>(ArenaPrimitives, Point(1.5, -0.5, -30), 4, pink_polished);
+        objects.push_back(sp4);
+        Sphere *sp5 = arena.make<Sphere>(ArenaPrimitives, Point(8, -6, -24), 6, red_polished);
+        objects.push_back(sp5);
+        Sphere *sp6 = arena.make<Sphere>(ArenaPrimitives, Point(-10, 2, -24), 4, yellow_polished);
+        objects.push_back(sp6);
+
+        Plane *plane = arena.make<Plane>(
+                ArenaPrimitives, Point(0.0, -7.0, 0.0), Point(0.0, 1.0, 0.0), blue_matte, pastel_matte_plane);
+        objects.push_back(plane);
 
         std::vector<Light> lights;
-        lights.emplace_back(Point(-5, 4, -7.5), 1.8);
-        lights.emplace_back(Point(5, 4, -7.5), 1.8);
+        lights.emplace_back(Point(-5, 4, -7.5), 1.8, lightRadius);
+        lights.emplace_back(Point(5, 4, -7.5), 1.8, lightRadius);
 
-        image = scene(objects, lights, width, height, threads);
+        int edits = 0;
+        if (cmdLineParams.find("-edits") != cmdLineParams.end())
+            edits = atoi(cmdLineParams["-edits"].c_str());
+
+        int relights = 0;
+        if (cmdLineParams.find("-relight") != cmdLineParams.end())
+            relights = atoi(cmdLineParams["-relight"].c_str());
+
+        if (edits > 0 || relights > 0) {
+            // rolls the green sphere to the left, then swings the left light over the scene, each frame traces only
+            // the pixels the change affects
+            Scene scene(objects, lights, &arena);
+            IncrementalRenderer incremental(scene, views[0].camera, width, height, options, relights > 0);
+            incremental.render(&stats);
+            for (int e = 1; e <= edits + relights; ++e) {
+                if (e <= edits) {
+                    *sp2 = Sphere(Point(4 - 0.25 * e, -4, -14), 2.5, green_polished);
+                    scene.update(sp2);
+                } else {
+                    lights[0] = Light(Point(-5 + 0.5 * (e - edits), 4, -7.5), 1.8, lightRadius);
+                    scene.setLights(lights);
+                }
+                auto start = std::chrono::steady_clock::now();
+                images.assign(1, incremental.render(&stats));
+                std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+                std::cout << (e <= edits ? "Edit " : "Relight ") << (e <= edits ? e : e - edits) << ": traced "
+                          << incremental.getTracedPixels() << " pixels ("
+                          << 100.0 * incremental.getTracedPixels() / (width * height) << "%) in "
+                          << elapsed.count() << " ms" << std::endl;
+            }
+        } else {
+            images = renderer.render(Scene(objects, lights, &arena), views, &stats);
+        }
     } else if (sceneId == 2) {
         // room
         Material gray_polished(ReflectionParams(0.5, 0.3, 0.1), DiffusiveParams(0.3, 0.4, 0.4), 45.0, 0.0, 1.0);
         Material purple_matte_wall(ReflectionParams(0.8, 0.2, 0.0), DiffusiveParams(0.3, 0.3, 0.4), 10.0, 0.0, 1.0);
-        Material pastel_matte_wall(ReflectionParams(0.8, 0.2, 0.0), DiffusiveParams(0.4, 0.4, 0.3), 10.0, 0.0, 1.0);
+        Material pastel_matte_floor(ReflectionParams(0.8, 0.2, 0.0), DiffusiveParams(0.4, 0.4, 0.3), 10.0, 0.0, 1.0,
+                                    floorTexture.get());
         Material red_matte_wall(ReflectionParams(0.8, 0.2, 0.0), DiffusiveParams(0.6, 0.1, 0.1), 10.0, 0.0, 1.0);
         Material dark_red_matte(ReflectionParams(0.8, 0.2, 0.0), DiffusiveParams(0.3, 0.1, 0.1), 10.0, 0.0, 1.0);
-        Material blue_matte(ReflectionParams(0.9, 0.1, 0.0), DiffusiveParams(0.1, 0.1, 0.3), 10.0, 0.0, 1.0);
+        Material blue_matte(ReflectionParams(0.9, 0.1, 0.0), DiffusiveParams(0.1, 0.1, 0.3), 10.0, 0.0, 1.0,
+                            floorTexture.get());
         Material mirror(ReflectionParams(0.0, 10.0, 0.9), DiffusiveParams(1.0, 1.0, 1.0), 1400.0, 0.0, 1.0);
 
         std::vector<BasicObject *> objects;
-        Sphere sp1 = Sphere(Point(-3.99, -3.99, -15.99), 3, gray_polished);
-        objects.push_back(&sp1);
-        Sphere sp2 = Sphere(Point(4, -4.49, -13.99), 2.5, mirror);
-        objects.push_back(&sp2);
-
-        Plane floor = Plane(Point(0.0, -7.0, 0.0), Point(0.0, 1.0, 0.0), blue_matte, pastel_matte_wall);
-        objects.push_back(&floor);
-        Plane up = Plane(Point(0.0, 7.0, 0.0), Point(0.0, -1.0, 0.0), dark_red_matte, dark_red_matte);
-        objects.push_back(&up);
-        Plane left = Plane(Point(-7.0, 0.0, 0.0), Point(1.0, 0.0, 0.0), purple_matte_wall, purple_matte_wall);
-        objects.push_back(&left);
-        Plane right = Plane(Point(7.0, 0.0, 0.0), Point(-1.0, 0.0, 0.0), purple_matte_wall, purple_matte_wall);
-        objects.push_back(&right);
-        Plane back = Plane(Point(0.0, 0.0, -20.0), Point(0.0, 0.0, 1.0), purple_matte_wall, purple_matte_wall);
-        objects.push_back(&back);
-        Plane front = Plane(Point(0.0, 0.0, 5.0), Point(0.0, 0.0, -1.0), purple_matte_wall, red_matte_wall);
-        objects.push_back(&front);
-
-        Triangle wall_mir1 = Triangle(Point(-3.0, 0.0, -19.99999), Point(3.0, 0.0, -19.99999),
-                                      Point(3.0, 5.0, -19.99999),
-                                      mirror);
-        objects.push_back(&wall_mir1);
-        Triangle wall_mir2 = Triangle(Point(-3.0, 5.0, -19.99999), Point(-3.0, 0.0, -19.99999),
-                                      Point(3.0, 5.0, -19.99999),
-                                      mirror);
-        objects.push_back(&wall_mir2);
-        Triangle floor_triangle1 = Triangle(Point(-3.0, -7.0, -20.0), Point(0.0, -7.0, -17.0), Point(0.0, -3.0, -20.0),
-                                            red_matte_wall);
-        objects.push_back(&floor_triangle1);
-        Triangle floor_triangle2 = Triangle(Point(3.0, -7.0, -20.0), Point(0.0, -3.0, -20.0), Point(0.0, -7.0, -17.0),
-                                            red_matte_wall);
-        objects.push_back(&floor_triangle2);
+        Sphere *sp1 = arena.make<Sphere>(ArenaPrimitives, Point(-3.99, -3.99, -15.99), 3, gray_polished);
+        objects.push_back(sp1);
+        Sphere *sp2 = arena.make<Sphere>(ArenaPrimitives, Point(4, -4.49, -13.99), 2.5, mirror);
+        objects.push_back(sp2);
+
+        Plane *floor = arena.make<Plane>(
+                ArenaPrimitives, Point(0.0, -7.0, 0.0), Point(0.0, 1.0, 0.0), blue_matte, pastel_matte_floor);
+        objects.push_back(floor);
+        Plane *up = arena.make<Plane>(
+                ArenaPrimitives, Point(0.0, 7.0, 0.0), Point(0.0, -1.0, 0.0), dark_red_matte, dark_red_matte);
+        objects.push_back(up);
+        Plane *left = arena.make<Plane>(
+                ArenaPrimitives, Point(-7.0, 0.0, 0.0), Point(1.0, 0.0, 0.0), purple_matte_wall, purple_matte_wall);
+        objects.push_back(left);
+        Plane *right = arena.make<Plane>(
+                ArenaPrimitives, Point(7.0, 0.0, 0.0), Point(-1.0, 0.0, 0.0), purple_matte_wall, purple_matte_wall);
+        objects.push_back(right);
+        Plane *back = arena.make<Plane>(
+                ArenaPrimitives, Point(0.0, 0.0, -20.0), Point(0.0, 0.0, 1.0), purple_matte_wall, purple_matte_wall);
+        objects.push_back(back);
+        Plane *front = arena.make<Plane>(
+                ArenaPrimitives, Point(0.0, 0.0, 5.0), Point(0.0, 0.0, -1.0), purple_matte_wall, red_matte_wall);
+        objects.push_back(front);
+
+        Triangle *wall_mir1 = arena.make<Triangle>(
+                ArenaPrimitives, Point(-3.0, 0.0, -19.99999), Point(3.0, 0.0, -19.99999), Point(3.0, 5.0, -19.99999),
+                mirror);
+        objects.push_back(wall_mir1);
+        Triangle *wall_mir2 = arena.make<Triangle>(
+                ArenaPrimitives, Point(-3.0, 5.0, -19.99999), Point(-3.0, 0.0, -19.99999), Point(3.0, 5.0, -19.99999),
+                mirror);
+        objects.push_back(wall_mir2);
+        Triangle *floor_triangle1 = arena.make<Triangle>(
+                ArenaPrimitives, Point(-3.0, -7.0, -20.0), Point(0.0, -7.0, -17.0), Point(0.0, -3.0, -20.0),
+                red_matte_wall);
+        objects.push_back(floor_triangle1);
+        Triangle *floor_triangle2 = arena.make<Triangle>(
+                ArenaPrimitives, Point(3.0, -7.0, -20.0), Point(0.0, -3.0, -20.0), Point(0.0, -7.0, -17.0),
+                red_matte_wall);
+        objects.push_back(floor_triangle2);
+
+        std::vector<Light> lights;
+        lights.emplace_back(Point(-5, 4, -10), 1.8, lightRadius);
+        lights.emplace_back(Point(5, 4, -10), 1.8, lightRadius);
+
+        images = renderer.render(Scene(objects, lights, &arena), views, &stats);
+    } else if (sceneId == 3) {
+        // forest: one tree model placed 10000 times
+        Material bark(ReflectionParams(0.9, 0.1, 0.0), DiffusiveParams(0.35, 0.2, 0.1), 10.0, 0.0, 1.0);
+        Material leaves(ReflectionParams(0.8, 0.2, 0.0), DiffusiveParams(0.1, 0.45, 0.15), 20.0, 0.0, 1.0);
+        Material grass(ReflectionParams(0.9, 0.1, 0.0), DiffusiveParams(0.25, 0.35, 0.15), 10.0, 0.0, 1.0,
+                       floorTexture.get());
+
+        Point apex(0.0, 2.5, 0.0);
+        Point base[4] = {Point(-0.3, 0.0, -0.3), Point(0.3, 0.0, -0.3), Point(0.3, 0.0, 0.3), Point(-0.3, 0.0, 0.3)};
+        std::vector<BasicObject *> treeParts;
+        for (int i = 0; i < 4; ++i) {
+            treeParts.push_back(arena.make<Triangle>(ArenaPrimitives, base[(i + 1) % 4], base[i], apex, bark));
+        }
+        treeParts.push_back(arena.make<Sphere>(ArenaPrimitives, Point(0.0, 2.2, 0.0), 0.9, leaves));
+        Group *tree = arena.make<Group>(ArenaPrimitives, treeParts, &arena);
+
+        std::vector<BasicObject *> objects;
+        std::mt19937 random(1);
+        std::uniform_real_distribution<double> jitter(-1.0, 1.0);
+        for (int i = 0; i < 100; ++i) {
+            for (int j = 0; j < 100; ++j) {
+                Point position(3.0 * (i - 50) + jitter(random), -4.0, -6.0 - 3.0 * j + jitter(random));
+                Transform transform = Transform::Translate(position) * Transform::RotateY(M_PI * jitter(random)) *
+                                      Transform::Scale(1.0 + 0.3 * jitter(random));
+                objects.push_back(arena.make<Instance>(ArenaPrimitives, *tree, transform));
+            }
+        }
+
+        Plane *ground = arena.make<Plane>(ArenaPrimitives, Point(0.0, -4.0, 0.0), Point(0.0, 1.0, 0.0), grass, grass);
+        objects.push_back(ground);
+
+        std::vector<Light> lights;
+        lights.emplace_back(Point(-30, 40, 10), 1.2, lightRadius);
+
+        images = renderer.render(Scene(objects, lights, &arena), views, &stats);
+    } else if (sceneId == 4) {
+        // compact mesh: the model from -mesh or a finely tessellated torus
+        Material pink_polished(ReflectionParams(0.5, 0.3, 0.1), DiffusiveParams(0.5, 0.2, 0.5), 45.0, 0.0, 1.0);
+        Material pastel_matte_plane(ReflectionParams(0.8, 0.2, 0.0), DiffusiveParams(0.4, 0.4, 0.3), 10.0, 0.0, 1.0,
+                                    floorTexture.get());
+        Material blue_matte(ReflectionParams(0.9, 0.1, 0.0), DiffusiveParams(0.1, 0.1, 0.3), 10.0, 0.0, 1.0,
+                            floorTexture.get());
+
+        // with -mesh-file the mesh is paged in from a memory-mapped file, which is written on the first run
+        std::string meshFile;
+        if (cmdLineParams.find("-mesh-file") != cmdLineParams.end())
+            meshFile = cmdLineParams["-mesh-file"];
+        size_t meshMemoryMb = 0;
+        if (cmdLineParams.find("-mesh-memory") != cmdLineParams.end())
+            meshMemoryMb = atoi(cmdLineParams["-mesh-memory"].c_str());
+
+        std::unique_ptr<CompactMesh> mesh;
+        MappedMesh *mappedMesh = nullptr;
+        if (!meshFile.empty()) {
+            std::unique_ptr<MappedMesh> mapped = MappedMesh::Map(meshFile, pink_polished, meshMemoryMb << 20);
+            mappedMesh = mapped.get();
+            mesh = std::move(mapped);
+        }
+        if (!mesh) {
+            MeshData meshData;
+            if (cmdLineParams.find("-mesh") != cmdLineParams.end()) {
+                if (!LoadOBJ(cmdLineParams["-mesh"], meshData)) {
+                    std::cerr << "Can't load mesh " << cmdLineParams["-mesh"] << std::endl;
+                    return 1;
+                }
+            } else {
+                meshData = MakeTorus(1.0, 0.4, 1024, 512);
+            }
+            CompactMesh::Precision precision = CompactMesh::Quantized16;
+            if (cmdLineParams.find("-mesh-precision") != cmdLineParams.end() &&
+                cmdLineParams["-mesh-precision"] == "float")
+                precision = CompactMesh::Float;
+            mesh.reset(new CompactMesh(meshData, pink_polished, precision));
+            if (!meshFile.empty()) {
+                std::unique_ptr<MappedMesh> mapped;
+                if (mesh->Save(meshFile)) {
+                    mesh.reset();
+                    mapped = MappedMesh::Map(meshFile, pink_polished, meshMemoryMb << 20);
+                }
+                if (!mapped) {
+                    std::cerr << "Can't map mesh file " << meshFile << std::endl;
+                    return 1;
+                }
+                mappedMesh = mapped.get();
+                mesh = std::move(mapped);
+            }
+        }
+        std::cout << "Mesh: " << mesh->getTrianglesCount() << " triangles in " << mesh->getMemoryBytes() / 1024
+                  << " KiB (" << (double) mesh->getMemoryBytes() / mesh->getTrianglesCount() << " bytes per triangle)"
+                  << std::endl;
+
+        // fit the model into a box of size 10 standing on the floor
+        Bounds bounds = mesh->getBounds();
+        Point extent = bounds.max - bounds.min;
+        double scale = 10.0 / std::max(std::max(extent[0], extent[1]), extent[2]);
+        Point center = bounds.center();
+        Instance *model = arena.make<Instance>(
+                ArenaPrimitives, *mesh, Transform::Translate(Point(0.0, -7.0 + extent[1] * scale / 2, -18.0)) *
+                                        Transform::RotateY(M_PI / 6) * Transform::Scale(scale) *
+                                        Transform::Translate(-center));
+
+        std::vector<BasicObject *> objects;
+        objects.push_back(model);
+        Plane *plane = arena.make<Plane>(
+                ArenaPrimitives, Point(0.0, -7.0, 0.0), Point(0.0, 1.0, 0.0), blue_matte, pastel_matte_plane);
+        objects.push_back(plane);
 
         std::vector<Light> lights;
-        lights.emplace_back(Point(-5, 4, -10), 1.8);
-        lights.emplace_back(Point(5, 4, -10), 1.8);
+        lights.emplace_back(Point(-5, 6, -7.5), 1.8, lightRadius);
+        lights.emplace_back(Point(5, 4, -7.5), 1.2, lightRadius);
 
-        image = scene(objects, lights, width, height, threads);
+        images = renderer.render(Scene(objects, lights, &arena), views, &stats);
+        if (mappedMesh != nullptr) {
+            std::cout << "Mesh file: peak resident " << mappedMesh->getPeakResidentBytes() / 1024 << " KiB";
+            if (meshMemoryMb != 0)
+                std::cout << " (budget " << meshMemoryMb << " MiB)";
+            std::cout << ", process peak " << PeakProcessMemory() / (1 << 20) << " MiB" << std::endl;
+        }
     } else {
         return 0;
     }
 
-    SaveBMP(outFilePath.c_str(), image.data(), width, height);
+    if (stats.samples > 0)
+        std::cout << "Path tracing: " << stats.samples << " samples per pixel" << std::endl;
+    else
+        std::cout << "Kernel:" << (stats.features & FeatureShadows ? " shadows" : "")
+                  << (stats.features & FeatureSpecular ? " specular" : "")
+                  << (stats.features & FeatureReflection ? " reflection" : "")
+                  << (stats.features & FeatureRefraction ? " refraction" : "")
+                  << (stats.features & FeatureFastMath ? " fast-math" : "") << ", depth " << stats.maxDepth
+                  << (sizeof(Real) == sizeof(float) ? ", single precision" : "") << std::endl;
+    std::cout << "Shadow rays: " << stats.shadowRays << ", occluder cache hits: " << stats.occluderCacheHits
+              << " (" << stats.occluderHitRate() * 100 << "%)" << std::endl;
+    if (options.shadowMapSize > 0 && options.samples == 0) {
+        std::cout << "Shadow maps: " << stats.shadowMapHits << " lookups answered, "
+                  << 100.0 * stats.shadowMapHits / std::max(1ULL, stats.shadowMapHits + stats.shadowRays) << "%"
+                  << std::endl;
+    }
+    if (options.timeBudget > 0) {
+        std::cout << "Time budget: " << options.timeBudget << " ms, rendered in " << stats.milliseconds << " ms";
+        if (options.samples > 0) {
+            std::cout << " with " << stats.samples << " of " << options.samples << " samples per pixel";
+        } else if (unsigned tiles = stats.budgetTiles[0] + stats.budgetTiles[1] + stats.budgetTiles[2]) {
+            // frames of -edits and -relight trace their dirty pixels without a budget
+            std::cout << ", tiles at full resolution " << 100.0 * stats.budgetTiles[0] / tiles << "%, half "
+                      << 100.0 * stats.budgetTiles[1] / tiles << "%, quarter " << 100.0 * stats.budgetTiles[2] / tiles
+                      << "%";
+        }
+        std::cout << std::endl;
+    }
+    if (!options.checkpoint.empty() && options.timeBudget == 0) {
+        if (stats.checkpointed)
+            std::cout << "Checkpoint: " << stats.resumedTiles << " tiles resumed" << std::endl;
+        else
+            std::cerr << "Can't map checkpoint file " << options.checkpoint << std::endl;
+    }
+    if (floorTexture) {
+        std::cout << "Texture cache: " << textureCache.getHits() << " hits, " << textureCache.getMisses()
+                  << " misses, peak " << textureCache.getPeakBytes() / 1024 << " KiB" << std::endl;
+    }
+    std::cout << "Scene memory: primitives " << arena.getUsedBytes(ArenaPrimitives) / 1024.0 << " KiB, BVH "
+              << arena.getUsedBytes(ArenaNodes) / 1024.0 << " KiB, " << arena.getReservedBytes() / 1024
+              << " KiB reserved";
+    if (hugePages)
+        std::cout << " (" << arena.getHugePageBytes() / 1024 << " KiB in huge pages)";
+    std::cout << std::endl;
+
+    for (size_t v = 0; v < images.size(); ++v) {
+        std::string path = outFilePath;
+        if (images.size() > 1)
+            path.insert(std::min(path.rfind('.'), path.size()), viewNames[v]);
+        SaveBMP(path.c_str(), images[v].data(), views[v].width, views[v].height);
+    }
+
+    const std::vector<unsigned int> &image = images[0];
+
+    if (!reference.empty()) {
+        size_t differing = 0;
+        unsigned int maxDiff = 0;
+        double sumDiff = 0;
+        for (size_t i = 0; i < reference.size(); ++i) {
+            unsigned int pixelDiff = 0;
+            for (int c = 0; c < 3; ++c) {
+                int a = (image[i] >> (8 * c)) & 0xFF, b = (reference[i] >> (8 * c)) & 0xFF;
+                pixelDiff = std::max(pixelDiff, (unsigned int) std::abs(a - b));
+                sumDiff += std::abs(a - b);
+            }
+            differing += pixelDiff != 0;
+            maxDiff = std::max(maxDiff, pixelDiff);
+        }
+        std::cout << "Reference: " << differing << " pixels differ (" << 100.0 * differing / reference.size()
+                  << "%), max " << maxDiff << ", mean " << sumDiff / (3 * reference.size()) << std::endl;
+        // fails when more than the -outliers percentage of pixels differ by more than -max-difference levels
+        if (cmdLineParams.find("-max-difference") != cmdLineParams.end()) {
+            unsigned int maxDifference = atoi(cmdLineParams["-max-difference"].c_str());
+            double outliers = 0;
+            if (cmdLineParams.find("-outliers") != cmdLineParams.end())
+                outliers = atof(cmdLineParams["-outliers"].c_str());
+            size_t beyond = 0;
+            for (size_t i = 0; i < reference.size(); ++i) {
+                for (int c = 0; c < 3; ++c) {
+                    int a = (image[i] >> (8 * c)) & 0xFF, b = (reference[i] >> (8 * c)) & 0xFF;
+                    if ((unsigned int) std::abs(a - b) > maxDifference) {
+                        ++beyond;
+                        break;
+                    }
+                }
+            }
+            std::cout << "Reference: " << 100.0 * beyond / reference.size() << "% of pixels differ by more than "
+                      << maxDifference << ", " << outliers << "% allowed" << std::endl;
+            if (100.0 * beyond > outliers * reference.size())
+                return 2;
+        }
+    }
     std::cout << "end." << std::endl;
     return 0;
 }
\ No newline at end of file
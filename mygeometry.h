@@ -4,8 +4,17 @@
 #include <cstdlib>
 #include <cmath>
 #include <limits>
+#include <utility>
+#include <vector>
 
-constexpr double EPS = 0.0001;
+// scalar used for geometry and shading, the RT_SINGLE_PRECISION build traces and shades in float
+#ifdef RT_SINGLE_PRECISION
+using Real = float;
+#else
+using Real = double;
+#endif
+
+constexpr Real EPS = 0.0001;
 constexpr int refComplexity = 4;
 constexpr int MAX_DIST = 1000;
 
@@ -27,8 +36,8 @@ public:
         return point[(i < 0) ? 0 : i];
     }
 
-    double length() const {
-        return sqrt(point[0] * point[0] + point[1] * point[1] + point[2] * point[2]);
+    T length() const {
+        return std::sqrt(point[0] * point[0] + point[1] * point[1] + point[2] * point[2]);
     }
 
     Triple<T> &normalize(T l = 1) {
@@ -44,22 +53,22 @@ public:
         return *this - N * 2.0 * (*this * N);
     }
 
-    Triple<T> refract(const Triple<T> &N, const double refIdx) const {
+    Triple<T> refract(const Triple<T> &N, const Real refIdx) const {
         // Snell's law
-        double cos = -std::max(-1.0, std::min(1.0, *this * N));
-        double n1 = 1, n2 = refIdx;
+        Real cos = -std::max<Real>(-1, std::min<Real>(1, *this * N));
+        Real n1 = 1, n2 = refIdx;
         Triple<T> n = N;
         if (cos < 0) {
             cos *= -1;
             std::swap(n1, n2);
             n = n * -1;
         }
-        double d = n1 / n2;
-        double k = 1.1 - d * d * (1 - cos * cos);
+        Real d = n1 / n2;
+        Real k = 1.1 - d * d * (1 - cos * cos);
         if (k < 0) {
             return Triple<T>();
         }
-        return *this * d + n * (d * cos - sqrt(k));
+        return *this * d + n * (d * cos - std::sqrt(k));
     }
 
     T operator*(const Triple<T> &right) const {
@@ -78,6 +87,18 @@ public:
         return result;
     }
 
+    Triple<T> &operator+=(const Triple<T> &right) {
+        for (size_t i = 0; i < 3; ++i) {
+            point[i] += right[i];
+        }
+        return *this;
+    }
+
+    // component-wise product, for colours
+    Triple<T> modulated(const Triple<T> &right) const {
+        return Triple<T>(point[0] * right[0], point[1] * right[1], point[2] * right[2]);
+    }
+
     Triple<T> operator-(const Triple<T> &right) const {
         Triple<T> result;
         for (size_t i = 0; i < 3; ++i) {
@@ -98,46 +119,344 @@ public:
     Triple<T> operator-() const {
         return *this * T(-1);
     }
+
+    Triple<T> cross(const Triple<T> &right) const {
+        return Triple<T>(point[1] * right[2] - point[2] * right[1], point[2] * right[0] - point[0] * right[2],
+                         point[0] * right[1] - point[1] * right[0]);
+    }
 };
 
-using Point = Triple<double>;
-using Colour = Triple<double>;
-using ReflectionParams = Triple<double>;
-using RefractionParams = Triple<double>;
-using DiffusiveParams = Triple<double>;
-using Pixel = Triple<double>;
+using Point = Triple<Real>;
+using Colour = Triple<Real>;
+using ReflectionParams = Triple<Real>;
+using RefractionParams = Triple<Real>;
+using DiffusiveParams = Triple<Real>;
+using Pixel = Triple<Real>;
+// u, v and the number of uv units per world unit, which drives mip level selection
+using UV = Triple<Real>;
+
+class Texture;
+
+// Distance a secondary ray origin is moved off the surface at p. The rounding error of a hit point grows with its
+// coordinates, so away from the origin the offset is a fixed number of ulps of the largest one instead of EPS.
+inline Real RayOffset(const Point &p) {
+    constexpr Real ulps = 256;
+    Real scale = std::max(std::max(std::abs(p[0]), std::abs(p[1])), std::abs(p[2]));
+    return std::max(EPS, scale * ulps * std::numeric_limits<Real>::epsilon());
+}
+
+struct Bounds {
+    Point min, max;
+
+    Bounds() : min(INFINITY, INFINITY, INFINITY), max(-INFINITY, -INFINITY, -INFINITY) {
+    }
+
+    Bounds(const Point &min, const Point &max) : min(min), max(max) {
+    }
 
+    static Bounds Infinite() {
+        return Bounds(Point(-INFINITY, -INFINITY, -INFINITY), Point(INFINITY, INFINITY, INFINITY));
+    }
+
+    bool isFinite() const {
+        for (size_t i = 0; i < 3; ++i) {
+            if (!std::isfinite(min[i]) || !std::isfinite(max[i])) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void grow(const Point &p) {
+        for (size_t i = 0; i < 3; ++i) {
+            min[i] = std::min(min[i], p[i]);
+            max[i] = std::max(max[i], p[i]);
+        }
+    }
+
+    void grow(const Bounds &b) {
+        grow(b.min);
+        grow(b.max);
+    }
+
+    Point center() const {
+        return (min + max) * 0.5;
+    }
+
+    // Slab test against the ray segment [0, tMax], invDir holds reciprocals of the direction components.
+    bool areIntersected(const Point &beamPoint, const Point &invDir, Real tMax) const {
+        Real tNear;
+        return areIntersected(beamPoint, invDir, tMax, tNear);
+    }
+
+    // also reports the entry distance, clamped to 0
+    bool areIntersected(const Point &beamPoint, const Point &invDir, Real tMax, Real &tNear) const {
+        tNear = 0;
+        Real tFar = tMax;
+        for (size_t i = 0; i < 3; ++i) {
+            Real t0 = (min[i] - beamPoint[i]) * invDir[i];
+            Real t1 = (max[i] - beamPoint[i]) * invDir[i];
+            if (t0 > t1) {
+                std::swap(t0, t1);
+            }
+            // rounded up by twice the error bound of t1 (Ize 2013), so a box is not missed by a ray that only
+            // grazes it, as rays through the shared edges of flat clusters and triangles do
+            t1 *= 1 + 6 * std::numeric_limits<Real>::epsilon();
+            tNear = t0 > tNear ? t0 : tNear;
+            tFar = t1 < tFar ? t1 : tFar;
+            if (tNear > tFar) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+// Affine transform stored as the upper 3x4 part of a 4x4 matrix.
+class Transform {
+    Real m[3][4];
+
+public:
+    Transform() {
+        for (size_t i = 0; i < 3; ++i) {
+            for (size_t j = 0; j < 4; ++j) {
+                m[i][j] = i == j ? 1 : 0;
+            }
+        }
+    }
+
+    static Transform Translate(const Point &offset) {
+        Transform result;
+        for (size_t i = 0; i < 3; ++i) {
+            result.m[i][3] = offset[i];
+        }
+        return result;
+    }
+
+    static Transform Scale(Real factor) {
+        Transform result;
+        for (size_t i = 0; i < 3; ++i) {
+            result.m[i][i] = factor;
+        }
+        return result;
+    }
+
+    static Transform RotateY(Real angle) {
+        Transform result;
+        result.m[0][0] = cos(angle);
+        result.m[0][2] = sin(angle);
+        result.m[2][0] = -sin(angle);
+        result.m[2][2] = cos(angle);
+        return result;
+    }
+
+    // (a * b) applies b first
+    Transform operator*(const Transform &right) const {
+        Transform result;
+        for (size_t i = 0; i < 3; ++i) {
+            for (size_t j = 0; j < 4; ++j) {
+                result.m[i][j] = (j == 3 ? m[i][3] : 0);
+                for (size_t k = 0; k < 3; ++k) {
+                    result.m[i][j] += m[i][k] * right.m[k][j];
+                }
+            }
+        }
+        return result;
+    }
+
+    Point applyPoint(const Point &p) const {
+        return applyVector(p) + Point(m[0][3], m[1][3], m[2][3]);
+    }
+
+    Point applyVector(const Point &v) const {
+        return Point(m[0][0] * v[0] + m[0][1] * v[1] + m[0][2] * v[2],
+                     m[1][0] * v[0] + m[1][1] * v[1] + m[1][2] * v[2],
+                     m[2][0] * v[0] + m[2][1] * v[1] + m[2][2] * v[2]);
+    }
+
+    // Multiplies by the transposed linear part, call it on the inverse transform to carry normals over.
+    Point applyNormal(const Point &n) const {
+        return Point(m[0][0] * n[0] + m[1][0] * n[1] + m[2][0] * n[2],
+                     m[0][1] * n[0] + m[1][1] * n[1] + m[2][1] * n[2],
+                     m[0][2] * n[0] + m[1][2] * n[1] + m[2][2] * n[2]);
+    }
+
+    Bounds applyBounds(const Bounds &b) const {
+        Bounds result;
+        for (int corner = 0; corner < 8; ++corner) {
+            result.grow(applyPoint(Point(corner & 1 ? b.max[0] : b.min[0], corner & 2 ? b.max[1] : b.min[1],
+                                         corner & 4 ? b.max[2] : b.min[2])));
+        }
+        return result;
+    }
+
+    Transform inverse() const {
+        Transform result;
+        Real det = m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1]) -
+                     m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0]) +
+                     m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+        for (size_t i = 0; i < 3; ++i) {
+            for (size_t j = 0; j < 3; ++j) {
+                size_t r0 = (j + 1) % 3, r1 = (j + 2) % 3, c0 = (i + 1) % 3, c1 = (i + 2) % 3;
+                result.m[i][j] = (m[r0][c0] * m[r1][c1] - m[r0][c1] * m[r1][c0]) / det;
+            }
+        }
+        Point offset = result.applyVector(Point(m[0][3], m[1][3], m[2][3]));
+        for (size_t i = 0; i < 3; ++i) {
+            result.m[i][3] = -offset[i];
+        }
+        return result;
+    }
+};
+
+// Point light, or a sphere light for the path tracer when given a radius. Light does not fall off with distance.
 class Light {
     Point p;
-    double intensity;
+    Real intensity;
+    Real radius;
 
 public:
-    Light(const Point &position, double intensity) : p(position), intensity(intensity) {
+    Light(const Point &position, Real intensity, Real radius = 0) : p(position), intensity(intensity), radius(radius) {
     }
 
     Point getPosition() const {
         return p;
     }
 
-    double getIntensity() const {
+    Real getIntensity() const {
         return intensity;
     }
+
+    Real getRadius() const {
+        return radius;
+    }
 };
 
 struct Material {
     ReflectionParams reflectionParams;
     DiffusiveParams diffusiveParams;
-    double specularParam;
-    double refractiveParam;
-    double refractiveIndex;
-
-    Material(const ReflectionParams &reflect = {1, 0, 0}, const DiffusiveParams &diffuse = {}, double specular = {},
-             double refraction = {}, double refIdx = {}) :
+    Real specularParam;
+    Real refractiveParam;
+    Real refractiveIndex;
+    // modulates diffusiveParams when set
+    const Texture *texture;
+
+    Material(const ReflectionParams &reflect = {1, 0, 0}, const DiffusiveParams &diffuse = {}, Real specular = {},
+             Real refraction = {}, Real refIdx = {}, const Texture *texture = nullptr) :
             reflectionParams(reflect),
             diffusiveParams(diffuse),
             specularParam(specular),
             refractiveParam(refraction),
-            refractiveIndex(refIdx) {
+            refractiveIndex(refIdx),
+            texture(texture) {
+    }
+};
+
+class BasicObject;
+class Instance;
+
+struct Hit {
+    Real t;
+    // primitive that was hit and, when it was reached through an Instance, the instance that placed it
+    const BasicObject *object;
+    const Instance *instance;
+    // object of the scene the primitive belongs to, set by the outermost Group
+    const BasicObject *root;
+    // element of the object and barycentric coordinates inside it, set by objects made of several triangles
+    size_t primitive;
+    Real b1, b2;
+
+    Hit() : t(MAX_DIST), object(nullptr), instance(nullptr), root(nullptr), primitive(0), b1(0), b2(0) {
+    }
+};
+
+// Watertight triangle test of Woop, Benthin and Wald (2013). The ray runs along axis kz, sheared by (sx, sy) along kx
+// and ky it runs along z with unit speed when scaled by sz. The 2D edge functions in that space depend only on the
+// two vertices of an edge, so a ray cannot slip between triangles that share one. Set up once per ray and handed
+// down to every triangle it is tested against.
+struct RayShear {
+    int kx, ky, kz;
+    Real sx, sy, sz;
+
+    RayShear() : kx(0), ky(1), kz(2), sx(0), sy(0), sz(1) {
+    }
+
+    explicit RayShear(const Point &direction) {
+        set(direction);
+    }
+
+    void set(const Point &d) {
+        Real dx = std::abs(d[0]), dy = std::abs(d[1]), dz = std::abs(d[2]);
+        kz = dx > dy ? (dx > dz ? 0 : 2) : (dy > dz ? 1 : 2);
+        kx = kz == 2 ? 0 : kz + 1;
+        ky = kx == 2 ? 0 : kx + 1;
+        // keeps the winding of the triangle
+        if (d[kz] < 0) {
+            std::swap(kx, ky);
+        }
+        sz = 1 / d[kz];
+        sx = d[kx] * sz;
+        sy = d[ky] * sz;
+    }
+
+    // Distance t0 along the ray from beamPoint to triangle p0 p1 p2 and the weights b1, b2 of p1 and p2 at the hit.
+    // One sided triangles are only hit from the side their counterclockwise winding faces, t0 may be negative.
+    template<bool TwoSided>
+    bool intersect(const Point &beamPoint, const Point &p0, const Point &p1, const Point &p2, Real &t0, Real &b1,
+                   Real &b2) const {
+        Point a = p0 - beamPoint, b = p1 - beamPoint, c = p2 - beamPoint;
+        Real bx = b[kx] - sx * b[kz], by = b[ky] - sy * b[kz];
+        Real cx = c[kx] - sx * c[kz], cy = c[ky] - sy * c[kz];
+        Real u = cx * by - cy * bx;
+        if (!TwoSided && u < 0) {
+            return false;
+        }
+        Real ax = a[kx] - sx * a[kz], ay = a[ky] - sy * a[kz];
+        Real v = ax * cy - ay * cx, w = bx * ay - by * ax;
+#ifdef RT_SINGLE_PRECISION
+        // a float edge function of zero may have the wrong sign
+        if (u == 0 || v == 0 || w == 0) {
+            u = (Real) ((double) cx * by - (double) cy * bx);
+            v = (Real) ((double) ax * cy - (double) ay * cx);
+            w = (Real) ((double) bx * ay - (double) by * ax);
+        }
+#endif
+        if ((u < 0 || v < 0 || w < 0) && (!TwoSided || u > 0 || v > 0 || w > 0)) {
+            return false;
+        }
+        Real det = u + v + w;
+        if (det == 0) {
+            return false;
+        }
+        t0 = (u * a[kz] + v * b[kz] + w * c[kz]) * sz / det;
+        b1 = v / det;
+        b2 = w / det;
+        return true;
+    }
+};
+
+// Receives the primitives objects draw into a tile of a VisibilityBuffer. leaf is the object that intersects the
+// primitive again through intersectPrimitive, primitive tells it which one when it holds several. Objects placed by
+// an instance draw in their own space, the target takes them to the world.
+class RasterTarget {
+public:
+    // false when nothing inside bounds can cover a pixel of the tile or be seen in front of what covers them
+    virtual bool overlaps(const Bounds &bounds) = 0;
+
+    // camera position in the space of the primitives drawn, objects made of many draw the near ones first
+    virtual Point viewpoint() const = 0;
+
+    virtual void triangle(const BasicObject *leaf, size_t primitive, const Point &p0, const Point &p1, const Point &p2,
+                          bool twoSided) = 0;
+
+    virtual void sphere(const BasicObject *leaf, const Point &center, Real radius) = 0;
+
+    virtual void plane(const BasicObject *leaf, const Point &point, const Point &normal) = 0;
+
+    // Primitives drawn from now on are placed by instance, nullptr when they are in the world already.
+    virtual void setInstance(const Instance *instance) = 0;
+
+    virtual ~RasterTarget() {
     }
 };
 
@@ -147,26 +466,89 @@ public:
 
     virtual Point getNormal(Point &p) const = 0;
 
-    virtual bool areIntersected(const Point &beamPoint, const Point &direction, double &t0) const = 0;
+    virtual bool areIntersected(const Point &beamPoint, const Point &direction, Real &t0) const = 0;
+
+    virtual UV getUV(const Point &p) const {
+        return UV();
+    }
+
+    // Normal used for shading a hit reported by intersect, objects with interpolated normals override it.
+    virtual Point getShadingNormal(const Hit &hit, Point &p) const {
+        return getNormal(p);
+    }
+
+    virtual Bounds getBounds() const {
+        return Bounds::Infinite();
+    }
+
+    virtual void getMaterials(std::vector<Material> &materials) const = 0;
+
+    // False when no ray from beamPoint whose direction lies in the cone spanned by directions can hit the object.
+    // Only unbounded objects need it, the others are culled through their bounds.
+    virtual bool mayBeHit(const Point &beamPoint, const Point *directions, size_t count) const {
+        return true;
+    }
+
+    // Updates hit when this object is intersected in front of the beam point and closer than hit.t.
+    virtual bool intersect(const Point &beamPoint, const Point &direction, Hit &hit) const {
+        Real t0;
+        return areIntersected(beamPoint, direction, t0) && closer(t0, hit);
+    }
+
+    // The tests above for callers that have sheared the ray already, objects made of triangles take it over.
+    virtual bool areIntersected(const Point &beamPoint, const Point &direction, const RayShear &shear,
+                                Real &t0) const {
+        return areIntersected(beamPoint, direction, t0);
+    }
+
+    virtual bool intersect(const Point &beamPoint, const Point &direction, const RayShear &shear, Hit &hit) const {
+        return intersect(beamPoint, direction, hit);
+    }
+
+    // Draws the primitives of the object into target. False when it cannot be rasterized and has to be traced.
+    virtual bool rasterize(RasterTarget &target) const {
+        return false;
+    }
+
+    // intersect limited to the primitive leaf drew with the given index, leaf is this object or one inside it.
+    virtual bool intersectPrimitive(const Point &beamPoint, const Point &direction, const RayShear &shear,
+                                    const BasicObject *leaf, size_t primitive, Hit &hit) const {
+        return intersect(beamPoint, direction, shear, hit);
+    }
+
+    virtual ~BasicObject() {
+    }
+
+protected:
+    // Makes t0 on this object the hit when it lies in front of the beam point and closer than hit.t.
+    bool closer(Real t0, Hit &hit) const {
+        if (t0 >= 0 && t0 < hit.t) {
+            hit.t = t0;
+            hit.object = this;
+            hit.instance = nullptr;
+            return true;
+        }
+        return false;
+    }
 };
 
 class Sphere : public BasicObject {
     Point center;
-    double radius;
+    Real radius;
     Material material;
 public:
-    Sphere(const Point &c, double r, const Material &mat) : center(c), radius(r), material(mat) {}
+    Sphere(const Point &c, Real r, const Material &mat) : center(c), radius(r), material(mat) {}
 
-    bool areIntersected(const Point &beamPoint, const Point &direction, double &t0) const {
+    bool areIntersected(const Point &beamPoint, const Point &direction, Real &t0) const {
         Point vB2C = center - beamPoint;
-        double posB2C = vB2C * direction;
-        double d2 = vB2C * vB2C - posB2C * posB2C;
+        Real posB2C = vB2C * direction;
+        Real d2 = vB2C * vB2C - posB2C * posB2C;
         if (d2 > radius * radius) {
             return false;
         }
-        double dist = sqrt(radius * radius - d2);
+        Real dist = sqrt(radius * radius - d2);
         t0 = posB2C - dist;
-        double t1 = posB2C + dist;
+        Real t1 = posB2C + dist;
         if (t0 < 0) {
             t0 = t1;
         }
@@ -177,9 +559,28 @@ public:
         return (p - center).normalized();
     }
 
+    Bounds getBounds() const {
+        return Bounds(center - Point(radius, radius, radius), center + Point(radius, radius, radius));
+    }
+
+    bool rasterize(RasterTarget &target) const {
+        target.sphere(this, center, radius);
+        return true;
+    }
+
+    UV getUV(const Point &p) const {
+        Point d = (p - center) * (1.0 / radius);
+        return UV(0.5 + atan2(d[2], d[0]) / (2 * M_PI), acos(std::max<Real>(-1, std::min<Real>(1, d[1]))) / M_PI,
+                  1.0 / (M_PI * radius));
+    }
+
     Material getMaterial(Point &p) const {
         return material;
     }
+
+    void getMaterials(std::vector<Material> &materials) const {
+        materials.push_back(material);
+    }
 };
 
 class Plane : public BasicObject {
@@ -187,22 +588,52 @@ class Plane : public BasicObject {
     Point point;
     Material material1;
     Material material2;
+    Point tangent, bitangent;
+    Real uvScale;
 public:
-    Plane(const Point &point, const Point &normal, const Material &mat1, const Material &mat2) :
-            normal(normal.normalized()), point(point), material1(mat1), material2(mat2) {
+    Plane(const Point &point, const Point &normal, const Material &mat1, const Material &mat2, Real uvScale = 0.25) :
+            normal(normal.normalized()), point(point), material1(mat1), material2(mat2), uvScale(uvScale) {
+        tangent = this->normal.cross(std::abs(this->normal[0]) < 0.9 ? Point(1, 0, 0) : Point(0, 1, 0)).normalize();
+        bitangent = this->normal.cross(tangent);
     }
 
     Material getMaterial(Point &p) const {
         return (((int) (0.5 * p[0] + 1000) + (int) (0.5 * p[2])) % 2) ? material1 : material2;
     }
 
+    void getMaterials(std::vector<Material> &materials) const {
+        materials.push_back(material1);
+        materials.push_back(material2);
+    }
+
     Point getNormal(Point &p) const {
         return normal;
     }
 
-    bool areIntersected(const Point &beamPoint, const Point &direction, double &t0) const {
+    UV getUV(const Point &p) const {
+        Point d = p - point;
+        return UV(d * tangent * uvScale, d * bitangent * uvScale, uvScale);
+    }
+
+    bool rasterize(RasterTarget &target) const {
+        target.plane(this, point, normal);
+        return true;
+    }
+
+    // hit from the side of beamPoint only by directions heading to the other side
+    bool mayBeHit(const Point &beamPoint, const Point *directions, size_t count) const {
+        Real side = (beamPoint - point) * normal;
+        for (size_t k = 0; k < count; ++k) {
+            if (side * (directions[k] * normal) <= 0) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool areIntersected(const Point &beamPoint, const Point &direction, Real &t0) const {
         if (std::abs(direction * normal) > EPS / 100) {
-            double plane_dist = -((beamPoint - point) * normal) / (direction * normal);
+            Real plane_dist = -((beamPoint - point) * normal) / (direction * normal);
             if (plane_dist > 0) {
                 t0 = plane_dist;
                 return true;
@@ -216,44 +647,74 @@ public:
 
 class Triangle : public BasicObject {
     Point p0, p1, p2;
+    Point normal;
     Material material;
+    UV uv0, uv1, uv2;
 
     Point helpNormal(Point v1, Point v2) const {
         return Point(v1[1] * v2[2] - v1[2] * v2[1], v1[2] * v2[0] - v1[0] * v2[2], v1[0] * v2[1] - v1[1] * v2[0]);
     }
 public:
-    Triangle(const Point &p0 = {}, const Point &p1 = {}, const Point &p2 = {}, const Material &mat = {}) :
-            p0(p0), p1(p1), p2(p2), material(mat) {
+    Triangle(const Point &p0 = {}, const Point &p1 = {}, const Point &p2 = {}, const Material &mat = {},
+             const UV &uv0 = UV(0, 0), const UV &uv1 = UV(1, 0), const UV &uv2 = UV(0, 1)) :
+            p0(p0), p1(p1), p2(p2), normal(helpNormal(p1 - p0, p2 - p0).normalized()), material(mat), uv0(uv0),
+            uv1(uv1), uv2(uv2) {
     }
 
     Material getMaterial(Point &p) const {
         return material;
     }
 
+    void getMaterials(std::vector<Material> &materials) const {
+        materials.push_back(material);
+    }
+
     Point getNormal(Point &p) const {
-        return helpNormal(p1 - p0, p2 - p0).normalized();
+        return normal;
     }
 
-    bool areIntersected(const Point &beamPoint, const Point &direction, double &t0) const {
-        Point e1 = p1 - p0, e2 = p2 - p0;
-        Point v1 = helpNormal(direction, e2);
-        double d = e1 * v1;
-        if (std::abs(d) < EPS) {
-            return false;
-        }
-        Point v2 = beamPoint - p0;
-        double u = v2 * v1;
-        if (u < 0 || u > d) {
-            return false;
-        }
-        Point v3 = helpNormal(v2, e1);
-        double v = direction * v3;
-        if (v < 0 || u + v > d) {
-            return false;
-        }
-        t0 = e2 * v3 * (1.0 / d);
+    Bounds getBounds() const {
+        Bounds result;
+        result.grow(p0);
+        result.grow(p1);
+        result.grow(p2);
+        return result;
+    }
+
+    bool rasterize(RasterTarget &target) const {
+        target.triangle(this, 0, p0, p1, p2, false);
         return true;
     }
+
+    UV getUV(const Point &p) const {
+        Point e1 = p1 - p0, e2 = p2 - p0, d = p - p0;
+        Real d11 = e1 * e1, d12 = e1 * e2, d22 = e2 * e2;
+        Real d1 = d * e1, d2 = d * e2;
+        Real denom = d11 * d22 - d12 * d12;
+        Real b1 = (d22 * d1 - d12 * d2) / denom, b2 = (d11 * d2 - d12 * d1) / denom;
+        UV uv = uv0 + (uv1 - uv0) * b1 + (uv2 - uv0) * b2;
+        uv[2] = sqrt((uv1 - uv0).cross(uv2 - uv0).length() / e1.cross(e2).length());
+        return uv;
+    }
+
+    // Watertight, only the side getNormal points to is hit.
+    bool areIntersected(const Point &beamPoint, const Point &direction, Real &t0) const {
+        return areIntersected(beamPoint, direction, RayShear(direction), t0);
+    }
+
+    bool areIntersected(const Point &beamPoint, const Point &direction, const RayShear &shear, Real &t0) const {
+        Real b1, b2;
+        return shear.intersect<false>(beamPoint, p0, p1, p2, t0, b1, b2);
+    }
+
+    bool intersect(const Point &beamPoint, const Point &direction, Hit &hit) const {
+        return intersect(beamPoint, direction, RayShear(direction), hit);
+    }
+
+    bool intersect(const Point &beamPoint, const Point &direction, const RayShear &shear, Hit &hit) const {
+        Real t0;
+        return areIntersected(beamPoint, direction, shear, t0) && closer(t0, hit);
+    }
 };
 
 
@@ -0,0 +1,105 @@
+#include <cmath>
+#include <cstdio>
+
+#include "FastMath.h"
+
+// Sweeps every function of FastMath.h over the range it documents and checks the error bound it states against
+// the standard library evaluated in double. Returns non-zero when a bound is exceeded.
+
+static bool
+report(const char *name, double worst, float worstX, double bound) {
+    bool passed = worst < bound;
+    std::printf("%-10s max error %.3g at %.9g (bound %.3g) %s\n", name, worst, worstX, bound, passed ? "ok" : "FAILED");
+    return passed;
+}
+
+// bits of the positive normal floats, every stride-th one and the largest
+template<typename F>
+static void
+forNormalFloats(uint32_t stride, F f) {
+    const uint32_t last = floatBits(std::numeric_limits<float>::max());
+    for (uint32_t bits = floatBits(std::numeric_limits<float>::min()); bits < last; bits += stride) {
+        f(bitsFloat(bits));
+    }
+    f(bitsFloat(last));
+}
+
+static bool
+testRsqrt() {
+    double worst = 0;
+    float worstX = 0;
+    forNormalFloats(97, [&](float x) {
+        double exact = 1 / std::sqrt((double) x);
+        double error = std::abs(FastRsqrt(x) - exact) / exact;
+        if (error > worst) {
+            worst = error;
+            worstX = x;
+        }
+    });
+    bool passed = report("FastRsqrt", worst, worstX, 5e-6);
+    if (!std::isinf(FastRsqrt(0.0f))) {
+        std::printf("FastRsqrt  of 0 is not infinite FAILED\n");
+        passed = false;
+    }
+    return passed;
+}
+
+static bool
+testExp2() {
+    double worst = 0;
+    float worstX = 0;
+    // every float of [-126, 126] whose spacing is at least 2^-20, the denser ones near 0 in the same steps
+    for (int32_t k = -126 * (1 << 20); k <= 126 * (1 << 20); ++k) {
+        float x = std::ldexp((float) k, -20);
+        double exact = std::exp2((double) x);
+        double error = std::abs(FastExp2(x) - exact) / exact;
+        if (error > worst) {
+            worst = error;
+            worstX = x;
+        }
+    }
+    return report("FastExp2", worst, worstX, 2e-7);
+}
+
+static bool
+testLog2() {
+    double worst = 0;
+    float worstX = 0;
+    forNormalFloats(97, [&](float x) {
+        double error = std::abs(FastLog2(x) - std::log2((double) x));
+        if (error > worst) {
+            worst = error;
+            worstX = x;
+        }
+    });
+    return report("FastLog2", worst, worstX, 4e-6);
+}
+
+static bool
+testPow() {
+    double worst = 0;
+    float worstX = 0;
+    // 0, every 4099th float of (0, 1] and 1, each with 81 exponents spread over [0, 2000]
+    const uint32_t one = floatBits(1.0f);
+    for (uint32_t bits = 0; bits <= one + 4098; bits += 4099) {
+        float x = bitsFloat(std::min(bits, one));
+        for (int j = 0; j <= 80; ++j) {
+            float y = j * 25.0f;
+            double error = std::abs(FastPow(x, y) - std::pow((double) x, (double) y));
+            if (error > worst) {
+                worst = error;
+                worstX = x;
+            }
+        }
+    }
+    return report("FastPow", worst, worstX, 1e-6);
+}
+
+int
+main() {
+    bool passed = testRsqrt();
+    passed = testExp2() && passed;
+    passed = testLog2() && passed;
+    passed = testPow() && passed;
+    return passed ? 0 : 1;
+}
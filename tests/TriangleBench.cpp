@@ -0,0 +1,205 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+#include "Mesh.h"
+#include "mygeometry.h"
+
+// Compares the watertight test of Triangle, with the ray shear set up per ray as Group does and per call, with the
+// Moller-Trumbore test it replaced: agreement and time per call on random rays and triangles, and how many rays
+// aimed exactly at the shared edges and vertices of a triangle grid hit none of its triangles, as Triangles and as a
+// CompactMesh. Returns non-zero when the two ways of shearing disagree or a watertight test loses a ray at the edges.
+
+struct Vertices {
+    Point p0, p1, p2;
+};
+
+static Point
+cross(const Point &a, const Point &b) {
+    return Point(a[1] * b[2] - a[2] * b[1], a[2] * b[0] - a[0] * b[2], a[0] * b[1] - a[1] * b[0]);
+}
+
+// the test Triangle used before the watertight one
+static bool
+mollerTrumbore(const Vertices &v, const Point &beamPoint, const Point &direction, Real &t0) {
+    Point e1 = v.p1 - v.p0, e2 = v.p2 - v.p0;
+    Point v1 = cross(direction, e2);
+    Real d = e1 * v1;
+    if (std::abs(d) < EPS) {
+        return false;
+    }
+    Point v2 = beamPoint - v.p0;
+    Real u = v2 * v1;
+    if (u < 0 || u > d) {
+        return false;
+    }
+    Point v3 = cross(v2, e1);
+    Real w = direction * v3;
+    if (w < 0 || u + w > d) {
+        return false;
+    }
+    t0 = e2 * v3 * (1.0 / d);
+    return true;
+}
+
+struct Ray {
+    Point orig, dir;
+    RayShear shear;
+};
+
+// nanoseconds per test, the best of three runs over every ray and triangle, rays outermost as in a BVH leaf
+template<typename Test>
+static double
+timeTest(const std::vector<Ray> &rays, size_t triangles, Test test, size_t &hits) {
+    double best = INFINITY;
+    for (int run = 0; run < 3; ++run) {
+        hits = 0;
+        auto started = std::chrono::steady_clock::now();
+        for (const Ray &ray : rays) {
+            for (size_t i = 0; i < triangles; ++i) {
+                Real t0;
+                hits += test(i, ray, t0);
+            }
+        }
+        std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - started;
+        best = std::min(best, elapsed.count() / ((double) rays.size() * triangles));
+    }
+    return best;
+}
+
+static bool
+benchmarkRandom() {
+    std::mt19937 random(1);
+    std::uniform_real_distribution<Real> unit(-1, 1);
+    const size_t count = 2000;
+    std::vector<Vertices> vertices;
+    std::vector<Triangle> triangles;
+    for (size_t i = 0; i < count; ++i) {
+        Point centre(unit(random), unit(random), unit(random));
+        Vertices v = {centre + Point(unit(random), unit(random), unit(random)) * 0.3,
+                      centre + Point(unit(random), unit(random), unit(random)) * 0.3,
+                      centre + Point(unit(random), unit(random), unit(random)) * 0.3};
+        vertices.push_back(v);
+        triangles.emplace_back(v.p0, v.p1, v.p2);
+    }
+    std::vector<Ray> rays;
+    for (size_t i = 0; i < count; ++i) {
+        Point orig = Point(unit(random), unit(random), unit(random)).normalized() * 4;
+        Point target(unit(random), unit(random), unit(random));
+        Point dir = (target - orig).normalized();
+        rays.push_back({orig, dir, RayShear(dir)});
+    }
+
+    size_t mismatches = 0, oldMismatches = 0;
+    for (const Ray &ray : rays) {
+        for (size_t i = 0; i < count; ++i) {
+            Real tRay = 0, tCall = 0, tOld = 0;
+            bool hitRay = triangles[i].areIntersected(ray.orig, ray.dir, ray.shear, tRay);
+            bool hitCall = triangles[i].areIntersected(ray.orig, ray.dir, tCall);
+            bool hitOld = mollerTrumbore(vertices[i], ray.orig, ray.dir, tOld);
+            mismatches += hitRay != hitCall || (hitRay && tRay != tCall);
+            oldMismatches += hitRay != hitOld || (hitRay && hitOld && std::abs(tRay - tOld) > 1e-4);
+        }
+    }
+
+    size_t hitsOld, hitsCall, hitsRay;
+    double old = timeTest(rays, count, [&](size_t i, const Ray &ray, Real &t0) {
+        return mollerTrumbore(vertices[i], ray.orig, ray.dir, t0);
+    }, hitsOld);
+    double perCall = timeTest(rays, count, [&](size_t i, const Ray &ray, Real &t0) {
+        return triangles[i].areIntersected(ray.orig, ray.dir, t0);
+    }, hitsCall);
+    double perRay = timeTest(rays, count, [&](size_t i, const Ray &ray, Real &t0) {
+        return triangles[i].areIntersected(ray.orig, ray.dir, ray.shear, t0);
+    }, hitsRay);
+    std::printf("%zu rays x %zu triangles\n", rays.size(), count);
+    std::printf("  Moller-Trumbore                %.2f ns per test, %zu hits, %zu results differ\n", old, hitsOld,
+                oldMismatches);
+    std::printf("  watertight, shear per call     %.2f ns per test, %zu hits\n", perCall, hitsCall);
+    std::printf("  watertight, shear per ray      %.2f ns per test, %zu hits, %zu results differ from per call\n",
+                perRay, hitsRay, mismatches);
+    return mismatches == 0;
+}
+
+// Rays at random points of the shared edges, diagonals and vertices of a size x size grid of quads in z = 0, each
+// split into two triangles facing +z, coming from random directions above it.
+static bool
+edgeLoss() {
+    const int size = 64;
+    std::vector<Vertices> vertices;
+    for (int j = 0; j < size; ++j) {
+        for (int i = 0; i < size; ++i) {
+            Point a(i, j, 0), b(i + 1, j, 0), c(i + 1, j + 1, 0), d(i, j + 1, 0);
+            vertices.push_back({a, b, c});
+            vertices.push_back({a, c, d});
+        }
+    }
+    std::vector<Triangle> triangles;
+    MeshData grid;
+    for (const Vertices &v : vertices) {
+        triangles.emplace_back(v.p0, v.p1, v.p2);
+        for (const Point &p : {v.p0, v.p1, v.p2}) {
+            grid.indices.push_back((unsigned int) grid.positions.size());
+            grid.positions.push_back(p);
+        }
+    }
+    grid.computeNormals();
+    // the grid points are on the quantization grid, so the mesh has the very same triangles
+    CompactMesh mesh(grid, Material());
+
+    std::mt19937 random(2);
+    std::uniform_int_distribution<int> cell(1, size - 2), kind(0, 3);
+    std::uniform_real_distribution<Real> along(0, 1), unit(-1, 1);
+    const int raysCount = 200000;
+    int lostOld = 0, lostNew = 0, lostMesh = 0;
+    for (int r = 0; r < raysCount; ++r) {
+        int i = cell(random), j = cell(random);
+        Real s = along(random);
+        Point target;
+        switch (kind(random)) {
+            case 0:
+                target = Point(i + s, j, 0);
+                break;
+            case 1:
+                target = Point(i, j + s, 0);
+                break;
+            case 2:
+                target = Point(i + s, j + s, 0);
+                break;
+            default:
+                target = Point(i, j, 0);
+        }
+        Point dir(unit(random), unit(random), -1);
+        dir = dir.normalized();
+        Point orig = target - dir * 10;
+        bool hitOld = false, hitNew = false;
+        // only the quads around the target can be hit
+        for (int y = j - 1; y <= j + 1; ++y) {
+            for (int x = i - 1; x <= i + 1; ++x) {
+                for (int k = 0; k < 2; ++k) {
+                    size_t t = 2 * ((size_t) y * size + x) + k;
+                    Real t0;
+                    hitOld = mollerTrumbore(vertices[t], orig, dir, t0) || hitOld;
+                    hitNew = triangles[t].areIntersected(orig, dir, t0) || hitNew;
+                }
+            }
+        }
+        Hit hit;
+        lostOld += !hitOld;
+        lostNew += !hitNew;
+        lostMesh += !mesh.intersect(orig, dir, hit);
+    }
+    std::printf("%d rays at the edges of a %dx%d grid: %d missed every triangle with Moller-Trumbore (%.1f%%), "
+                "%d with the watertight test, %d the CompactMesh\n", raysCount, size, size, lostOld,
+                100.0 * lostOld / raysCount, lostNew, lostMesh);
+    return lostNew == 0 && lostMesh == 0;
+}
+
+int
+main() {
+    bool passed = benchmarkRandom();
+    passed = edgeLoss() && passed;
+    return passed ? 0 : 1;
+}